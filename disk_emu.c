@@ -1,38 +1,215 @@
 #include <stdio.h>
-#include <stdlib.h> 
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 #include "disk_emu.h"
+#include "sfs_crc32c.h"
 
 
-FILE* fp = NULL;
 double L, p;
 double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
+int MAX_RETRY;
+
+/*-------------------------------------------------------------------*/
+/*One open disk file. Several can be open at once, the old global    */
+/*functions at the bottom all work on default_disk.                  */
+/*-------------------------------------------------------------------*/
+struct disk_t
+{
+    FILE* fp;
+    int BLOCK_SIZE, MAX_BLOCK;
+
+    /*One CRC-32C per block, kept in memory and stored in a checksum    */
+    /*area right after the last block. NULL when the disk file has no   */
+    /*such area (verifying is then skipped).                            */
+    uint32_t* checksums;
+
+    /*Block I/O goes through pread/pwrite on the file's descriptor,     */
+    /*which don't share a file position, so threads can read and write  */
+    /*at the same time. Only the checksum blocks need a lock (several   */
+    /*blocks share one).                                                */
+    pthread_mutex_t checksum_lock;
+
+    /*Only ever changed with atomic adds*/
+    disk_stats stats;
+
+    /*Block I/O trace, trace is NULL when none runs. tracing is read     */
+    /*without the lock, so calls on an untraced disk never take it.      */
+    FILE* trace;
+    int tracing;
+    uint64_t trace_start;
+    pthread_mutex_t trace_lock;
+    int data_first, data_end;
+};
+
+static disk_t* default_disk = NULL;
+
+static void count(uint64_t* counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static uint64_t now_ns()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*---------------------------------------------------------------*/
+/*Appends a call to the trace, if one is running                 */
+/*---------------------------------------------------------------*/
+static void trace_call(disk_t* disk, int op, int start_address, int nblocks)
+{
+    disk_trace_record rec;
+
+    if (!__atomic_load_n(&disk->tracing, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    rec.op = op;
+    rec.kind = start_address >= disk->data_first
+               && start_address < disk->data_end
+        ? DISK_TRACE_DATA
+        : DISK_TRACE_META;
+
+    /*The time is taken under the lock, so records are in time order*/
+    pthread_mutex_lock(&disk->trace_lock);
+    if (disk->trace != NULL)
+    {
+        rec.ns = now_ns() - disk->trace_start;
+        do
+        {
+            rec.address = start_address;
+            rec.nblocks = nblocks > UINT16_MAX ? UINT16_MAX : nblocks;
+            fwrite(&rec, sizeof(rec), 1, disk->trace);
+            start_address += rec.nblocks;
+            nblocks -= rec.nblocks;
+        } while (nblocks > 0);
+    }
+    pthread_mutex_unlock(&disk->trace_lock);
+}
+
+/*---------------------------------------------------------------*/
+/*Writes the checksum blocks that cover blocks first..last       */
+/*---------------------------------------------------------------*/
+static void write_checksums(disk_t* disk, int first, int last)
+{
+    int per_block = disk->BLOCK_SIZE / sizeof(uint32_t);
+    int from = first / per_block;
+    int to = last / per_block;
+    int i;
+
+    for (i = from; i <= to; i++)
+    {
+        int n = disk->MAX_BLOCK - i * per_block;
+        if (n > per_block)
+        {
+            n = per_block;
+        }
+
+        /*The in-memory array isn't padded, so the last block may be short*/
+        pwrite(fileno(disk->fp), disk->checksums + i * per_block,
+               n * sizeof(uint32_t),
+               (off_t)(disk->MAX_BLOCK + i) * disk->BLOCK_SIZE);
+    }
+    count(&disk->stats.checksum_blocks_written, to - from + 1);
+}
+
+/*---------------------------------------------------------------*/
+/*Sets up the in-memory checksums, from the disk file if it has  */
+/*a checksum area or as the checksum of a zeroed block otherwise */
+/*---------------------------------------------------------------*/
+static int init_checksums(disk_t* disk, int fresh)
+{
+    long expected_len;
+    int i;
+
+    disk->checksums = (uint32_t*) malloc(disk->MAX_BLOCK * sizeof(uint32_t));
+
+    if (fresh)
+    {
+        void* zeros = calloc(1, disk->BLOCK_SIZE);
+        uint32_t zero_crc = crc32c(0, zeros, disk->BLOCK_SIZE);
+
+        free(zeros);
+        for (i = 0; i < disk->MAX_BLOCK; i++)
+        {
+            disk->checksums[i] = zero_crc;
+        }
+        write_checksums(disk, 0, disk->MAX_BLOCK - 1);
+        return 0;
+    }
+
+    /*Older disk files stop at the last block*/
+    expected_len = (long)disk->MAX_BLOCK * disk->BLOCK_SIZE
+        + disk->MAX_BLOCK * sizeof(uint32_t);
+    fseek(disk->fp, 0, SEEK_END);
+    if (ftell(disk->fp) < expected_len)
+    {
+        free(disk->checksums);
+        disk->checksums = NULL;
+        return 0;
+    }
+
+    fseek(disk->fp, (long)disk->MAX_BLOCK * disk->BLOCK_SIZE, SEEK_SET);
+    if (fread(disk->checksums, sizeof(uint32_t), disk->MAX_BLOCK, disk->fp)
+        != disk->MAX_BLOCK)
+    {
+        free(disk->checksums);
+        disk->checksums = NULL;
+    }
+    return 0;
+}
+
+static disk_t* new_disk(FILE* fp, int block_size, int num_blocks)
+{
+    disk_t* disk = (disk_t*) calloc(1, sizeof(disk_t));
+
+    disk->fp = fp;
+    disk->BLOCK_SIZE = block_size;
+    disk->MAX_BLOCK = num_blocks;
+    pthread_mutex_init(&disk->checksum_lock, NULL);
+    pthread_mutex_init(&disk->trace_lock, NULL);
+    return disk;
+}
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
-int close_disk()
+int close_disk_r(disk_t* disk)
 {
-    if(NULL != fp)
+    if (NULL == disk)
     {
-        fclose(fp);
+        return 0;
     }
+    stop_disk_trace_r(disk);
+    if(NULL != disk->fp)
+    {
+        fclose(disk->fp);
+    }
+    free(disk->checksums);
+    pthread_mutex_destroy(&disk->checksum_lock);
+    pthread_mutex_destroy(&disk->trace_lock);
+    free(disk);
     return 0;
 }
 
 /*---------------------------------------*/
 /*Initializes a disk file filled with 0's*/
 /*---------------------------------------*/
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
+disk_t* init_fresh_disk_r(char *filename, int block_size, int num_blocks)
 {
-    int i, j;
+    int i;
+    FILE* fp;
+    disk_t* disk;
+    void* zeros;
 
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
     /*Creates a new file*/
@@ -41,103 +218,241 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
     if (fp == NULL)
     {
         printf("Could not create new disk file %s\n\n", filename);
-        return -1;
+        return NULL;
     }
-    
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+
+    /*Fills the file with 0's to its given size, a block at a time*/
+    zeros = calloc(1, block_size);
+    for (i = 0; i < num_blocks; i++)
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
+        fwrite(zeros, block_size, 1, fp);
     }
-    return 0;
+    free(zeros);
+    fflush(fp);
+
+    disk = new_disk(fp, block_size, num_blocks);
+    init_checksums(disk, 1);
+    return disk;
 }
 /*----------------------------*/
 /*Initializes an existing disk*/
 /*----------------------------*/
-int init_disk(char *filename, int block_size, int num_blocks)
+disk_t* init_disk_r(char *filename, int block_size, int num_blocks)
 {
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
-    
+    FILE* fp;
+    disk_t* disk;
+
     /*Opens a file*/
     fp = fopen (filename, "r+b");
 
     if (fp == NULL)
     {
         printf("Could not open %s\n\n", filename);
-        return -1;
+        return NULL;
     }
-    return 0;
+
+    disk = new_disk(fp, block_size, num_blocks);
+    init_checksums(disk, 0);
+    return disk;
 }
 
 /*-------------------------------------------------------------------*/
 /*Reads a series of blocks from the disk into the buffer             */
 /*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
+int read_blocks_r(disk_t* disk, int start_address, int nblocks, void *buffer)
 {
-    int i, s;
+    int i, s, corrupt;
+    int BLOCK_SIZE = disk->BLOCK_SIZE;
     s = 0;
-
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
+    corrupt = 0;
 
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address + nblocks > disk->MAX_BLOCK)
     {
         printf("out of bound error %d\n", start_address);
         return -1;
     }
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    trace_call(disk, DISK_TRACE_READ, start_address, nblocks);
+    uint64_t start = now_ns();
+
+    /*The whole run in one call, straight into the caller's buffer*/
+    pread(fileno(disk->fp), buffer, (size_t)nblocks * BLOCK_SIZE,
+          (off_t)start_address * BLOCK_SIZE);
 
     /*For every block requested*/
     for (i = 0; i < nblocks; ++i)
     {
         s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+
+        /*Catches torn or corrupted blocks before anyone uses them*/
+        if (disk->checksums != NULL
+            && crc32c(0, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE)
+               != disk->checksums[start_address + i])
+        {
+            printf("checksum error in block %d\n", start_address + i);
+            corrupt = 1;
+            count(&disk->stats.checksum_errors, 1);
+        }
     }
 
-    free(blockRead);
-    return s;
+    count(&disk->stats.reads, 1);
+    count(&disk->stats.blocks_read, nblocks);
+    count(&disk->stats.read_ns, now_ns() - start);
+    return corrupt ? -1 : s;
 }
 
 /*------------------------------------------------------------------*/
 /*Writes a series of blocks to the disk from the buffer             */
 /*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
+int write_blocks_r(disk_t* disk, int start_address, int nblocks, void *buffer)
 {
     int i, s;
+    int BLOCK_SIZE = disk->BLOCK_SIZE;
     s = 0;
 
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (start_address + nblocks > disk->MAX_BLOCK)
     {
         printf("out of bound error\n");
         return -1;
     }
 
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    trace_call(disk, DISK_TRACE_WRITE, start_address, nblocks);
+    uint64_t start = now_ns();
 
-    /*For every block requested*/        
+    /*For every block requested*/
     for (i = 0; i < nblocks; ++i)
     {
         /*Pause until the latency duration is elapsed*/
         usleep(L);
+        s++;
+    }
 
-        memcpy(blockWrite, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
+    /*The whole run in one call, straight from the caller's buffer*/
+    pwrite(fileno(disk->fp), buffer, (size_t)nblocks * BLOCK_SIZE,
+           (off_t)start_address * BLOCK_SIZE);
 
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
+    /*The data goes first, so a torn write shows up as a mismatch*/
+    if (disk->checksums != NULL && nblocks > 0)
+    {
+        pthread_mutex_lock(&disk->checksum_lock);
+        for (i = 0; i < nblocks; ++i)
+        {
+            disk->checksums[start_address + i] =
+                crc32c(0, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
+        }
+        write_checksums(disk, start_address, start_address + nblocks - 1);
+        pthread_mutex_unlock(&disk->checksum_lock);
     }
-    free(blockWrite);
+
+    count(&disk->stats.writes, 1);
+    count(&disk->stats.blocks_written, nblocks);
+    count(&disk->stats.write_ns, now_ns() - start);
     return s;
 }
+
+/*------------------------------------------------------------------*/
+/*Copies the counters out, each one read atomically                 */
+/*------------------------------------------------------------------*/
+void get_disk_stats_r(disk_t* disk, disk_stats* stats)
+{
+    uint64_t* from = (uint64_t*)&disk->stats;
+    uint64_t* to = (uint64_t*)stats;
+    size_t i;
+
+    for (i = 0; i < sizeof(disk_stats) / sizeof(uint64_t); i++)
+    {
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*Starts writing a record of every call to path                     */
+/*------------------------------------------------------------------*/
+int start_disk_trace_r(disk_t* disk, const char* path)
+{
+    disk_trace_header header;
+    struct timespec now;
+    FILE* trace;
+
+    stop_disk_trace_r(disk);
+
+    trace = fopen(path, "wb");
+    if (trace == NULL)
+    {
+        printf("Could not create trace file %s\n", path);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    memset(&header, 0, sizeof(header));
+    header.magic = DISK_TRACE_MAGIC;
+    header.version = DISK_TRACE_VERSION;
+    header.block_size = disk->BLOCK_SIZE;
+    header.num_blocks = disk->MAX_BLOCK;
+    header.start_unix_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    fwrite(&header, sizeof(header), 1, trace);
+
+    pthread_mutex_lock(&disk->trace_lock);
+    disk->trace = trace;
+    disk->trace_start = now_ns();
+    __atomic_store_n(&disk->tracing, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&disk->trace_lock);
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Flushes and closes the trace, if one is running                   */
+/*------------------------------------------------------------------*/
+void stop_disk_trace_r(disk_t* disk)
+{
+    pthread_mutex_lock(&disk->trace_lock);
+    __atomic_store_n(&disk->tracing, 0, __ATOMIC_RELEASE);
+    if (disk->trace != NULL)
+    {
+        fclose(disk->trace);
+        disk->trace = NULL;
+    }
+    pthread_mutex_unlock(&disk->trace_lock);
+}
+
+void set_disk_data_area_r(disk_t* disk, int first, int count)
+{
+    disk->data_first = first;
+    disk->data_end = first + count;
+}
+
+/*------------------------------------------------------------------*/
+/*The original single-disk interface, on top of default_disk         */
+/*------------------------------------------------------------------*/
+int close_disk()
+{
+    close_disk_r(default_disk);
+    default_disk = NULL;
+    return 0;
+}
+
+int init_fresh_disk(char *filename, int block_size, int num_blocks)
+{
+    close_disk();
+    default_disk = init_fresh_disk_r(filename, block_size, num_blocks);
+    return default_disk == NULL ? -1 : 0;
+}
+
+int init_disk(char *filename, int block_size, int num_blocks)
+{
+    close_disk();
+    default_disk = init_disk_r(filename, block_size, num_blocks);
+    return default_disk == NULL ? -1 : 0;
+}
+
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    return read_blocks_r(default_disk, start_address, nblocks, buffer);
+}
+
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    return write_blocks_r(default_disk, start_address, nblocks, buffer);
+}
@@ -1,5 +1,72 @@
+#ifndef DISK_EMU_H
+#define DISK_EMU_H
+
+#include <stdint.h>
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
 int close_disk();
+
+/*Same as above, but for any number of disk files open at the same time*/
+typedef struct disk_t disk_t;
+
+disk_t* init_fresh_disk_r(char *filename, int block_size, int num_blocks);
+disk_t* init_disk_r(char *filename, int block_size, int num_blocks);
+int read_blocks_r(disk_t* disk, int start_address, int nblocks, void *buffer);
+int write_blocks_r(disk_t* disk, int start_address, int nblocks, void *buffer);
+int close_disk_r(disk_t* disk);
+
+/*Counters since the disk was opened. Checksum blocks are the disk's own*/
+/*bookkeeping, written on top of the blocks asked for.                 */
+typedef struct
+{
+    uint64_t reads, writes;          /*read_blocks/write_blocks calls*/
+    uint64_t blocks_read, blocks_written;
+    uint64_t checksum_blocks_written;
+    uint64_t checksum_errors;
+    uint64_t read_ns, write_ns;      /*time spent in those calls*/
+} disk_stats;
+
+void get_disk_stats_r(disk_t* disk, disk_stats* stats);
+
+/*-------------------------------------------------------------------*/
+/*Block I/O trace. While one runs, every read_blocks/write_blocks call*/
+/*appends a record to the trace file, which starts with a header.    */
+/*Both are in the host's byte order, sfs_replay plays them back.     */
+/*-------------------------------------------------------------------*/
+#define DISK_TRACE_MAGIC 0x54534653 /*"SFST" read little-endian*/
+#define DISK_TRACE_VERSION 1
+
+typedef struct
+{
+    uint32_t magic, version;
+    uint32_t block_size, num_blocks; /*of the traced disk*/
+    uint64_t start_unix_ns;          /*wall clock when the trace started*/
+} disk_trace_header;
+
+#define DISK_TRACE_READ 0
+#define DISK_TRACE_WRITE 1
+
+#define DISK_TRACE_META 0
+#define DISK_TRACE_DATA 1
+
+typedef struct
+{
+    uint64_t ns;      /*when the call was made, since the trace started*/
+    uint32_t address;
+    uint16_t nblocks; /*longer calls take several records*/
+    uint8_t op;       /*DISK_TRACE_READ or DISK_TRACE_WRITE*/
+    uint8_t kind;     /*DISK_TRACE_DATA if address is in the data area*/
+} disk_trace_record;
+
+/*Starts a trace at path (replacing any running one), -1 if the file */
+/*can't be created. close_disk_r stops it.                           */
+int start_disk_trace_r(disk_t* disk, const char* path);
+void stop_disk_trace_r(disk_t* disk);
+
+/*Blocks first..first+count-1 hold file data, the rest is metadata*/
+void set_disk_data_area_r(disk_t* disk, int first, int count);
+
+#endif
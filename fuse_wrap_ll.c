@@ -0,0 +1,575 @@
+#define FUSE_USE_VERSION 30
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include "disk_emu.h"
+#include "sfs_api.h"
+
+#define DISK "fs.sfs"
+
+/*-------------------------------------------------------------------*/
+/*Low-level wrapper: the kernel names files by i-node number, so only */
+/*lookup and create ever look at a name. The root directory is FUSE's */
+/*i-node 1 and sfs' i-node 0, so every number is off by one.          */
+/*Names are stored with a leading '/' like the path-based wrappers do,*/
+/*so images can be mounted with any of them.                          */
+/*                                                                    */
+/*sfs reuses a removed file's i-node for the next file created, so    */
+/*each i-node has a generation, bumped when its file is removed, in   */
+/*the bits above the i-node number. A number the kernel kept from     */
+/*before the remove then names nothing instead of the new file.       */
+/*-------------------------------------------------------------------*/
+#define INODE_BITS 8 /*sfs has 200 i-nodes*/
+#define FUSE_INO(nth_inode) \
+    ((((fuse_ino_t)generation[nth_inode] << INODE_BITS) | (nth_inode)) + 1)
+#define SFS_INODE(ino) ((int)(((ino) - 1) & ((1 << INODE_BITS) - 1)))
+#define GENERATION(ino) (((ino) - 1) >> INODE_BITS)
+
+/*Nothing but this mount changes the image, and the kernel updates its*/
+/*caches on everything done through it, so they can be kept a while  */
+#define ENTRY_TIMEOUT 10.0
+#define ATTR_TIMEOUT 10.0
+
+/*.sfs_stats in the root: read-only, holds what sfs_format_stats prints,*/
+/*formatted afresh on every read (direct_io, and its attributes are   */
+/*never cached, since they change all the time). Its number is past   */
+/*any sfs file's (that takes 2^24 removes from one i-node). readdir   */
+/*doesn't list it.                                                    */
+#define STATS_NAME ".sfs_stats"
+#define STATS_INO ((fuse_ino_t)1 << 32)
+
+static sfs_t *fs;
+static struct fuse_chan *ch; /*for telling the kernel to drop its caches*/
+static unsigned long generation[1 << INODE_BITS];
+
+/*0 if ino names a file that still exists, the error to reply otherwise*/
+static int check_ino(fuse_ino_t ino)
+{
+    if (ino == FUSE_ROOT_ID || ino == STATS_INO)
+        return 0;
+    if (GENERATION(ino) != generation[SFS_INODE(ino)])
+        return ESTALE;
+    if (sfs_inode_size_r(fs, SFS_INODE(ino)) == -1)
+        return ENOENT;
+
+    return 0;
+}
+
+/*The stats text in a buffer the caller frees, NULL if out of memory*/
+static char *stats_text(int *len)
+{
+    sfs_stats stats;
+    char *text;
+
+    sfs_get_stats_r(fs, &stats);
+    *len = sfs_format_stats(&stats, NULL, 0);
+    text = malloc(*len + 1);
+    if (text != NULL)
+        sfs_format_stats(&stats, text, *len + 1);
+    return text;
+}
+
+static void file_stat(fuse_ino_t ino, unsigned int size, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = ino;
+    stbuf->st_mode = S_IFREG | 0666;
+    stbuf->st_nlink = 1;
+    stbuf->st_size = size;
+}
+
+static int fill_stat(fuse_ino_t ino, struct stat *stbuf)
+{
+    int size;
+
+    if (ino == FUSE_ROOT_ID) {
+        memset(stbuf, 0, sizeof(struct stat));
+        stbuf->st_ino = ino;
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+    } else if (ino == STATS_INO) {
+        free(stats_text(&size));
+        file_stat(ino, size, stbuf);
+        stbuf->st_mode = S_IFREG | 0444;
+    } else if (check_ino(ino) == 0
+               && (size = sfs_inode_size_r(fs, SFS_INODE(ino))) != -1)
+        file_stat(ino, size, stbuf);
+    else
+        return -1;
+
+    return 0;
+}
+
+/*'/' + name, -1 if that doesn't fit in a file name*/
+static int sfs_name(const char *name, char *filename)
+{
+    if (strlen(name) + 1 > MAXFILENAME)
+        return -1;
+
+    filename[0] = '/';
+    strcpy(&filename[1], name);
+    return 0;
+}
+
+static int fill_entry(int nth_inode, struct fuse_entry_param *e)
+{
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    e->ino = FUSE_INO(nth_inode);
+    e->generation = generation[nth_inode];
+    e->attr_timeout = ATTR_TIMEOUT;
+    e->entry_timeout = ENTRY_TIMEOUT;
+
+    return fill_stat(e->ino, &e->attr);
+}
+
+/*Same negotiation as fuse_init in fuse_wrap_new.c, plus readdirplus*/
+#define MAX_WRITE (128 * 1024)
+#define MAX_READAHEAD (512 * 1024)
+
+static void fuse_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    if (conn->capable & FUSE_CAP_BIG_WRITES)
+        conn->want |= FUSE_CAP_BIG_WRITES;
+    if (conn->capable & FUSE_CAP_ASYNC_READ)
+        conn->want |= FUSE_CAP_ASYNC_READ;
+#ifdef FUSE_CAP_READDIRPLUS
+    if (conn->capable & FUSE_CAP_READDIRPLUS)
+        conn->want |= FUSE_CAP_READDIRPLUS;
+#endif
+    conn->async_read = 1;
+    conn->max_write = MAX_WRITE;
+    conn->max_readahead = MAX_READAHEAD;
+}
+
+static void fuse_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+    char filename[MAXFILENAME + 1];
+    int nth_inode;
+
+    if (parent == FUSE_ROOT_ID && strcmp(name, STATS_NAME) == 0) {
+        memset(&e, 0, sizeof(struct fuse_entry_param));
+        e.ino = STATS_INO;
+        e.entry_timeout = ENTRY_TIMEOUT;
+        fill_stat(e.ino, &e.attr);
+        fuse_reply_entry(req, &e);
+        return;
+    }
+
+    if (parent != FUSE_ROOT_ID || sfs_name(name, filename) == -1
+        || (nth_inode = sfs_lookup_r(fs, filename)) == -1
+        || fill_entry(nth_inode, &e) == -1) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    fuse_reply_entry(req, &e);
+}
+
+static void fuse_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    struct stat stbuf;
+    int err = check_ino(ino);
+
+    if (err != 0 || fill_stat(ino, &stbuf) == -1)
+        fuse_reply_err(req, err != 0 ? err : ENOENT);
+    else
+        fuse_reply_attr(req, &stbuf, ino == STATS_INO ? 0 : ATTR_TIMEOUT);
+}
+
+static void fuse_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+        int to_set, struct fuse_file_info *fi)
+{
+    struct stat stbuf;
+    int err = check_ino(ino);
+
+    if (err != 0 || fill_stat(ino, &stbuf) == -1) {
+        fuse_reply_err(req, err != 0 ? err : ENOENT);
+        return;
+    }
+
+    /*sfs files can only be emptied, and modes and times aren't kept*/
+    if ((to_set & FUSE_SET_ATTR_SIZE) && attr->st_size != stbuf.st_size) {
+        if (ino == STATS_INO) {
+            fuse_reply_err(req, EACCES);
+            return;
+        }
+        if (ino == FUSE_ROOT_ID || attr->st_size != 0) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        sfs_empty_inode_r(fs, SFS_INODE(ino));
+        stbuf.st_size = 0;
+    }
+
+    fuse_reply_attr(req, &stbuf, ATTR_TIMEOUT);
+}
+
+/*Offsets: 0 is ".", 1 is "..", past that they're sfs_readdir cookies + 2,*/
+/*so a listing carries on where it stopped whatever happened in between. */
+/*With plus, every entry comes with its attributes, so the kernel doesn't */
+/*have to look each one up afterwards (ls -l is one request per batch).  */
+/*libfuse older than 2.9 has no readdirplus, there it's never asked for. */
+static void list_dir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+        int plus)
+{
+    struct fuse_entry_param e;
+    sfs_dirent entry;
+    const char *name;
+    size_t len = 0, entry_len;
+    off_t next;
+    char *buf;
+    int cookie;
+
+    if (ino != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    for (;;) {
+        memset(&e, 0, sizeof(struct fuse_entry_param));
+        if (off < 2) {
+            /*e.ino stays 0, so the kernel doesn't take these as lookups*/
+            name = off == 0 ? "." : "..";
+            fill_stat(FUSE_ROOT_ID, &e.attr);
+            next = off + 1;
+        } else {
+            cookie = sfs_readdir_r(fs, off - 2, &entry);
+            if (cookie == 0)
+                break;
+            name = &entry.name[1];
+            e.ino = FUSE_INO(entry.inode);
+            e.generation = generation[entry.inode];
+            e.attr_timeout = ATTR_TIMEOUT;
+            e.entry_timeout = ENTRY_TIMEOUT;
+            file_stat(e.ino, entry.size, &e.attr);
+            next = cookie + 2;
+        }
+
+#ifdef FUSE_CAP_READDIRPLUS
+        if (plus)
+            entry_len = fuse_add_direntry_plus(req, buf + len, size - len,
+                    name, &e, next);
+        else
+#endif
+            entry_len = fuse_add_direntry(req, buf + len, size - len, name,
+                    &e.attr, next);
+        if (entry_len > size - len)
+            break;
+        len += entry_len;
+        off = next;
+    }
+
+    fuse_reply_buf(req, buf, len);
+    free(buf);
+}
+
+static void fuse_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+        off_t off, struct fuse_file_info *fi)
+{
+    list_dir(req, ino, size, off, 0);
+}
+
+#ifdef FUSE_CAP_READDIRPLUS
+static void fuse_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+        off_t off, struct fuse_file_info *fi)
+{
+    list_dir(req, ino, size, off, 1);
+}
+#endif
+
+static void fuse_ll_open(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    int err = check_ino(ino);
+
+    if (ino == FUSE_ROOT_ID)
+        fuse_reply_err(req, EISDIR);
+    else if (ino == STATS_INO) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+            fuse_reply_err(req, EACCES);
+            return;
+        }
+        fi->direct_io = 1;
+        fuse_reply_open(req, fi);
+    } else if (err != 0)
+        fuse_reply_err(req, err);
+    else
+        fuse_reply_open(req, fi);
+}
+
+static void read_stats(fuse_req_t req, size_t size, off_t off)
+{
+    int len;
+    char *text = stats_text(&len);
+
+    if (text == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    if (off >= len)
+        size = 0;
+    else if (size > len - off)
+        size = len - off;
+    fuse_reply_buf(req, text + off, size);
+    free(text);
+}
+
+static void fuse_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+        off_t off, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec reply = FUSE_BUFVEC_INIT(0);
+    char *buf;
+    int res, err = check_ino(ino);
+
+    if (ino == STATS_INO) {
+        read_stats(req, size, off);
+        return;
+    }
+    if (err != 0) {
+        fuse_reply_err(req, err);
+        return;
+    }
+
+    buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    res = sfs_pread_inode_r(fs, SFS_INODE(ino), buf, size, off);
+    reply.buf[0].mem = buf;
+    reply.buf[0].size = res;
+    fuse_reply_data(req, &reply, 0);
+    free(buf);
+}
+
+static void fuse_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+        size_t size, off_t off, struct fuse_file_info *fi)
+{
+    int res, err = check_ino(ino);
+
+    if (ino == STATS_INO) {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+    if (err != 0) {
+        fuse_reply_err(req, err);
+        return;
+    }
+    if (size > 0 && off >= FILE_CAPACITY) {
+        fuse_reply_err(req, EFBIG);
+        return;
+    }
+
+    /*short of FILE_CAPACITY, writing nothing means the disk is full*/
+    res = sfs_pwrite_inode_r(fs, SFS_INODE(ino), buf, size, off);
+    if (res == 0 && size > 0)
+        fuse_reply_err(req, ENOSPC);
+    else
+        fuse_reply_write(req, res);
+}
+
+/*See write_buf in fuse_wrap_new.c: memory is written from where it is,*/
+/*a spliced pipe is read once straight into the buffer sfs gets        */
+static void fuse_ll_write_buf(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi)
+{
+    size_t size = fuse_buf_size(bufv);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    ssize_t copied;
+
+    if (bufv->count == 1 && !(bufv->buf[0].flags & FUSE_BUF_IS_FD)) {
+        fuse_ll_write(req, ino, (char *)bufv->buf[0].mem + bufv->off, size,
+                off, fi);
+        return;
+    }
+
+    dst.buf[0].mem = malloc(size);
+    if (dst.buf[0].mem == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    copied = fuse_buf_copy(&dst, bufv, 0);
+    if (copied < 0)
+        fuse_reply_err(req, -copied);
+    else
+        fuse_ll_write(req, ino, dst.buf[0].mem, copied, off, fi);
+    free(dst.buf[0].mem);
+}
+
+static void fuse_ll_create(fuse_req_t req, fuse_ino_t parent,
+        const char *name, mode_t mode, struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    char filename[MAXFILENAME + 1];
+    int nth_inode;
+
+    if (parent != FUSE_ROOT_ID) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (strcmp(name, STATS_NAME) == 0) {
+        fuse_reply_err(req, EEXIST);
+        return;
+    }
+    if (sfs_name(name, filename) == -1) {
+        fuse_reply_err(req, ENAMETOOLONG);
+        return;
+    }
+
+    nth_inode = sfs_create_r(fs, filename);
+    if (nth_inode == -1) {
+        fuse_reply_err(req, ENOSPC);
+        return;
+    }
+
+    fill_entry(nth_inode, &e);
+    fuse_reply_create(req, &e, fi);
+}
+
+static void fuse_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    char filename[MAXFILENAME + 1];
+    int nth_inode;
+
+    if (parent == FUSE_ROOT_ID && strcmp(name, STATS_NAME) == 0) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+    if (parent != FUSE_ROOT_ID || sfs_name(name, filename) == -1
+        || (nth_inode = sfs_lookup_r(fs, filename)) == -1
+        || sfs_remove_r(fs, filename) == -1) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    /*what the kernel still holds of it must not reach the next file*/
+    generation[nth_inode]++;
+    fuse_reply_err(req, 0);
+}
+
+static void fuse_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+        struct fuse_file_info *fi)
+{
+    /*writes are buffered, this is where they have to reach the disk*/
+    if (sfs_sync_r(fs) == -1)
+        fuse_reply_err(req, ENOSPC); /*some of them found no room on it*/
+    else
+        fuse_reply_err(req, 0);
+}
+
+/*SFS_IOC_CLONE makes the open file a clone of the one the argument names*/
+/*(see sfs_clone.c). Its attributes and pages are cached for a while, so */
+/*the kernel is told to drop them before the ioctl returns.              */
+static void fuse_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg,
+        struct fuse_file_info *fi, unsigned flags, const void *in_buf,
+        size_t in_bufsz, size_t out_bufsz)
+{
+    const sfs_clone_ioctl *clone = in_buf;
+    char filename[MAXFILENAME + 1];
+    int src;
+    int err;
+
+    if (cmd != SFS_IOC_CLONE) {
+        fuse_reply_err(req, ENOTTY);
+        return;
+    }
+    if (flags & FUSE_IOCTL_COMPAT) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+    if (ino == STATS_INO) {
+        fuse_reply_err(req, EBADF);
+        return;
+    }
+    if ((err = check_ino(ino)) != 0) {
+        fuse_reply_err(req, err);
+        return;
+    }
+    if (in_bufsz < sizeof(sfs_clone_ioctl)
+        || memchr(clone->src, '\0', sizeof(clone->src)) == NULL
+        || sfs_name(clone->src, filename) == -1) {
+        fuse_reply_err(req, ENAMETOOLONG);
+        return;
+    }
+
+    src = sfs_lookup_r(fs, filename);
+    if (src == -1 || sfs_clone_inode_r(fs, src, SFS_INODE(ino)) == -1) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fuse_lowlevel_notify_inval_inode(ch, ino, 0, 0);
+    fuse_reply_ioctl(req, 0, NULL, 0);
+}
+
+static struct fuse_lowlevel_ops ll_oper = {
+    .init = fuse_ll_init,
+    .lookup = fuse_ll_lookup,
+    .getattr = fuse_ll_getattr,
+    .setattr = fuse_ll_setattr,
+    .readdir = fuse_ll_readdir,
+#ifdef FUSE_CAP_READDIRPLUS
+    .readdirplus = fuse_ll_readdirplus,
+#endif
+    .open = fuse_ll_open,
+    .read = fuse_ll_read,
+    .write = fuse_ll_write,
+    .write_buf = fuse_ll_write_buf,
+    .create = fuse_ll_create,
+    .unlink = fuse_ll_unlink,
+    .fsync = fuse_ll_fsync,
+    .ioctl = fuse_ll_ioctl,
+};
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_session *se;
+    char *mountpoint;
+    int multithreaded;
+    int err = -1;
+
+    fs = sfs_mount(DISK, 1);
+    if (fs == NULL)
+        return 1;
+
+    /*requests are handled on several threads, unless -s is given*/
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, NULL) != -1
+        && (ch = fuse_mount(mountpoint, &args)) != NULL) {
+        se = fuse_lowlevel_new(&args, &ll_oper, sizeof(ll_oper), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                if (multithreaded)
+                    err = fuse_session_loop_mt(se);
+                else
+                    err = fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    fuse_opt_free_args(&args);
+    sfs_unmount(fs);
+
+    return err ? 1 : 0;
+}
@@ -11,42 +11,169 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
 
+/*-------------------------------------------------------------------*/
+/*Files open through FUSE. sfs hands out one fd per file, so every    */
+/*FUSE handle on a file shares one of these and the fd is only closed */
+/*when the last one is released. fi->fh is the index of the slot.     */
+/*read/write hold the lock for reading, everything that changes the   */
+/*table (or which fd a name has) holds it for writing.                */
+/*-------------------------------------------------------------------*/
+#define MAX_OPEN_FILES 200
+
+typedef struct
+{
+    char name[MAXFILENAME + 1];
+    int fd;   /*-1 once the file is gone (removed)*/
+    int refs; /*0 if the slot is free*/
+} open_file;
+
+static open_file open_files[MAX_OPEN_FILES];
+static pthread_rwlock_t open_files_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*Finds or opens the file, returns its slot or a negative errno*/
+static int get_open_file(const char *path)
+{
+    int i, fd, free_slot = -1;
+    char filename[MAXFILENAME + 1];
+
+    if (strlen(path) > MAXFILENAME)
+        return -ENAMETOOLONG;
+
+    pthread_rwlock_wrlock(&open_files_lock);
+    for (i = 0; i < MAX_OPEN_FILES; i++) {
+        if (open_files[i].refs > 0 && open_files[i].fd != -1
+            && strcmp(open_files[i].name, path) == 0) {
+            open_files[i].refs++;
+            pthread_rwlock_unlock(&open_files_lock);
+            return i;
+        }
+        if (open_files[i].refs == 0 && free_slot == -1)
+            free_slot = i;
+    }
+    if (free_slot == -1) {
+        pthread_rwlock_unlock(&open_files_lock);
+        return -ENFILE;
+    }
+
+    strcpy(filename, path);
+    fd = sfs_fopen(filename);
+    if (fd == -1) {
+        pthread_rwlock_unlock(&open_files_lock);
+        return -ENFILE;
+    }
+    strcpy(open_files[free_slot].name, path);
+    open_files[free_slot].fd = fd;
+    open_files[free_slot].refs = 1;
+    pthread_rwlock_unlock(&open_files_lock);
+
+    return free_slot;
+}
+
+/*Points the file's open slot at a new fd (-1 if it's gone), the caller*/
+/*holds the lock for writing                                           */
+static void reopen_file(const char *path, int fd)
+{
+    int i;
+
+    for (i = 0; i < MAX_OPEN_FILES; i++) {
+        if (open_files[i].refs > 0 && open_files[i].fd != -1
+            && strcmp(open_files[i].name, path) == 0) {
+            open_files[i].fd = fd;
+            return;
+        }
+    }
+    if (fd != -1)
+        sfs_fclose(fd);
+}
+
+/*-------------------------------------------------------------------*/
+/*/.sfs_stats: read-only, holds what sfs_format_stats prints. The text */
+/*is formatted afresh on every read (direct_io, so the page cache never*/
+/*hands out an old copy). readdir doesn't list it.                     */
+/*-------------------------------------------------------------------*/
+#define STATS_PATH "/.sfs_stats"
+#define STATS_FH MAX_OPEN_FILES /*fi->fh of its handles, not a slot*/
+
+/*Copies what fits in size bytes of the text, from offset, into buf*/
+static int read_stats(char *buf, size_t size, off_t offset)
+{
+    sfs_stats stats;
+    char *text;
+    int len;
+
+    sfs_get_stats(&stats);
+    len = sfs_format_stats(&stats, NULL, 0);
+    text = malloc(len + 1);
+    if (text == NULL)
+        return -ENOMEM;
+    sfs_format_stats(&stats, text, len + 1);
+
+    if (offset >= len)
+        size = 0;
+    else if (size > len - offset)
+        size = len - offset;
+    memcpy(buf, text + offset, size);
+    free(text);
+    return size;
+}
+
 static int fuse_getattr(const char *path, struct stat *stbuf)
 {
     int res = 0;
-    int size;
     
     memset(stbuf, 0, sizeof(struct stat));
     
     if (strcmp(path, "/") == 0) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
-    } else if((size = sfs_getfilesize(path)) != -1) {
+    } else if (strcmp(path, STATS_PATH) == 0) {
+        sfs_stats stats;
+
+        sfs_get_stats(&stats);
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = sfs_format_stats(&stats, NULL, 0);
+    } else if (sfs_lookup(path) != -1) {
         stbuf->st_mode = S_IFREG | 0666;
         stbuf->st_nlink = 1;
-        stbuf->st_size = size;
+        stbuf->st_size = sfs_getfilesize(path);
     } else
         res = -ENOENT;
     
     return res;
 }
 
+/*Offsets: 1 and 2 follow "." and "..", past that they're sfs_readdir */
+/*cookies + 2, so FUSE can stop when its buffer is full and carry on    */
+/*from there on the next call, without a scan from the start each time */
 static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         off_t offset, struct fuse_file_info *fi)
 {
-    char file_name[MAXFILENAME];
+    sfs_dirent entry;
+    struct stat stbuf;
+    int cookie;
     
     if (strcmp(path, "/") != 0)
         return -ENOENT;
     
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+    memset(&stbuf, 0, sizeof(struct stat));
+    stbuf.st_mode = S_IFDIR;
+    if (offset == 0 && filler(buf, ".", &stbuf, 1))
+        return 0;
+    if (offset <= 1 && filler(buf, "..", &stbuf, 2))
+        return 0;
     
-    while(sfs_getnextfilename(file_name)) {
-        filler(buf, &file_name[1], NULL, 0);
+    cookie = offset <= 2 ? SFS_DIR_START : offset - 2;
+    stbuf.st_mode = S_IFREG | 0666;
+    stbuf.st_nlink = 1;
+    while ((cookie = sfs_readdir(cookie, &entry)) != 0) {
+        stbuf.st_size = entry.size;
+        if (filler(buf, &entry.name[1], &stbuf, cookie + 2))
+            break;
     }
     
     return 0;
@@ -55,94 +182,177 @@ static int fuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int fuse_unlink(const char *path)
 {
     int res;
-    char filename[MAXFILENAME];
+    char filename[MAXFILENAME + 1];
+    
+    if (strcmp(path, STATS_PATH) == 0)
+        return -EACCES;
+    if (strlen(path) > MAXFILENAME)
+        return -ENAMETOOLONG;
     
     strcpy(filename, path);
+    pthread_rwlock_wrlock(&open_files_lock);
     res = sfs_remove(filename);
+    if (res != -1)
+        reopen_file(path, -1); /*its fd may go to another file next*/
+    pthread_rwlock_unlock(&open_files_lock);
     if (res == -1)
-        return -errno;
+        return -ENOENT;
     
     return 0;
 }
 
 static int fuse_open(const char *path, struct fuse_file_info *fi)
 {
-    int res;
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
+    int slot;
+
+    if (strcmp(path, STATS_PATH) == 0) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
+        fi->direct_io = 1;
+        fi->fh = STATS_FH;
+        return 0;
+    }
+
+    slot = get_open_file(path);
+    if (slot < 0)
+        return slot;
     
-    res = sfs_fopen(filename);
-    if (res == -1)
-        return -errno;
+    fi->fh = slot;
+    return 0;
+}
+
+static int fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    open_file *f;
+
+    if (fi->fh == STATS_FH)
+        return 0;
+    f = &open_files[fi->fh];
+
+    pthread_rwlock_wrlock(&open_files_lock);
+    if (--f->refs == 0 && f->fd != -1)
+        sfs_fclose(f->fd);
+    pthread_rwlock_unlock(&open_files_lock);
     
-    sfs_fclose(res);
     return 0;
 }
 
 static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
-    int fd;
-    int res;
+    int res = -ENOENT;
+    open_file *f;
     
-    char filename[MAXFILENAME];
+    if (fi->fh == STATS_FH)
+        return read_stats(buf, size, offset);
+    f = &open_files[fi->fh];
     
-    strcpy(filename, path);
+    pthread_rwlock_rdlock(&open_files_lock);
+    if (f->fd != -1)
+        res = sfs_pread(f->fd, buf, size, offset);
+    pthread_rwlock_unlock(&open_files_lock);
     
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
-    
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
-    
-    res = sfs_fread(fd, buf, size);
-    if (res == -1)
-        return -errno;
-    
-    sfs_fclose(fd);
     return res;
 }
 
 static int fuse_write(const char *path, const char *buf, size_t size,
         off_t offset, struct fuse_file_info *fi)
 {
-    int fd;
-    int res;
+    int res = -ENOENT;
+    open_file *f;
     
-    char filename[MAXFILENAME];
+    if (fi->fh == STATS_FH)
+        return -EBADF;
+    f = &open_files[fi->fh];
     
-    strcpy(filename, path);
-    
-    fd = sfs_fopen(filename);
-    if (fd == -1) 
-        return -errno;
-    
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+    pthread_rwlock_rdlock(&open_files_lock);
+    if (f->fd != -1)
+        res = sfs_pwrite(f->fd, buf, size, offset);
+    pthread_rwlock_unlock(&open_files_lock);
     
-    res = sfs_fwrite(fd, buf, size);
-    if (res == -1)
-        return -errno;
-    
-    sfs_fclose(fd);
+    return res;
+}
+
+/*Hands FUSE the buffer sfs read into instead of copying it into one of*/
+/*FUSE's, it frees it once the reply is sent                           */
+static int fuse_read_buf(const char *path, struct fuse_bufvec **bufp,
+        size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *src = malloc(sizeof(struct fuse_bufvec));
+    char *mem = malloc(size);
+    int res;
+
+    if (src == NULL || mem == NULL) {
+        free(src);
+        free(mem);
+        return -ENOMEM;
+    }
+
+    res = fuse_read(path, mem, size, offset, fi);
+    if (res < 0) {
+        free(src);
+        free(mem);
+        return res;
+    }
+
+    *src = FUSE_BUFVEC_INIT(res);
+    src->buf[0].mem = mem;
+    *bufp = src;
+    return 0;
+}
+
+/*Data already in memory is written from where it is, whole blocks of it*/
+/*go to sfs without another copy. Data still in a pipe (when FUSE splices*/
+/*the request) is read out of it once, straight into the buffer sfs gets.*/
+static int fuse_write_buf(const char *path, struct fuse_bufvec *buf,
+        off_t offset, struct fuse_file_info *fi)
+{
+    size_t size = fuse_buf_size(buf);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    ssize_t copied;
+    int res;
+
+    if (buf->count == 1 && !(buf->buf[0].flags & FUSE_BUF_IS_FD))
+        return fuse_write(path, (char *)buf->buf[0].mem + buf->off, size,
+                offset, fi);
+
+    dst.buf[0].mem = malloc(size);
+    if (dst.buf[0].mem == NULL)
+        return -ENOMEM;
+
+    copied = fuse_buf_copy(&dst, buf, 0);
+    if (copied < 0)
+        res = copied;
+    else
+        res = fuse_write(path, dst.buf[0].mem, copied, offset, fi);
+
+    free(dst.buf[0].mem);
     return res;
 }
 
 static int fuse_truncate(const char *path, off_t size)
 {
-    char filename[MAXFILENAME];
+    char filename[MAXFILENAME + 1];
     int fd;
     
+    if (strcmp(path, STATS_PATH) == 0)
+        return -EACCES;
+    if (strlen(path) > MAXFILENAME)
+        return -ENAMETOOLONG;
+    
     strcpy(filename, path);
     
+    pthread_rwlock_wrlock(&open_files_lock);
     fd = sfs_remove(filename);
-    if (fd == -1)
-        return -errno;
+    if (fd == -1) {
+        pthread_rwlock_unlock(&open_files_lock);
+        return -ENOENT;
+    }
     
+    /*handles open on the file carry on with the new, empty one*/
     fd = sfs_fopen(filename);
-    sfs_fclose(fd);
+    reopen_file(path, fd);
+    pthread_rwlock_unlock(&open_files_lock);
     return 0;
 }
 
@@ -158,16 +368,82 @@ static int fuse_mknod(const char *path, mode_t mode, dev_t rdev)
 
 static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp)
 {
-    char filename[MAXFILENAME];
-    int fd;
-    
-    strcpy(filename, path);
-    fd = sfs_fopen(filename);
+    int slot;
+
+    if (strcmp(path, STATS_PATH) == 0)
+        return -EEXIST;
+
+    slot = get_open_file(path);
+    if (slot < 0)
+        return slot;
     
-    sfs_fclose(fd);
+    fp->fh = slot;
+    return 0;
+}
+
+static int fuse_fsync(const char *path, int datasync,
+        struct fuse_file_info *fi)
+{
+    /*writes are buffered, this is where they have to reach the disk*/
+    if (sfs_sync() == -1)
+        return -ENOSPC; /*some of them found no room on it*/
     return 0;
 }
 
+/*SFS_IOC_CLONE makes the open file a clone of the one the argument names*/
+/*(see sfs_clone.c). It keeps its i-node, so its fd and handles carry on.*/
+/*The kernel may keep the old size until the attribute timeout is up.   */
+static int fuse_ioctl(const char *path, int cmd, void *arg,
+        struct fuse_file_info *fi, unsigned int flags, void *data)
+{
+    int res = -ENOENT;
+    open_file *f;
+    sfs_clone_ioctl *clone = data;
+    char src[MAXFILENAME + 2];
+    char filename[MAXFILENAME + 1];
+
+    if (cmd != SFS_IOC_CLONE)
+        return -ENOTTY;
+    if (flags & FUSE_IOCTL_COMPAT)
+        return -ENOSYS;
+    if (fi->fh == STATS_FH)
+        return -EBADF;
+    f = &open_files[fi->fh];
+    if (memchr(clone->src, '\0', sizeof(clone->src)) == NULL
+        || strlen(clone->src) + 1 > MAXFILENAME)
+        return -ENAMETOOLONG;
+
+    sprintf(src, "/%s", clone->src);
+    strcpy(filename, path);
+    pthread_rwlock_rdlock(&open_files_lock);
+    if (f->fd != -1 && sfs_clone(src, filename) != -1)
+        res = 0;
+    pthread_rwlock_unlock(&open_files_lock);
+
+    return res;
+}
+
+/*Larger requests: every 4 KiB write is a FUSE round trip of its own,  */
+/*so 128 KiB ones (the most the kernel sends) cut the per-request cost. */
+/*Readahead of a whole sfs file at most (the kernel's limit wins if it  */
+/*is lower). Reads can be in flight at once, sfs takes the locks it     */
+/*needs, and fuse_main runs its multithreaded loop unless given -s.     */
+#define MAX_WRITE (128 * 1024)
+#define MAX_READAHEAD (512 * 1024)
+
+static void *fuse_init(struct fuse_conn_info *conn)
+{
+    if (conn->capable & FUSE_CAP_BIG_WRITES)
+        conn->want |= FUSE_CAP_BIG_WRITES;
+    if (conn->capable & FUSE_CAP_ASYNC_READ)
+        conn->want |= FUSE_CAP_ASYNC_READ;
+    conn->async_read = 1;
+    conn->max_write = MAX_WRITE;
+    conn->max_readahead = MAX_READAHEAD;
+
+    return NULL;
+}
+
 static struct fuse_operations xmp_oper = {
     .getattr = fuse_getattr,
     .readdir = fuse_readdir,
@@ -175,10 +451,16 @@ static struct fuse_operations xmp_oper = {
     .unlink = fuse_unlink,
     .truncate = fuse_truncate,
     .open = fuse_open, 
+    .release = fuse_release,
     .read = fuse_read, 
     .write = fuse_write, 
+    .read_buf = fuse_read_buf,
+    .write_buf = fuse_write_buf,
     .access = fuse_access,
     .create = fuse_create,
+    .fsync = fuse_fsync,
+    .ioctl = fuse_ioctl,
+    .init = fuse_init,
 };
 
 int main(int argc, char *argv[])
@@ -1,16 +1,26 @@
 #include "sfs_api.h"
+#include "sfs_crc32c.h"
+#include "sfs_lz.h"
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
 
 #define DISK "fs.sfs"
 #define NUM_INODES 200  // also max number of files (including the directory)
 
+// Changes whenever the layout on disk does, so an image from before the change
+// isn't misread. 0xACBD0005 was the original one, before i-nodes had flags
+// (which moved everything after them).
+#define SFS_MAGIC 0xACBD0006
+
 // NOTE:
 // If you see +1 after an integer division, it's likely there for rounding up.
 
 #define NUM_INODE_BLOCKS (sizeof(inode) * NUM_INODES / BLOCK_SIZE + 1)
 #define NUM_ROOT_BLOCKS (sizeof(dir_entry) * NUM_INODES / BLOCK_SIZE + 1)
-#define MAX_BLOCKS_PER_FILE (12 + NUM_INDIRECT_PTR_ENTRIES)
-#define FILE_CAPACITY (BLOCK_SIZE * MAX_BLOCKS_PER_FILE)
 //
 #define MAX_BLOCKS_ALL_FILES (NUM_INODES - 1) * MAX_BLOCKS_PER_FILE
 // -1 is for the root aka directory
@@ -20,452 +30,4414 @@
   sizeof(uint64_t) * NUM_FREE_BITMAP_ROWS / BLOCK_SIZE + 1
 #define FREE_BLOCK_LIST_ADDR \
   1 /*super block*/ + NUM_INODE_BLOCKS + NUM_ROOT_BLOCKS + MAX_BLOCKS_ALL_FILES
+#define DATA_BLOCKS_ADDR (1 /*super block*/ + NUM_INODE_BLOCKS + NUM_ROOT_BLOCKS)
 
-superblock supblock;
-inode inode_table[NUM_INODES]; // cannot operate on root i-node
-// 0th element is unused for consistency (keep it that way!)
-dir_entry dir_table[NUM_INODES];
-//
-fd fdt[NUM_INODES]; // stores root at index 0, closing it closes the disk
-uint64_t free_block_list[NUM_FREE_BITMAP_ROWS];
-unsigned int current_file = 0; // among the existing files
+// The data region is split into allocation groups, each a run of whole bitmap
+// rows with its own lock and free count, so writers of different files don't
+// fight over one bitmap. A file's blocks go in its home group (i-node number
+// mod NUM_ALLOC_GROUPS) until that fills up. The on-disk bitmap is the same.
+#define NUM_ALLOC_GROUPS 16
+#define GROUP_ROWS \
+  ((NUM_FREE_BITMAP_ROWS + NUM_ALLOC_GROUPS - 1) / NUM_ALLOC_GROUPS)
+#define GROUP_BLOCKS (GROUP_ROWS * 64)
 
-void write_inode_table() {
-  write_blocks(1, NUM_INODE_BLOCKS, inode_table);
-}
-void write_dir_table() {
-  write_blocks(1 + NUM_INODE_BLOCKS, NUM_ROOT_BLOCKS, dir_table);
-}
-void write_free_block_list() {
-  // left space for the data blocks
-  write_blocks(FREE_BLOCK_LIST_ADDR, NUM_FREE_BITMAP_BLOCKS, free_block_list);
-}
+#define WB_BUCKETS 1024
 
-void reset_fdt() {
-  for (int i = 0; i < NUM_INODES; i++) {
-    fdt[i].inode = -1;
-    fdt[i].rwptr = 0;
-  }
-}
+// Under writeback a new data block gets no place on disk until the flusher
+// writes it out. Its slot holds BLOCK_PTR_DELAYED plus a number only that slot
+// uses, and its data waits in wb_table under that number. The flusher then
+// places all of a file's delayed blocks at once, in one run if a free one is
+// long enough. Only ever in memory: the i-node copies that go to disk have
+// holes there.
+#define BLOCK_PTR_DELAYED 0x40000000u
+#define DELAYED_PTR(nth_inode, nth_inode_block) \
+  (BLOCK_PTR_DELAYED | ((nth_inode) * MAX_BLOCKS_PER_FILE + (nth_inode_block)))
+#define DELAYED_INODE(block_ptr) \
+  ((int)(((block_ptr) & ~BLOCK_PTR_DELAYED) / MAX_BLOCKS_PER_FILE))
 
-void init_superblock() {
-  supblock.magic = 0xACBD0005;
-  supblock.block_size = BLOCK_SIZE;
-  supblock.inode_table_len = NUM_INODE_BLOCKS;
-  supblock.root_dir_inode = 0;  // 0th i-node -> root dir
-  supblock.fs_size = 1 // superblock 
-    + NUM_ROOT_BLOCKS
-    + NUM_INODE_BLOCKS
-    + MAX_BLOCKS_ALL_FILES
-    + NUM_FREE_BITMAP_BLOCKS;
-}
+// a data block written to memory but not to disk yet
+typedef struct wb_block {
+  unsigned int addr;
+  uint64_t gen; // changes on every write, so the flusher can tell
+  uint64_t dirtied_at; // when it went from clean to dirty
+  struct wb_block* next; // in its wb_table bucket
+  char data[BLOCK_SIZE];
+} wb_block;
 
-void mksfs(int fresh) {
-  // Reset global variables
-  current_file = 0;
-  init_superblock();
+// Everything one mounted image needs. All API calls take one of these, the
+// original calls (mksfs, sfs_fopen, ...) work on default_fs.
+struct sfs_t {
+  disk_t* disk;
+  superblock supblock;
+  inode inode_table[NUM_INODES]; // cannot operate on root i-node
+  // 0th element is unused for consistency (keep it that way!)
+  dir_entry dir_table[NUM_INODES];
+  //
+  fd fdt[NUM_INODES]; // stores root at index 0
+  uint64_t free_block_list[NUM_FREE_BITMAP_ROWS];
+  unsigned int current_file; // among the existing files
+  sfs_stats stats; // only changed with atomic adds, disk is filled in on reads
 
-  if (fresh) {
-    // reset cache
-    for (int i = 0; i < NUM_INODES; i++) {
-      inode_table[i].mode = 0;
-      inode_table[i].size = 0;
+  // LOCKS
+  // Always taken in this order: ns_lock, then i-node locks (lowest first when
+  // a call needs several), then disk_table_lock, then group locks (lowest
+  // group first), then wb_lock.
+  // ns_lock: dir_table, which i-nodes are in use, current_file, superblock
+  // inode_locks[i]: the rest of inode_table[i] and the data blocks it points to
+  // (shared ones aren't written, see write_file)
+  // group_locks[g]: group g's rows of free_block_list and block_shares
+  // wb_lock: the writeback state below
+  // fd slots don't have a lock, they're claimed/released with atomic
+  // operations on fd.inode
+  pthread_rwlock_t ns_lock;
+  pthread_rwlock_t inode_locks[NUM_INODES];
+  pthread_mutex_t group_locks[NUM_ALLOC_GROUPS];
+  int group_free[NUM_ALLOC_GROUPS]; // atomic, so full groups can be skipped
+  int reserved_blocks; // free blocks promised to delayed ones, atomic
+  // a delayed block couldn't be placed since the last sync, atomic
+  bool place_failed;
+  // how many other pointers there are to each data block besides one, from
+  // clones and dedup (which can point many of one file's slots at a block);
+  // changed atomically, so it can be read without the group lock
+  uint16_t block_shares[MAX_BLOCKS_ALL_FILES];
+  // I-nodes share disk blocks, so writing one also writes its neighbours. They
+  // get copied out of inode_disk_table, which only changes under
+  // disk_table_lock, instead of out of inode_table where their owners may be
+  // changing them. dir_disk_table is the same for dir_table, so the flusher
+  // doesn't need ns_lock, and bitmap_disk_table for the groups' rows.
+  inode inode_disk_table[NUM_INODES];
+  dir_entry dir_disk_table[NUM_INODES];
+  uint64_t bitmap_disk_table[NUM_FREE_BITMAP_ROWS];
+  bool inode_blocks_dirty[NUM_INODE_BLOCKS];
+  bool dir_dirty;
+  pthread_mutex_t disk_table_lock;
+  bool bitmap_dirty; // atomic
+
+  // WRITEBACK
+  // Data blocks are written into wb_table and the tables are only marked dirty.
+  // The flusher thread writes them out later, data first.
+  wb_block* wb_table[WB_BUCKETS];
+  int wb_dirty; // blocks in wb_table
+  int wb_delayed; // of those, delayed ones (changed atomically)
+  uint64_t wb_gen;
+  uint64_t meta_dirty_since; // 0 if the tables are clean
+  int max_dirty; // 0 for write-through
+  int max_age_ms;
+  unsigned int sync_requested, sync_done;
+  bool stopping;
+  bool flusher_running;
+  pthread_t flusher;
+  pthread_mutex_t wb_lock;
+  pthread_cond_t wb_wake; // the flusher has work
+  pthread_cond_t wb_drained; // the flusher made progress
+};
+
+sfs_t* default_fs = NULL;
+
+#define STAT_ADD(field, n) \
+  __atomic_fetch_add(&fs->stats.compress.field, (n), __ATOMIC_RELAXED)
+#define COUNT(field, n) \
+  __atomic_fetch_add(&fs->stats.field, (n), __ATOMIC_RELAXED)
 
-      fdt[i].inode = -1;
-      fdt[i].rwptr = 0;
+// The in-memory tables aren't a whole number of blocks long, so the last block
+// of each goes through a bounce buffer instead of reading/writing past the end
+// of the array (which used to clobber whatever global came next). Returns -1
+// if any of the blocks failed (a read one its checksum, say), 0 otherwise; a
+// failed read still fills in what it read.
+int table_blocks_io(
+  sfs_t* fs, bool write, int table_addr, void* table, size_t table_len,
+  int first, int last
+) {
+  int full_blocks = table_len / BLOCK_SIZE;
+  int result = 0;
 
-      dir_table[i].mode = 0;
+  if (first < full_blocks) {
+    int n = (last < full_blocks ? last + 1 : full_blocks) - first;
+
+    if (write) {
+      if (
+        write_blocks_r(
+          fs->disk, table_addr + first, n, (char*)table + first * BLOCK_SIZE
+        ) < 0
+      ) {
+        result = -1;
+      }
+      COUNT(meta_blocks_written, n);
+    } else {
+      if (
+        read_blocks_r(
+          fs->disk, table_addr + first, n, (char*)table + first * BLOCK_SIZE
+        ) < 0
+      ) {
+        result = -1;
+      }
+      COUNT(meta_blocks_read, n);
     }
+  }
+  if (last >= full_blocks && table_len % BLOCK_SIZE != 0) {
+    char block_buf[BLOCK_SIZE];
+    size_t tail = table_len % BLOCK_SIZE;
 
-    // init root
-    fdt[0].inode = 0; // 0th i-node is for the root
-    inode_table[0].mode = 1;
+    memset(block_buf, 0, BLOCK_SIZE);
+    if (write) {
+      memcpy(block_buf, (char*)table + full_blocks * BLOCK_SIZE, tail);
+      if (
+        write_blocks_r(fs->disk, table_addr + full_blocks, 1, block_buf) < 0
+      ) {
+        result = -1;
+      }
+      COUNT(meta_blocks_written, 1);
+    } else {
+      if (read_blocks_r(fs->disk, table_addr + full_blocks, 1, block_buf) < 0) {
+        result = -1;
+      }
+      memcpy((char*)table + full_blocks * BLOCK_SIZE, block_buf, tail);
+      COUNT(meta_blocks_read, 1);
+    }
+  }
 
-    // init and write onto disk
-    init_fresh_disk(DISK, BLOCK_SIZE, supblock.fs_size);
-    write_blocks(0, 1, &supblock);
-    write_inode_table();
-    write_dir_table();
-    write_free_block_list();
+  return result;
+}
 
-    fflush(stdout);
-  } else {
-    // all files are unopened except root
-    reset_fdt();
-    fdt[0].inode = 0;
+uint64_t now_ns() {
+  struct timespec now;
 
-    // init and read from disk
-    init_disk(DISK, BLOCK_SIZE, supblock.fs_size);
-    read_blocks(0, 1, &supblock);
-    read_blocks(1, NUM_INODE_BLOCKS, inode_table);
-    read_blocks(1 + NUM_INODE_BLOCKS, NUM_ROOT_BLOCKS, dir_table);
-    read_blocks(FREE_BLOCK_LIST_ADDR, NUM_FREE_BITMAP_BLOCKS, free_block_list);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// counts a call to op that started at start (a now_ns() time)
+void op_done(sfs_t* fs, int op, uint64_t start) {
+  sfs_op_stats* stats = &fs->stats.ops[op];
+  uint64_t ns = now_ns() - start;
+  int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+  uint64_t max = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+
+  if (bucket >= SFS_LATENCY_BUCKETS) {
+    bucket = SFS_LATENCY_BUCKETS - 1;
+  }
+  __atomic_fetch_add(&stats->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->total_ns, ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->latency[bucket], 1, __ATOMIC_RELAXED);
+  while (
+    ns > max
+    && !__atomic_compare_exchange_n(
+      &stats->max_ns, &max, ns, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED
+    )
+  ) {
+    // someone else raised it, max is the new value
   }
 }
 
-int sfs_getnextfilename(char* fname) {
-  int visited = 0;
-  for (int i = 1; i < NUM_INODES; i++) {
-    if (dir_table[i].mode == 1) {
-      if (visited == current_file) {
-        strcpy(fname, dir_table[i].name);
-        current_file++;
+// writes the table blocks marked dirty, the caller holds disk_table_lock
+void write_tables(sfs_t* fs) {
+  for (int first = 0; first < NUM_INODE_BLOCKS; first++) {
+    if (!fs->inode_blocks_dirty[first]) {
+      continue;
+    }
 
-        return 1;
-      } else {
-        visited++;
-      }
+    int last = first;
+    while (last + 1 < NUM_INODE_BLOCKS && fs->inode_blocks_dirty[last + 1]) {
+      last++;
+    }
+    table_blocks_io(
+      fs, true, 1, fs->inode_disk_table, sizeof(fs->inode_disk_table),
+      first, last
+    );
+    for (int i = first; i <= last; i++) {
+      fs->inode_blocks_dirty[i] = false;
     }
+    first = last;
   }
-  current_file = 0;
+  if (fs->dir_dirty) {
+    table_blocks_io(
+      fs, true, 1 + NUM_INODE_BLOCKS, fs->dir_disk_table,
+      sizeof(fs->dir_disk_table), 0, NUM_ROOT_BLOCKS - 1
+    );
+    fs->dir_dirty = false;
+  }
+  if (__atomic_exchange_n(&fs->bitmap_dirty, false, __ATOMIC_ACQ_REL)) {
+    for (int group = 0; group < NUM_ALLOC_GROUPS; group++) {
+      pthread_mutex_lock(&fs->group_locks[group]);
+    }
+    memcpy(
+      fs->bitmap_disk_table, fs->free_block_list, sizeof(fs->free_block_list)
+    );
+    for (int group = NUM_ALLOC_GROUPS - 1; group >= 0; group--) {
+      pthread_mutex_unlock(&fs->group_locks[group]);
+    }
 
-  return 0;
+    // left space for the data blocks
+    table_blocks_io(
+      fs, true, FREE_BLOCK_LIST_ADDR, fs->bitmap_disk_table,
+      sizeof(fs->bitmap_disk_table), 0, NUM_FREE_BITMAP_BLOCKS - 1
+    );
+  }
+}
+void flush_tables(sfs_t* fs) {
+  pthread_mutex_lock(&fs->disk_table_lock);
+  write_tables(fs);
+  pthread_mutex_unlock(&fs->disk_table_lock);
 }
 
-int sfs_getfilesize(const char* path) {
-  if (!(0 <= strlen(path) && strlen(path) <= MAXFILENAME)) { // check arg
-    return 0;
+// a table changed: write-through writes it now, otherwise the flusher gets to
+// it within max_age_ms
+void tables_dirtied(sfs_t* fs) {
+  pthread_mutex_lock(&fs->wb_lock);
+  if (fs->max_dirty > 0) {
+    if (fs->meta_dirty_since == 0) {
+      fs->meta_dirty_since = now_ns();
+      // an idle flusher doesn't know when to wake up yet
+      pthread_cond_signal(&fs->wb_wake);
+    }
+    pthread_mutex_unlock(&fs->wb_lock);
+
+    return;
   }
+  pthread_mutex_unlock(&fs->wb_lock);
 
-  for (int i = 1; i < NUM_INODES; i++) {
-    if (dir_table[i].mode == 1 && strcmp(path, dir_table[i].name) == 0) {
-      return inode_table[i].size;
+  flush_tables(fs);
+}
+
+bool is_delayed(unsigned int block_ptr) {
+  return (block_ptr & (BLOCK_PTR_COMPRESSED | BLOCK_PTR_DELAYED))
+    == BLOCK_PTR_DELAYED;
+}
+
+// the copy of an i-node that goes to disk, where its delayed blocks are holes
+// until the flusher places them
+void disk_inode(inode* to, const inode* from) {
+  *to = *from;
+  if (from->flags & INODE_INLINE) {
+    // the pointers are file bytes
+
+    return;
+  }
+  for (int i = 0; i < 12; i++) {
+    if (is_delayed(to->direct[i])) {
+      to->direct[i] = 0;
+    }
+  }
+  for (int i = 0; i < NUM_INDIRECT_PTR_ENTRIES; i++) {
+    if (is_delayed(to->indirect[i])) {
+      to->indirect[i] = 0;
     }
   }
+}
 
-  return 0;
+void write_inode_table(sfs_t* fs) {
+  pthread_mutex_lock(&fs->disk_table_lock);
+  for (int i = 0; i < NUM_INODES; i++) {
+    disk_inode(&fs->inode_disk_table[i], &fs->inode_table[i]);
+  }
+  for (int i = 0; i < NUM_INODE_BLOCKS; i++) {
+    fs->inode_blocks_dirty[i] = true;
+  }
+  pthread_mutex_unlock(&fs->disk_table_lock);
+  tables_dirtied(fs);
 }
+// only marks the block(s) the i-node lives in, the caller holds its lock
+void write_inode(sfs_t* fs, int nth_inode) {
+  int first = nth_inode * sizeof(inode) / BLOCK_SIZE;
+  int last = ((nth_inode + 1) * sizeof(inode) - 1) / BLOCK_SIZE;
 
-int sfs_fopen(char* name) {
-  if (!(0 <= strlen(name) && strlen(name) <= MAXFILENAME)) {
-    return -1;
+  pthread_mutex_lock(&fs->disk_table_lock);
+  disk_inode(&fs->inode_disk_table[nth_inode], &fs->inode_table[nth_inode]);
+  for (int i = first; i <= last; i++) {
+    fs->inode_blocks_dirty[i] = true;
   }
+  pthread_mutex_unlock(&fs->disk_table_lock);
+  tables_dirtied(fs);
+}
+// the caller holds ns_lock for writing
+void write_dir_table(sfs_t* fs) {
+  pthread_mutex_lock(&fs->disk_table_lock);
+  memcpy(fs->dir_disk_table, fs->dir_table, sizeof(fs->dir_table));
+  fs->dir_dirty = true;
+  pthread_mutex_unlock(&fs->disk_table_lock);
+  tables_dirtied(fs);
+}
+void write_free_block_list(sfs_t* fs) {
+  __atomic_store_n(&fs->bitmap_dirty, true, __ATOMIC_RELEASE);
+  tables_dirtied(fs);
+}
 
-  // filename length is valid
+// the link pointing at a block's wb_block (or at NULL if it isn't dirty), the
+// caller holds wb_lock
+wb_block** wb_find(sfs_t* fs, unsigned int addr) {
+  wb_block** link = &fs->wb_table[addr % WB_BUCKETS];
 
-  // must check for three cases: file and descriptor exists, only file exists,
-  // both don't exist
+  while (*link != NULL && (*link)->addr != addr) {
+    link = &(*link)->next;
+  }
 
-  for (int i = 1; i < NUM_INODES; i++) {
-    if (dir_table[i].mode == 1 && strcmp(name, dir_table[i].name) == 0) {
-      // file exists
+  return link;
+}
 
-      for (int j = 1; j < NUM_INODES; j++) {
-        if (fdt[j].inode == i) {
-          // descriptor exists
+// write_blocks_r for data blocks, through the writeback buffer
+void write_data_blocks(
+  sfs_t* fs, unsigned int addr, int nblocks, const char* buf
+) {
+  // delayed blocks have nowhere to go but the buffer, even if it was just
+  // switched to write-through
+  bool delayed = addr & BLOCK_PTR_DELAYED;
 
-          return j;
-        }
-      }
+  pthread_mutex_lock(&fs->wb_lock);
+  if (fs->max_dirty == 0 && !delayed) {
+    // A copy still buffered from before the switch would be read instead of
+    // this, and the flusher may be writing it out right now, over this. It
+    // gets the new data too, so it's what gets read and (again) written.
+    for (int i = 0; fs->wb_dirty > 0 && i < nblocks; i++) {
+      wb_block* block = *wb_find(fs, addr + i);
 
-      // descriptor doesn't exist
-      for (int j = 1; j < NUM_INODES; j++) {
-        if (fdt[j].inode == -1) {
-          // FDT slot available
+      if (block != NULL) {
+        memcpy(block->data, buf + i * BLOCK_SIZE, BLOCK_SIZE);
+        block->gen = ++fs->wb_gen;
+      }
+    }
+    pthread_mutex_unlock(&fs->wb_lock);
+    write_blocks_r(fs->disk, addr, nblocks, (void*)buf);
+    COUNT(data_blocks_written, nblocks);
 
-          fdt[j].inode = i;
-          fdt[j].rwptr = sfs_getfilesize(name);
+    return;
+  }
 
-          return j;
-        }
-      }
+  // BACKPRESSURE
+  // only on the blocks the flusher can always write: it can't place a file's
+  // delayed blocks while its writer holds the i-node lock, so new_data_block
+  // keeps those to half the buffer instead
+  while (
+    !delayed && fs->wb_dirty - fs->wb_delayed > 0
+    && fs->wb_dirty - fs->wb_delayed + nblocks > fs->max_dirty
+  ) {
+    pthread_cond_signal(&fs->wb_wake);
+    pthread_cond_wait(&fs->wb_drained, &fs->wb_lock);
+  }
 
-      // FDT is full
-      return -1;
-    }
+  if (fs->wb_dirty == 0) {
+    // an idle flusher doesn't know when to wake up yet
+    pthread_cond_signal(&fs->wb_wake);
   }
+  for (int i = 0; i < nblocks; i++) {
+    wb_block** link = wb_find(fs, addr + i);
 
-  // file (and descriptor) doesn't exist
-  for (int i = 1; i < NUM_INODES; i++) {
-    if (inode_table[i].mode == 0) {
-      inode_table[i].mode = 1;
-      strcpy(dir_table[i].name, name);
-      dir_table[i].mode = 1;
-      write_inode_table();
-      write_dir_table();
-
-      for (int j = 1; j < NUM_INODES; j++) {
-        if (fdt[j].inode == -1) {
-          fdt[j].inode = i;
-          fdt[j].rwptr = 0;
-
-          return j;
-        }
+    if (*link == NULL) {
+      *link = malloc(sizeof(wb_block));
+      (*link)->addr = addr + i;
+      (*link)->dirtied_at = now_ns();
+      (*link)->next = NULL;
+      fs->wb_dirty++;
+      if (delayed) {
+        __atomic_fetch_add(&fs->wb_delayed, 1, __ATOMIC_RELAXED);
       }
+    } else {
+      COUNT(wb_overwrites, 1);
     }
+    memcpy((*link)->data, buf + i * BLOCK_SIZE, BLOCK_SIZE);
+    (*link)->gen = ++fs->wb_gen;
   }
-
-  // Idk something went wrong
-  return -1;
+  if (fs->wb_dirty * 2 > fs->max_dirty) {
+    // past the background threshold, start writing before writers block
+    pthread_cond_signal(&fs->wb_wake);
+  }
+  pthread_mutex_unlock(&fs->wb_lock);
 }
 
-int sfs_fclose(int fileID) {
-  if (!(1 <= fileID && fileID < NUM_INODES)) { // check arg
-    return -1;
-  }
+// read_blocks_r for data blocks, dirty ones come from the writeback buffer
+int read_data_blocks(sfs_t* fs, unsigned int addr, int nblocks, char* buf) {
+  int result = nblocks;
+  int i = 0;
 
-  fd* f = &fdt[fileID];
+  while (i < nblocks) {
+    pthread_mutex_lock(&fs->wb_lock);
+    wb_block* block = *wb_find(fs, addr + i);
+    if (block != NULL) {
+      memcpy(buf + i * BLOCK_SIZE, block->data, BLOCK_SIZE);
+      pthread_mutex_unlock(&fs->wb_lock);
+      COUNT(wb_hits, 1);
+      i++;
+      continue;
+    }
 
-  // if file is already closed
-  if (f->inode == -1) {
-    return -1;
-  }
+    // not dirty, so what's on disk is current, and so may be the next ones
+    int run = 1;
+    while (i + run < nblocks && *wb_find(fs, addr + i + run) == NULL) {
+      run++;
+    }
+    pthread_mutex_unlock(&fs->wb_lock);
 
-  if (fileID == 0) { // first fd always reserved for root
-    close_disk();
-    reset_fdt();
-  } else {
-    f->inode = -1;
-    f->rwptr = 0;
+    if (read_blocks_r(fs->disk, addr + i, run, buf + i * BLOCK_SIZE) < 0) {
+      result = -1;
+    }
+    COUNT(wb_misses, run);
+    COUNT(data_blocks_read, run);
+    i += run;
   }
 
-  return 0;
+  return result;
 }
 
-int sfs_fwrite(int fileID, const char* buf, int length) {
-  // ARGUMENT CHECKING
-  if (fileID < 0 || length == 0) {
-    return 0;
+// a freed block's pending write is pointless, drops it
+void wb_forget(sfs_t* fs, unsigned int addr) {
+  pthread_mutex_lock(&fs->wb_lock);
+  wb_block** link = wb_find(fs, addr);
+  if (*link != NULL) {
+    wb_block* block = *link;
+
+    *link = block->next;
+    free(block);
+    fs->wb_dirty--;
+    if (addr & BLOCK_PTR_DELAYED) {
+      __atomic_fetch_sub(&fs->wb_delayed, 1, __ATOMIC_RELAXED);
+    }
+    pthread_cond_broadcast(&fs->wb_drained);
   }
+  pthread_mutex_unlock(&fs->wb_lock);
+}
 
-  // INITIALIZE VARIABLES
-  bool wrote_to_disk = false;
-  int buf_len = length;
-  int bytes_written = 0;
-  fd* f = &fdt[fileID];
-  inode* file_inode;
-  int nth_inode_block = (f->rwptr) / BLOCK_SIZE; // starts from 0
-  unsigned int* data_block_addr;
+// a delayed block was placed at addr, its data moves there and can be
+// written like any other
+void wb_rekey(sfs_t* fs, unsigned int delayed_ptr, unsigned int addr) {
+  pthread_mutex_lock(&fs->wb_lock);
+  wb_block** link = wb_find(fs, delayed_ptr);
+  if (*link != NULL) {
+    wb_block* block = *link;
 
-  // SANITY CHECK
-  if (
-    !(0 <= f->rwptr && f->rwptr < FILE_CAPACITY)
-    || f->inode <= 0 // can't write to root
-    || nth_inode_block < 0
-  ) {
-    return 0;
+    *link = block->next;
+    block->addr = addr;
+    block->next = fs->wb_table[addr % WB_BUCKETS];
+    fs->wb_table[addr % WB_BUCKETS] = block;
+    __atomic_fetch_sub(&fs->wb_delayed, 1, __ATOMIC_RELAXED);
   }
-  file_inode = &inode_table[f->inode];
+  pthread_mutex_unlock(&fs->wb_lock);
+}
 
-  while (bytes_written < buf_len && nth_inode_block < MAX_BLOCKS_PER_FILE) {
-    // GET N-TH I-NODE BLOCK
-    int block_offset = (f->rwptr) % BLOCK_SIZE;
-    char block_buf[BLOCK_SIZE];
+typedef struct {
+  unsigned int addr;
+  uint64_t gen;
+  char data[BLOCK_SIZE];
+} wb_copy;
+
+int wb_copy_cmp(const void* a, const void* b) {
+  unsigned int x = ((const wb_copy*)a)->addr;
+  unsigned int y = ((const wb_copy*)b)->addr;
 
-    if (nth_inode_block < 12) {
-      // direct pointer
+  return x < y ? -1 : x > y;
+}
 
-      data_block_addr = &(file_inode->direct[nth_inode_block]);
-    } else if (nth_inode_block >= 12 && nth_inode_block < MAX_BLOCKS_PER_FILE) {
-      // indirect pointer
+// with the allocator further down
+int place_delayed(sfs_t* fs, bool* files);
 
-      data_block_addr = &(file_inode->indirect[nth_inode_block - 12]);
-    } else {
-      // shouldn't get here
+// Writes dirty data blocks (then the tables) once they're max_age_ms old,
+// everything once more than half of max_dirty are dirty, and everything on
+// sfs_sync and unmount. Delayed blocks that are due get placed first.
+void* flusher_main(void* arg) {
+  sfs_t* fs = arg;
+
+  pthread_mutex_lock(&fs->wb_lock);
+  for (;;) {
+    unsigned int serving = fs->sync_requested;
+    bool flush_all = fs->stopping
+      || serving != fs->sync_done
+      || fs->wb_dirty * 2 > fs->max_dirty;
+    uint64_t now = now_ns();
+    uint64_t max_age = (uint64_t)fs->max_age_ms * 1000000;
+    uint64_t next_due = UINT64_MAX;
+    bool place[NUM_INODES] = {false}; // files with delayed blocks due
+    int nplace = 0;
+    bool place_busy = false; // some of them were locked
 
-      return bytes_written;
+    // PLACE
+    for (int i = 0; i < WB_BUCKETS; i++) {
+      for (wb_block* block = fs->wb_table[i]; block != NULL; block = block->next) {
+        if (!(block->addr & BLOCK_PTR_DELAYED)) {
+          continue;
+        }
+        if (flush_all || now - block->dirtied_at >= max_age) {
+          nplace += !place[DELAYED_INODE(block->addr)];
+          place[DELAYED_INODE(block->addr)] = true;
+        } else if (block->dirtied_at + max_age < next_due) {
+          next_due = block->dirtied_at + max_age;
+        }
+      }
     }
+    if (nplace > 0) {
+      pthread_mutex_unlock(&fs->wb_lock);
+      int unplaced = place_delayed(fs, place);
+      pthread_mutex_lock(&fs->wb_lock);
 
-    // PREPARE BLOCK BUFFER
-    if (*data_block_addr > 0) {
-      // data block is allocated
+      for (int i = 1; i < NUM_INODES; i++) {
+        place_busy |= place[i];
+      }
+      if (unplaced > 0) {
+        // no room, nothing to gain from trying again right away
+        uint64_t retry = now_ns() + (max_age > 1000000 ? max_age : 1000000);
 
-      read_blocks(*data_block_addr, 1, (void*)block_buf);
-    } else if (*data_block_addr == 0) {
-      for (int i = 0; i < BLOCK_SIZE; i++) {
-        block_buf[i] = '\0'; // bcuz initializing doesn't set the values to 0
+        if (retry < next_due) {
+          next_due = retry;
+        }
       }
     }
 
-    // EDIT BLOCK BUFFER
-    while (block_offset < BLOCK_SIZE && bytes_written < buf_len) {
-      (f->rwptr)++;
-      if (file_inode->size < f->rwptr) {
-        (file_inode->size)++;
+    bool tables = fs->meta_dirty_since != 0
+      && (flush_all || now - fs->meta_dirty_since >= max_age);
+    if (tables) {
+      fs->meta_dirty_since = 0;
+
+      // The tables may point at any block that's dirty, so all of them go
+      // first. Writers put a block's data in wb_table before its i-node goes
+      // in inode_disk_table, so holding disk_table_lock from here until the
+      // tables are written keeps them from pointing at one not collected.
+      pthread_mutex_unlock(&fs->wb_lock);
+      pthread_mutex_lock(&fs->disk_table_lock);
+      pthread_mutex_lock(&fs->wb_lock);
+    } else if (fs->meta_dirty_since != 0) {
+      if (fs->meta_dirty_since + max_age < next_due) {
+        next_due = fs->meta_dirty_since + max_age;
       }
-      block_buf[block_offset] = buf[bytes_written];
-      block_offset++;
-      bytes_written++;
     }
 
-    // WRITE BLOCK BUFFER INTO DISK
-    if (*data_block_addr > 0) {
-      write_blocks(*data_block_addr, 1, (void*)block_buf);
-    } else if (*data_block_addr == 0) {
-      // need to find a free data block
-      int new_data_block_addr = -1;
-      for (int row_num = 0; row_num < NUM_FREE_BITMAP_ROWS; row_num++) {
-        uint64_t row = free_block_list[row_num];
-
-        for (int col_num = 0; col_num < 64; col_num++) {
-          uint64_t bit = 1;
-          uint64_t bit_mask = bit << (63 - col_num);
-
-          if ((bit_mask & row) >> (63 - col_num) == 0) { // found a 0 in free_block_list
-            new_data_block_addr = 1 // superblock
-              + NUM_INODE_BLOCKS
-              + NUM_ROOT_BLOCKS
-              + col_num
-              + row_num * 64;
-            free_block_list[row_num] |= bit_mask;
-            break;
-          }
+    // COLLECT
+    // copies, since writers keep changing the originals while they're written
+    wb_copy* batch = malloc(fs->wb_dirty * sizeof(wb_copy) + 1);
+    int nbatch = 0;
+
+    for (int i = 0; i < WB_BUCKETS; i++) {
+      for (wb_block* block = fs->wb_table[i]; block != NULL; block = block->next) {
+        if (block->addr & BLOCK_PTR_DELAYED) {
+          // has no address to be written to yet, placing it failed (and the
+          // tables don't point at it)
+          continue;
+        }
+        if (flush_all || tables || now - block->dirtied_at >= max_age) {
+          batch[nbatch].addr = block->addr;
+          batch[nbatch].gen = block->gen;
+          memcpy(batch[nbatch].data, block->data, BLOCK_SIZE);
+          nbatch++;
+        } else if (block->dirtied_at + max_age < next_due) {
+          next_due = block->dirtied_at + max_age;
         }
+      }
+    }
+
+    if (nbatch > 0 || tables) {
+      pthread_mutex_unlock(&fs->wb_lock);
+
+      // WRITE, ADJACENT BLOCKS TOGETHER
+      qsort(batch, nbatch, sizeof(wb_copy), wb_copy_cmp);
+      for (int first = 0; first < nbatch; ) {
+        char run_buf[16 * BLOCK_SIZE];
+        int n = 0;
 
-        if (new_data_block_addr >= 0) {
-          *data_block_addr = new_data_block_addr;
-          write_blocks(*data_block_addr, 1, (void*)block_buf);
-          write_inode_table();
-          write_free_block_list();
-          break; // since a data block was found
+        while (
+          first + n < nbatch && n < 16
+          && batch[first + n].addr == batch[first].addr + n
+        ) {
+          memcpy(run_buf + n * BLOCK_SIZE, batch[first + n].data, BLOCK_SIZE);
+          n++;
         }
+        write_blocks_r(fs->disk, batch[first].addr, n, run_buf);
+        COUNT(data_blocks_written, n);
+        first += n;
       }
-      if (new_data_block_addr == -1) {
-        // no free blocks
+      // the tables point at the data, so they go last
+      if (tables) {
+        write_tables(fs);
+        pthread_mutex_unlock(&fs->disk_table_lock);
+      }
+
+      pthread_mutex_lock(&fs->wb_lock);
+      // whatever was written again in the meantime stays dirty
+      for (int i = 0; i < nbatch; i++) {
+        wb_block** link = wb_find(fs, batch[i].addr);
+
+        if (*link != NULL && (*link)->gen == batch[i].gen) {
+          wb_block* block = *link;
 
-        if (wrote_to_disk) {
-          return bytes_written;
-        } else {
-          return 0;
+          *link = block->next;
+          free(block);
+          fs->wb_dirty--;
         }
       }
+      pthread_cond_broadcast(&fs->wb_drained);
     }
+    free(batch);
 
-    wrote_to_disk = true;
-    nth_inode_block++;
+    if (flush_all && serving != fs->sync_done && !place_busy) {
+      // everything written before the sync call is on disk
+      fs->sync_done = serving;
+      pthread_cond_broadcast(&fs->wb_drained);
+    }
+    if (nbatch > 0 || tables) {
+      // more may have piled up while writing
+      continue;
+    }
+    if (fs->stopping && !place_busy) {
+      break;
+    }
+    if (place_busy && now_ns() + 1000000 < next_due) {
+      // try their files again soon
+      next_due = now_ns() + 1000000;
+    }
+
+    // WAIT
+    if (next_due == UINT64_MAX) {
+      pthread_cond_wait(&fs->wb_wake, &fs->wb_lock);
+    } else {
+      struct timespec until;
+
+      until.tv_sec = next_due / 1000000000;
+      until.tv_nsec = next_due % 1000000000;
+      pthread_cond_timedwait(&fs->wb_wake, &fs->wb_lock, &until);
+    }
   }
+  pthread_mutex_unlock(&fs->wb_lock);
 
-  return bytes_written;
+  return NULL;
 }
 
-int sfs_fread(int fileID, char* buf, int length) {
-  // ARGUMENT CHECKING
-  if (fileID < 0 || length == 0) {
-    return 0;
+// -1 if a delayed block couldn't be placed since the last one
+int sync_fs(sfs_t* fs) {
+  pthread_mutex_lock(&fs->wb_lock);
+  unsigned int ticket = ++fs->sync_requested;
+
+  pthread_cond_signal(&fs->wb_wake);
+  while ((int)(fs->sync_done - ticket) < 0) {
+    pthread_cond_wait(&fs->wb_drained, &fs->wb_lock);
   }
+  pthread_mutex_unlock(&fs->wb_lock);
 
-  // INITIALIZE VARIABLES
-  int buf_len = length;
-  int bytes_read = 0;
-  fd* f = &fdt[fileID];
-  inode* file_inode;
-  int nth_inode_block = (f->rwptr) / BLOCK_SIZE; // starts from 0
-  unsigned int* data_block_addr;
+  return __atomic_exchange_n(&fs->place_failed, false, __ATOMIC_ACQ_REL)
+    ? -1
+    : 0;
+}
 
-  // SANITY CHECK
-  if (
-    !(0 <= f->rwptr && f->rwptr < FILE_CAPACITY)
-    || f->inode <= 0 // 0 is root, -1 means not set
-    || nth_inode_block < 0
-  ) {
-    return 0;
+int sfs_sync_r(sfs_t* fs) {
+  uint64_t start = now_ns();
+  int result = sync_fs(fs);
+
+  op_done(fs, SFS_OP_SYNC, start);
+
+  return result;
+}
+
+void sfs_set_writeback_r(sfs_t* fs, int max_dirty_blocks, int max_age_ms) {
+  pthread_mutex_lock(&fs->wb_lock);
+  __atomic_store_n(
+    &fs->max_dirty, max_dirty_blocks > 0 ? max_dirty_blocks : 0,
+    __ATOMIC_RELAXED
+  );
+  fs->max_age_ms = max_age_ms > 0 ? max_age_ms : 0;
+  pthread_cond_signal(&fs->wb_wake);
+  pthread_mutex_unlock(&fs->wb_lock);
+
+  // nothing may stay behind once writes go straight to disk
+  sfs_sync_r(fs);
+}
+
+// returns the slot holding the address of the nth data block of a file, or
+// NULL if n is past what a single i-node can address
+unsigned int* get_block_ptr(inode* file_inode, int nth_inode_block) {
+  if (0 <= nth_inode_block && nth_inode_block < 12) {
+    // direct pointer
+
+    return &(file_inode->direct[nth_inode_block]);
+  } else if (12 <= nth_inode_block && nth_inode_block < MAX_BLOCKS_PER_FILE) {
+    // indirect pointer
+
+    return &(file_inode->indirect[nth_inode_block - 12]);
   }
-  file_inode = &inode_table[f->inode];
 
-  while (bytes_read < buf_len && nth_inode_block < (MAX_BLOCKS_PER_FILE)) {
-    // GET N-TH I-NODE BLOCK
-    int block_offset = (f->rwptr) % BLOCK_SIZE;
-    char block_buf[BLOCK_SIZE];
+  return NULL;
+}
 
-    if (nth_inode_block < 12) {
-      // direct pointer
+char* inline_data(inode* file_inode) {
+  return (char*)file_inode->indirect;
+}
 
-      data_block_addr = &(file_inode->direct[nth_inode_block]);
-    } else if (12 <= nth_inode_block && nth_inode_block < MAX_BLOCKS_PER_FILE) {
-      // indirect pointer
+bool in_data_region(unsigned int addr, int nblocks) {
+  return DATA_BLOCKS_ADDR <= addr
+    && addr + nblocks <= DATA_BLOCKS_ADDR + MAX_BLOCKS_ALL_FILES;
+}
 
-      data_block_addr = &(file_inode->direct[nth_inode_block]);
-    } else {
-      // shouldn't get here
+bool block_in_use(sfs_t* fs, int nth_data_block) {
+  return (fs->free_block_list[nth_data_block / 64]
+    >> (63 - nth_data_block % 64)) & 1;
+}
 
-      return bytes_read;
-    }
+// one past the last data block of group g
+int group_end(int group) {
+  int end = (group + 1) * GROUP_BLOCKS;
 
-    // PREPARE BLOCK BUFFER
-    read_blocks(*data_block_addr, 1, (void*)block_buf);
+  return end < MAX_BLOCKS_ALL_FILES ? end : MAX_BLOCKS_ALL_FILES;
+}
 
-    // READ BLOCK BUFFER
-    while (block_offset < BLOCK_SIZE && bytes_read < buf_len) {
-      buf[bytes_read] = block_buf[block_offset];
-      bytes_read++;
-      block_offset++;
-      (f->rwptr)++;
+// recounts every group's free blocks from the bitmap
+void count_free_blocks(sfs_t* fs) {
+  for (int group = 0; group < NUM_ALLOC_GROUPS; group++) {
+    int free_blocks = 0;
+
+    for (int i = group * GROUP_BLOCKS; i < group_end(group); i++) {
+      free_blocks += !block_in_use(fs, i);
     }
+    __atomic_store_n(&fs->group_free[group], free_blocks, __ATOMIC_RELAXED);
+  }
+}
 
-    nth_inode_block++;
+// first fit for n free blocks in a row inside the group, starting at from
+// (and wrapping around to the group's start), marks them used and returns the
+// first one's index in the data region or -1. The caller holds the group lock.
+int group_alloc_run(sfs_t* fs, int group, int from, int n) {
+  int first = group * GROUP_BLOCKS;
+  int end = group_end(group);
+
+  if (from < first || from >= end) {
+    from = first;
   }
 
-  // can't just return bytes_read, because some of buf could just be empty space
-  int valid_bytes_read = 0;
-  for (int i = 0; i < length; i++) {
-    if (buf[i] != '\0') {
-      valid_bytes_read = i;
+  int scanned = 0;
+
+  for (int pass = 0; pass < 2; pass++) {
+    int run = 0;
+
+    for (int nth_data_block = pass == 0 ? from : first; nth_data_block < end; nth_data_block++) {
+      scanned++;
+      if (
+        nth_data_block % 64 == 0
+        && fs->free_block_list[nth_data_block / 64] == ~(uint64_t)0
+      ) {
+        // whole row in use
+        nth_data_block += 63;
+        run = 0;
+        continue;
+      }
+      if (block_in_use(fs, nth_data_block)) {
+        run = 0;
+        continue;
+      }
+      if (++run < n) {
+        continue;
+      }
+
+      int start = nth_data_block - n + 1;
+      for (int i = start; i <= nth_data_block; i++) {
+        fs->free_block_list[i / 64] |= (uint64_t)1 << (63 - i % 64);
+      }
+      __atomic_fetch_sub(&fs->group_free[group], n, __ATOMIC_RELAXED);
+      COUNT(alloc_bits_scanned, scanned);
+
+      return start;
     }
   }
-  return valid_bytes_read + 1;
+  COUNT(alloc_bits_scanned, scanned);
+
+  return -1;
 }
 
-int sfs_fseek(int fileID, int loc) {
-  if (fileID < 0 || !(0 <= loc && loc < FILE_CAPACITY)) { // check args
-    return -1;
-  }
+// free blocks over all groups, without taking their locks
+int free_blocks_total(sfs_t* fs) {
+  int free_blocks = 0;
 
-  fd* f = &fdt[fileID];
-  if (f->inode <= 0) { // don't allow seeking root
-    return -1;
+  for (int group = 0; group < NUM_ALLOC_GROUPS; group++) {
+    free_blocks += __atomic_load_n(&fs->group_free[group], __ATOMIC_RELAXED);
   }
-  f->rwptr = loc;
 
-  return 0;
+  return free_blocks;
 }
 
-void free_from_block_list(int data_block_addr) {
-  int nth_data_block = data_block_addr \
-    - (1 /* superblock */ + NUM_INODE_BLOCKS + NUM_ROOT_BLOCKS);
-  int row_num = nth_data_block / 64;
-  int col_num = nth_data_block % 64;
-  uint64_t bit_mask = ~((uint64_t)1 << (63 - col_num));
+// finds n free data blocks in a row for the i-node and marks them as used,
+// returns the address of the first one or -1 if there's no such run. goal is
+// the address the file would like next (right after its previous block), 0 if
+// it has none.
+int alloc_run(sfs_t* fs, int nth_inode, unsigned int goal, int n) {
+  // a file sticks to its home group, or to wherever its blocks spilled to
+  int home = nth_inode % NUM_ALLOC_GROUPS;
+  int from = -1;
 
-  free_block_list[row_num] &= bit_mask;
-}
-int sfs_remove(char* file) {
-  // ARGUMENT CHECKING
-  if (!(0 <= strlen(file) && strlen(file) <= MAXFILENAME)) {
-    return -1;
+  if (in_data_region(goal, 1)) {
+    from = goal - DATA_BLOCKS_ADDR;
+    home = from / GROUP_BLOCKS;
   }
 
-  for (int i = 1; i < NUM_INODES - 1; i++) {
-    if (dir_table[i].mode == 1 && strcmp(file, dir_table[i].name) == 0) {
-      inode_table[i].mode = 0;
-      inode_table[i].size = 0;
+  COUNT(alloc_calls, 1);
+  for (int i = 0; i < NUM_ALLOC_GROUPS; i++) {
+    int group = (home + i) % NUM_ALLOC_GROUPS;
 
-      // DELETE I-NODE
-      // UPDATE FREE BLOCK LIST
-      for (int j = 0; j < 12; j++) { // direct blocks
-        free_from_block_list(inode_table[i].direct[j]);
+    if (__atomic_load_n(&fs->group_free[group], __ATOMIC_RELAXED) < n) {
+      // too full, don't even take the lock
+      continue;
+    }
 
-        inode_table[i].direct[j] = 0;
-      }
-      for (int j = 0; j < NUM_INDIRECT_PTR_ENTRIES; j++) { // indirect blocks
-        free_from_block_list(inode_table[i].indirect[j]);
+    COUNT(alloc_groups_scanned, 1);
+    pthread_mutex_lock(&fs->group_locks[group]);
+    int nth_data_block = group_alloc_run(fs, group, i == 0 ? from : -1, n);
+    pthread_mutex_unlock(&fs->group_locks[group]);
 
-        inode_table[i].indirect[j] = 0;
-      }
+    if (nth_data_block != -1) {
+      COUNT(alloc_blocks, n);
 
-      // DELETE FD
-      fdt[i].inode = -1;
+      return DATA_BLOCKS_ADDR + nth_data_block;
+    }
+  }
+  COUNT(alloc_failures, 1);
 
-      // DELETE DIR ENTRY
-      dir_table[i].mode = 0;
+  return -1;
+}
 
-      // UPDATE DISK
-      write_inode_table();
-      write_dir_table();
-      write_free_block_list();
+// alloc_run for everything but placing delayed blocks, which leaves the
+// blocks promised to those alone
+int alloc_data_run(sfs_t* fs, int nth_inode, unsigned int goal, int n) {
+  // promised too until they're taken, so whatever else checks meanwhile (this
+  // or new_data_block) counts them and the two can't both have the last ones
+  int reserved = __atomic_add_fetch(&fs->reserved_blocks, n, __ATOMIC_ACQ_REL);
+  int addr = -1;
 
-      return 0;
+  if (reserved <= free_blocks_total(fs)) {
+    addr = alloc_run(fs, nth_inode, goal, n);
+  } else {
+    COUNT(alloc_calls, 1);
+    COUNT(alloc_failures, 1);
+  }
+  __atomic_sub_fetch(&fs->reserved_blocks, n, __ATOMIC_ACQ_REL);
+
+  return addr;
+}
+
+// finds a free data block and marks it as used, -1 if the disk is full
+int alloc_data_block(sfs_t* fs, int nth_inode, unsigned int goal) {
+  return alloc_data_run(fs, nth_inode, goal, 1);
+}
+
+// where the nth block of a file would best go: right after the closest placed
+// block before it, 0 if there's none
+unsigned int alloc_goal(inode* file_inode, int nth_inode_block) {
+  for (int i = nth_inode_block - 1; i >= 0; i--) {
+    unsigned int block_ptr = *get_block_ptr(file_inode, i);
+
+    if (block_ptr & BLOCK_PTR_COMPRESSED) {
+      return BLOCK_PTR_ADDR(block_ptr) + BLOCK_PTR_NBLOCKS(block_ptr);
+    }
+    if (block_ptr > 0 && !is_delayed(block_ptr)) {
+      return block_ptr + 1;
     }
   }
 
-  return -1;
+  return 0;
+}
+
+// drops an i-node's use of the block, which is freed unless a clone still
+// points at it
+void free_from_block_list(sfs_t* fs, int data_block_addr) {
+  if (is_delayed(data_block_addr)) {
+    // never got a place, so the allocator and the disk never hear of it
+    wb_forget(fs, data_block_addr);
+    __atomic_fetch_sub(&fs->reserved_blocks, 1, __ATOMIC_RELAXED);
+    COUNT(delalloc_dropped, 1);
+
+    return;
+  }
+
+  int nth_data_block = data_block_addr - DATA_BLOCKS_ADDR;
+  int group = nth_data_block / GROUP_BLOCKS;
+  int row_num = nth_data_block / 64;
+  int col_num = nth_data_block % 64;
+  uint64_t bit_mask = ~((uint64_t)1 << (63 - col_num));
+
+  pthread_mutex_lock(&fs->group_locks[group]);
+  if (fs->block_shares[nth_data_block] > 0) {
+    // the clone keeps it, and its pending write
+    __atomic_fetch_sub(&fs->block_shares[nth_data_block], 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&fs->group_locks[group]);
+
+    return;
+  }
+  if (block_in_use(fs, nth_data_block)) {
+    fs->free_block_list[row_num] &= bit_mask;
+    __atomic_fetch_add(&fs->group_free[group], 1, __ATOMIC_RELAXED);
+  }
+  wb_forget(fs, data_block_addr);
+  pthread_mutex_unlock(&fs->group_locks[group]);
+}
+
+// a block for the nth block of the file, which has none: a delayed one while
+// writes are buffered (until delayed blocks fill half the buffer), a free
+// block now otherwise. -1 if the disk is full.
+int new_data_block(sfs_t* fs, int nth_inode, int nth_inode_block) {
+  int max_dirty = __atomic_load_n(&fs->max_dirty, __ATOMIC_RELAXED);
+
+  if (
+    max_dirty > 0
+    && __atomic_load_n(&fs->wb_delayed, __ATOMIC_RELAXED) * 2 < max_dirty
+  ) {
+    // promised a block now, so the flusher always has one to place it in
+    if (
+      __atomic_add_fetch(&fs->reserved_blocks, 1, __ATOMIC_RELAXED)
+      <= free_blocks_total(fs)
+    ) {
+      COUNT(delalloc_blocks, 1);
+
+      return DELAYED_PTR(nth_inode, nth_inode_block);
+    }
+    __atomic_fetch_sub(&fs->reserved_blocks, 1, __ATOMIC_RELAXED);
+    COUNT(alloc_failures, 1);
+
+    return -1;
+  }
+
+  return alloc_data_block(
+    fs, nth_inode, alloc_goal(&fs->inode_table[nth_inode], nth_inode_block)
+  );
+}
+
+// gives the file's delayed blocks their places, all in one run if a free one
+// is that long and in as few as it takes otherwise, and moves their data
+// there. The caller holds the i-node's write lock. Returns how many are left
+// delayed because the disk had no room.
+int place_file(sfs_t* fs, int nth_inode) {
+  inode* file_inode = &fs->inode_table[nth_inode];
+  int slots[MAX_BLOCKS_PER_FILE];
+  int n = 0;
+  int placed = 0;
+
+  if (file_inode->mode != 1 || (file_inode->flags & INODE_INLINE)) {
+    return 0;
+  }
+  for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+    if (is_delayed(*get_block_ptr(file_inode, i))) {
+      slots[n++] = i;
+    }
+  }
+  if (n == 0) {
+    return 0;
+  }
+
+  while (placed < n) {
+    int want = n - placed;
+    int addr = -1;
+
+    // they were promised blocks, only how long a run there's room for is open
+    while (want > 0) {
+      addr = alloc_run(
+        fs, nth_inode, alloc_goal(file_inode, slots[placed]), want
+      );
+      if (addr != -1) {
+        break;
+      }
+      want /= 2;
+    }
+    if (addr == -1) {
+      break;
+    }
+
+    for (int i = 0; i < want; i++) {
+      unsigned int* slot = get_block_ptr(file_inode, slots[placed + i]);
+
+      wb_rekey(fs, *slot, addr + i);
+      *slot = addr + i;
+    }
+    __atomic_fetch_sub(&fs->reserved_blocks, want, __ATOMIC_RELAXED);
+    COUNT(delalloc_runs, 1);
+    placed += want;
+  }
+
+  if (placed < n) {
+    // The disk is full after all. What's left keeps its data and its promise
+    // and is tried again later, the next sync reports it.
+    __atomic_store_n(&fs->place_failed, true, __ATOMIC_RELEASE);
+    COUNT(delalloc_failures, n - placed);
+  }
+  if (placed > 0) {
+    write_inode(fs, nth_inode);
+    write_free_block_list(fs);
+  }
+
+  return n - placed;
+}
+
+// place_file for the flusher, on the files marked in files; a file whose lock
+// is taken is left for later (its writer may be waiting on the flusher) and
+// stays marked, the others are unmarked. Returns how many blocks are left
+// delayed because the disk had no room.
+int place_delayed(sfs_t* fs, bool* files) {
+  int unplaced = 0;
+
+  for (int i = 1; i < NUM_INODES; i++) {
+    if (files[i] && pthread_rwlock_trywrlock(&fs->inode_locks[i]) == 0) {
+      unplaced += place_file(fs, i);
+      pthread_rwlock_unlock(&fs->inode_locks[i]);
+      files[i] = false;
+    }
+  }
+
+  return unplaced;
+}
+
+// one more i-node points at the block
+void share_block(sfs_t* fs, unsigned int addr) {
+  int nth_data_block = addr - DATA_BLOCKS_ADDR;
+  int group = nth_data_block / GROUP_BLOCKS;
+
+  pthread_mutex_lock(&fs->group_locks[group]);
+  __atomic_fetch_add(&fs->block_shares[nth_data_block], 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&fs->group_locks[group]);
+}
+
+// whether some other i-node points at the block too. Only a call that holds
+// the lock of an i-node pointing at it can make that true, so a writer that
+// holds its own i-node's lock can trust a false.
+bool block_shared(sfs_t* fs, unsigned int addr) {
+  return __atomic_load_n(
+    &fs->block_shares[addr - DATA_BLOCKS_ADDR], __ATOMIC_RELAXED
+  ) > 0;
+}
+
+// the data blocks the file points at into addrs (MAX_BLOCKS_PER_FILE long), a
+// packed cluster's once for all of its slots, not the delayed ones; returns
+// how many
+int file_blocks(inode* file_inode, unsigned int* addrs) {
+  int n = 0;
+
+  if (file_inode->mode != 1 || (file_inode->flags & INODE_INLINE)) {
+    return 0;
+  }
+  for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+    unsigned int block_ptr = *get_block_ptr(file_inode, i);
+
+    if (block_ptr & BLOCK_PTR_COMPRESSED) {
+      for (
+        int j = 0; j < BLOCK_PTR_NBLOCKS(block_ptr) && n < MAX_BLOCKS_PER_FILE;
+        j++
+      ) {
+        addrs[n++] = BLOCK_PTR_ADDR(block_ptr) + j;
+      }
+      i += CLUSTER_BLOCKS - 1 - i % CLUSTER_BLOCKS;
+    } else if (block_ptr > 0 && !is_delayed(block_ptr)) {
+      addrs[n++] = block_ptr;
+    }
+  }
+
+  return n;
+}
+
+// recounts block_shares from the i-nodes, nothing else may be running
+void count_block_shares(sfs_t* fs) {
+  bool* seen = calloc(MAX_BLOCKS_ALL_FILES, sizeof(bool));
+  unsigned int addrs[MAX_BLOCKS_PER_FILE];
+
+  memset(fs->block_shares, 0, sizeof(fs->block_shares));
+  for (int i = 1; i < NUM_INODES; i++) {
+    int n = file_blocks(&fs->inode_table[i], addrs);
+
+    for (int j = 0; j < n; j++) {
+      int nth_data_block = addrs[j] - DATA_BLOCKS_ADDR;
+
+      if (!in_data_region(addrs[j], 1)) {
+        // fsck's problem
+        continue;
+      }
+      if (!seen[nth_data_block]) {
+        seen[nth_data_block] = true;
+      } else if (fs->block_shares[nth_data_block] < UINT16_MAX) {
+        fs->block_shares[nth_data_block]++;
+      }
+    }
+  }
+  free(seen);
+}
+
+void reset_fdt(sfs_t* fs) {
+  for (int i = 0; i < NUM_INODES; i++) {
+    fs->fdt[i].inode = -1;
+    fs->fdt[i].rwptr = 0;
+  }
+}
+
+void init_superblock(sfs_t* fs) {
+  fs->supblock.magic = SFS_MAGIC;
+  fs->supblock.block_size = BLOCK_SIZE;
+  fs->supblock.inode_table_len = NUM_INODE_BLOCKS;
+  fs->supblock.root_dir_inode = 0;  // 0th i-node -> root dir
+  fs->supblock.flags = 0;
+  fs->supblock.fs_size = 1 // superblock 
+    + NUM_ROOT_BLOCKS
+    + NUM_INODE_BLOCKS
+    + MAX_BLOCKS_ALL_FILES
+    + NUM_FREE_BITMAP_BLOCKS;
+}
+
+// traces tell data from metadata by the block, and one is started right away
+// if the environment asks for it
+void setup_disk(sfs_t* fs) {
+  char* trace = getenv("SFS_TRACE");
+
+  set_disk_data_area_r(fs->disk, DATA_BLOCKS_ADDR, MAX_BLOCKS_ALL_FILES);
+  if (trace != NULL && trace[0] != '\0') {
+    start_disk_trace_r(fs->disk, trace);
+  }
+}
+
+// an sfs_t with its locks and writeback set up, but no disk yet
+sfs_t* new_fs() {
+  sfs_t* fs = calloc(1, sizeof(sfs_t));
+
+  pthread_rwlock_init(&fs->ns_lock, NULL);
+  for (int i = 0; i < NUM_INODES; i++) {
+    pthread_rwlock_init(&fs->inode_locks[i], NULL);
+  }
+  for (int i = 0; i < NUM_ALLOC_GROUPS; i++) {
+    pthread_mutex_init(&fs->group_locks[i], NULL);
+  }
+  pthread_mutex_init(&fs->disk_table_lock, NULL);
+  pthread_mutex_init(&fs->wb_lock, NULL);
+  pthread_cond_init(&fs->wb_drained, NULL);
+
+  // the flusher sleeps until blocks come of age, on the monotonic clock
+  pthread_condattr_t wake_attr;
+  pthread_condattr_init(&wake_attr);
+  pthread_condattr_setclock(&wake_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&fs->wb_wake, &wake_attr);
+  pthread_condattr_destroy(&wake_attr);
+
+  fs->max_dirty = SFS_WB_MAX_DIRTY_BLOCKS;
+  fs->max_age_ms = SFS_WB_MAX_AGE_MS;
+
+  fs->current_file = 0;
+  init_superblock(fs);
+
+  return fs;
+}
+
+// sfs_mount, and sfs_mount_damaged if damaged_ok
+sfs_t* mount_fs(char* path, int fresh, bool damaged_ok) {
+  sfs_t* fs = new_fs();
+
+  if (fresh) {
+    // reset cache
+    for (int i = 0; i < NUM_INODES; i++) {
+
+      fs->fdt[i].inode = -1;
+      fs->fdt[i].rwptr = 0;
+
+      fs->dir_table[i].mode = 0;
+    }
+
+    // init root
+    fs->fdt[0].inode = 0; // 0th i-node is for the root
+    fs->inode_table[0].mode = 1;
+
+    // init and write onto disk
+    fs->disk = init_fresh_disk_r(path, BLOCK_SIZE, fs->supblock.fs_size);
+    if (fs->disk == NULL) {
+      sfs_unmount(fs);
+
+      return NULL;
+    }
+    setup_disk(fs);
+    table_blocks_io(fs, true, 0, &fs->supblock, sizeof(fs->supblock), 0, 0);
+    write_inode_table(fs);
+    write_dir_table(fs);
+    write_free_block_list(fs);
+
+    fflush(stdout);
+  } else {
+    // all files are unopened except root
+    reset_fdt(fs);
+    fs->fdt[0].inode = 0;
+
+    // init and read from disk
+    fs->disk = init_disk_r(path, BLOCK_SIZE, fs->supblock.fs_size);
+    if (fs->disk == NULL) {
+      sfs_unmount(fs);
+
+      return NULL;
+    }
+    setup_disk(fs);
+    bool damaged = table_blocks_io(
+      fs, false, 0, &fs->supblock, sizeof(fs->supblock), 0, 0
+    ) < 0;
+    if (
+      fs->supblock.magic != SFS_MAGIC || fs->supblock.block_size != BLOCK_SIZE
+    ) {
+      // not sfs, or laid out differently: every table would be misread
+      printf("%s: not an sfs image (bad superblock)\n", path);
+      sfs_unmount(fs);
+
+      return NULL;
+    }
+    damaged |= table_blocks_io(
+      fs, false, 1, fs->inode_table, sizeof(fs->inode_table),
+      0, NUM_INODE_BLOCKS - 1
+    ) < 0;
+    memcpy(fs->inode_disk_table, fs->inode_table, sizeof(fs->inode_table));
+    damaged |= table_blocks_io(
+      fs, false, 1 + NUM_INODE_BLOCKS, fs->dir_table, sizeof(fs->dir_table),
+      0, NUM_ROOT_BLOCKS - 1
+    ) < 0;
+    damaged |= table_blocks_io(
+      fs, false, FREE_BLOCK_LIST_ADDR, fs->free_block_list,
+      sizeof(fs->free_block_list), 0, NUM_FREE_BITMAP_BLOCKS - 1
+    ) < 0;
+    if (damaged && !damaged_ok) {
+      // running on them would spread the damage, sfs_fsck can repair it
+      printf("%s: tables fail their checksums, run sfs_fsck\n", path);
+      sfs_unmount(fs);
+
+      return NULL;
+    }
+  }
+
+  count_free_blocks(fs);
+  count_block_shares(fs);
+  pthread_create(&fs->flusher, NULL, flusher_main, fs);
+  fs->flusher_running = true;
+
+  return fs;
+}
+
+sfs_t* sfs_mount(char* path, int fresh) {
+  return mount_fs(path, fresh, false);
+}
+
+sfs_t* sfs_mount_damaged(char* path) {
+  return mount_fs(path, 0, true);
+}
+
+void sfs_unmount(sfs_t* fs) {
+  if (fs == NULL) {
+    return;
+  }
+
+  if (fs->flusher_running) {
+    // it writes everything that's still dirty before it exits
+    pthread_mutex_lock(&fs->wb_lock);
+    fs->stopping = true;
+    pthread_cond_signal(&fs->wb_wake);
+    pthread_mutex_unlock(&fs->wb_lock);
+    pthread_join(fs->flusher, NULL);
+  }
+  // all that can be left is what the disk had no room for
+  for (int i = 0; i < WB_BUCKETS; i++) {
+    while (fs->wb_table[i] != NULL) {
+      wb_block* block = fs->wb_table[i];
+
+      fs->wb_table[i] = block->next;
+      free(block);
+    }
+  }
+
+  close_disk_r(fs->disk);
+  pthread_rwlock_destroy(&fs->ns_lock);
+  for (int i = 0; i < NUM_INODES; i++) {
+    pthread_rwlock_destroy(&fs->inode_locks[i]);
+  }
+  for (int i = 0; i < NUM_ALLOC_GROUPS; i++) {
+    pthread_mutex_destroy(&fs->group_locks[i]);
+  }
+  pthread_mutex_destroy(&fs->disk_table_lock);
+  pthread_mutex_destroy(&fs->wb_lock);
+  pthread_cond_destroy(&fs->wb_wake);
+  pthread_cond_destroy(&fs->wb_drained);
+  free(fs);
+}
+
+int sfs_start_trace_r(sfs_t* fs, const char* path) {
+  return start_disk_trace_r(fs->disk, path);
+}
+
+void sfs_stop_trace_r(sfs_t* fs) {
+  stop_disk_trace_r(fs->disk);
+}
+
+// programs using the original API never unmount, their writes still have to
+// make it to disk
+void sync_default_fs() {
+  if (default_fs != NULL) {
+    sfs_sync_r(default_fs);
+  }
+}
+
+// not thread safe, nothing else may be using the file system while it runs
+void mksfs(int fresh) {
+  static bool registered = false;
+
+  if (!registered) {
+    atexit(sync_default_fs);
+    registered = true;
+  }
+  sfs_unmount(default_fs);
+  default_fs = sfs_mount(DISK, fresh);
+}
+
+uint64_t elapsed_ns(struct timespec* start) {
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) * 1000000000ULL
+    + end.tv_nsec - start->tv_nsec;
+}
+
+// decompresses a packed cluster's blocks into cluster_buf, -1 (and zeros) if
+// they're corrupt
+int unpack_cluster(sfs_t* fs, const char* packed, char* cluster_buf) {
+  uint32_t packed_len;
+  struct timespec start;
+
+  memcpy(&packed_len, packed, sizeof(packed_len));
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int len = -1;
+  if (packed_len <= CLUSTER_SIZE - sizeof(packed_len)) {
+    len = lz_decompress(
+      packed + sizeof(packed_len), packed_len, cluster_buf, CLUSTER_SIZE
+    );
+  }
+  STAT_ADD(decompress_ns, elapsed_ns(&start));
+
+  if (len < 0) {
+    // corrupt, don't hand out garbage
+    memset(cluster_buf, 0, CLUSTER_SIZE);
+
+    return -1;
+  }
+  memset(cluster_buf + len, 0, CLUSTER_SIZE - len);
+  STAT_ADD(bytes_decompressed, len);
+
+  return 0;
+}
+
+int read_packed_cluster(sfs_t* fs, unsigned int block_ptr, char* cluster_buf) {
+  char packed[CLUSTER_SIZE];
+
+  if (
+    read_data_blocks(
+      fs, BLOCK_PTR_ADDR(block_ptr), BLOCK_PTR_NBLOCKS(block_ptr), packed
+    ) < 0
+  ) {
+    // failed its checksum
+    memset(cluster_buf, 0, CLUSTER_SIZE);
+
+    return -1;
+  }
+
+  return unpack_cluster(fs, packed, cluster_buf);
+}
+
+// fills cluster_buf with a cluster's current contents, whichever way it's stored
+void load_cluster(sfs_t* fs, unsigned int** slots, char* cluster_buf) {
+  if (*slots[0] & BLOCK_PTR_COMPRESSED) {
+    read_packed_cluster(fs, *slots[0], cluster_buf);
+
+    return;
+  }
+
+  for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+    if (*slots[i] > 0) {
+      read_data_blocks(fs, *slots[i], 1, cluster_buf + i * BLOCK_SIZE);
+    } else {
+      memset(cluster_buf + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+    }
+  }
+}
+
+// gives back the data blocks a cluster uses and turns it into a hole
+void release_cluster(sfs_t* fs, unsigned int** slots) {
+  if (*slots[0] & BLOCK_PTR_COMPRESSED) {
+    unsigned int addr = BLOCK_PTR_ADDR(*slots[0]);
+
+    for (int i = 0; i < BLOCK_PTR_NBLOCKS(*slots[0]); i++) {
+      free_from_block_list(fs, addr + i);
+    }
+  } else {
+    for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+      if (*slots[i] > 0) {
+        free_from_block_list(fs, *slots[i]);
+      }
+    }
+  }
+
+  for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+    *slots[i] = 0;
+  }
+}
+
+// write_file for compressed files, one whole cluster at a time
+int write_compressed(
+  sfs_t* fs, int nth_inode, const char* buf, int length, uint32_t offset
+) {
+  inode* file_inode = &fs->inode_table[nth_inode];
+  int bytes_written = 0;
+  bool changed = false;
+
+  while (bytes_written < length && offset < FILE_CAPACITY) {
+    int cluster = offset / CLUSTER_SIZE;
+    int cluster_offset = offset % CLUSTER_SIZE;
+    int chunk = CLUSTER_SIZE - cluster_offset;
+    unsigned int* slots[CLUSTER_BLOCKS];
+    char cluster_buf[CLUSTER_SIZE];
+    // length prefix + compressed bytes, has to come out smaller than a cluster
+    char packed[CLUSTER_SIZE];
+    uint32_t packed_len;
+    struct timespec start;
+
+    if (chunk > length - bytes_written) {
+      chunk = length - bytes_written;
+    }
+    for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+      slots[i] = get_block_ptr(file_inode, cluster * CLUSTER_BLOCKS + i);
+    }
+
+    // PREPARE CLUSTER BUFFER
+    if (chunk < CLUSTER_SIZE) {
+      load_cluster(fs, slots, cluster_buf);
+    }
+    memcpy(cluster_buf + cluster_offset, buf + bytes_written, chunk);
+
+    // COMPRESS
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    packed_len = lz_compress(
+      cluster_buf, CLUSTER_SIZE, packed + sizeof(packed_len),
+      (CLUSTER_BLOCKS - 1) * BLOCK_SIZE - sizeof(packed_len)
+    );
+    STAT_ADD(compress_ns, elapsed_ns(&start));
+    STAT_ADD(bytes_in, CLUSTER_SIZE);
+
+    if (packed_len > 0) {
+      // WRITE PACKED CLUSTER
+      int nblocks = (sizeof(packed_len) + packed_len + BLOCK_SIZE - 1)
+        / BLOCK_SIZE;
+      int addr = alloc_data_run(
+        fs, nth_inode, alloc_goal(file_inode, cluster * CLUSTER_BLOCKS), nblocks
+      );
+
+      if (addr == -1) {
+        // no room, keep whatever made it to disk
+        break;
+      }
+      memcpy(packed, &packed_len, sizeof(packed_len));
+      memset(
+        packed + sizeof(packed_len) + packed_len, 0,
+        nblocks * BLOCK_SIZE - sizeof(packed_len) - packed_len
+      );
+      write_data_blocks(fs, addr, nblocks, packed);
+
+      // the new copy is on disk, now drop the old one
+      release_cluster(fs, slots);
+      for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+        *slots[i] = BLOCK_PTR_COMPRESSED | (nblocks << 24) | addr;
+      }
+
+      STAT_ADD(clusters_packed, 1);
+      STAT_ADD(bytes_out, nblocks * BLOCK_SIZE);
+    } else {
+      // WRITE PLAIN BLOCKS
+      // only blocks that hold data or are being written get one
+      bool was_packed = *slots[0] & BLOCK_PTR_COMPRESSED;
+      unsigned int addrs[CLUSTER_BLOCKS];
+      bool out_of_space = false;
+
+      for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+        bool touched = i * BLOCK_SIZE < cluster_offset + chunk
+          && cluster_offset < (i + 1) * BLOCK_SIZE;
+        // a block a clone shares is copied if it changes, and left alone if
+        // it doesn't
+        bool copy = !was_packed && *slots[i] > 0 && touched
+          && block_shared(fs, *slots[i]);
+
+        addrs[i] = was_packed || copy ? 0 : *slots[i];
+        if (addrs[i] == 0 && (touched || was_packed || copy)) {
+          // right after the block before it, to keep the cluster together
+          unsigned int goal = i > 0 && addrs[i - 1] > 0
+            ? addrs[i - 1] + 1
+            : alloc_goal(file_inode, cluster * CLUSTER_BLOCKS + i);
+          int addr = alloc_data_block(fs, nth_inode, goal);
+
+          if (addr == -1) {
+            out_of_space = true;
+            break;
+          }
+          addrs[i] = addr;
+        }
+      }
+      if (out_of_space) {
+        // undo the blocks this cluster just took
+        for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+          if (addrs[i] > 0 && addrs[i] != *slots[i]) {
+            free_from_block_list(fs, addrs[i]);
+          }
+        }
+        break;
+      }
+
+      int nblocks = 0;
+      for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+        // shared blocks that are kept didn't change
+        bool kept_shared = addrs[i] > 0 && addrs[i] == *slots[i]
+          && block_shared(fs, addrs[i]);
+
+        if (addrs[i] > 0 && !kept_shared) {
+          write_data_blocks(fs, addrs[i], 1, cluster_buf + i * BLOCK_SIZE);
+          nblocks++;
+        }
+      }
+      if (was_packed) {
+        release_cluster(fs, slots);
+      } else {
+        // drop the shared blocks that were copied
+        for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+          if (*slots[i] > 0 && addrs[i] != *slots[i]) {
+            free_from_block_list(fs, *slots[i]);
+          }
+        }
+      }
+      for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+        *slots[i] = addrs[i];
+      }
+
+      STAT_ADD(clusters_raw, 1);
+      STAT_ADD(bytes_out, nblocks * BLOCK_SIZE);
+    }
+
+    changed = true;
+    bytes_written += chunk;
+    offset += chunk;
+    if (file_inode->size < offset) {
+      file_inode->size = offset;
+    }
+  }
+
+  // UPDATE METADATA ONCE FOR THE WHOLE CALL
+  if (changed) {
+    write_inode(fs, nth_inode);
+    write_free_block_list(fs);
+  }
+
+  return bytes_written;
+}
+
+// moves an inline file's bytes into its first data block, returns -1 (and
+// leaves the file inline) if no block is free
+int uninline_file(sfs_t* fs, int nth_inode) {
+  inode* file_inode = &fs->inode_table[nth_inode];
+  char block_buf[BLOCK_SIZE];
+
+  if (file_inode->size == 0) {
+    // nothing to move
+    file_inode->flags &= ~INODE_INLINE;
+    memset(file_inode->indirect, 0, sizeof(file_inode->indirect));
+
+    return 0;
+  }
+
+  // write_compressed packs clusters as it goes, it has no use for delayed
+  // blocks
+  int data_block_addr = file_inode->flags & INODE_COMPRESSED
+    ? alloc_data_block(fs, nth_inode, 0)
+    : new_data_block(fs, nth_inode, 0);
+  if (data_block_addr == -1) {
+    return -1;
+  }
+
+  // INLINE_DATA_CAPACITY is exactly one block
+  memcpy(block_buf, inline_data(file_inode), BLOCK_SIZE);
+  write_data_blocks(fs, data_block_addr, 1, block_buf);
+
+  memset(file_inode->indirect, 0, sizeof(file_inode->indirect));
+  file_inode->direct[0] = data_block_addr;
+  file_inode->flags &= ~INODE_INLINE;
+  write_inode(fs, nth_inode);
+  if (!is_delayed(data_block_addr)) {
+    write_free_block_list(fs);
+  }
+
+  return 0;
+}
+
+// looks a file up by name, the caller holds ns_lock
+int find_file(sfs_t* fs, const char* name) {
+  for (int i = 1; i < NUM_INODES; i++) {
+    if (
+      fs->dir_table[i].mode == 1 && strcmp(name, fs->dir_table[i].name) == 0
+    ) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+// takes a free fd slot for the i-node, -1 if the FDT is full
+int claim_fd(sfs_t* fs, int nth_inode, uint32_t rwptr) {
+  for (int j = 1; j < NUM_INODES; j++) {
+    int expected = -1;
+
+    if (
+      __atomic_load_n(&fs->fdt[j].inode, __ATOMIC_RELAXED) == -1
+      && __atomic_compare_exchange_n(
+        &fs->fdt[j].inode, &expected, nth_inode, false,
+        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED
+      )
+    ) {
+      fs->fdt[j].rwptr = rwptr;
+
+      return j;
+    }
+  }
+
+  return -1;
+}
+
+// creates an empty file, returns its i-node or -1 if they're all in use. The
+// caller holds ns_lock for writing and has checked the name isn't taken.
+int create_file(sfs_t* fs, const char* name) {
+  for (int i = 1; i < NUM_INODES; i++) {
+    if (fs->inode_table[i].mode == 0) {
+      pthread_rwlock_wrlock(&fs->inode_locks[i]);
+      fs->inode_table[i].mode = 1;
+      fs->inode_table[i].flags = INODE_INLINE; // new files start out small
+      if (fs->supblock.flags & SFS_COMPRESS_NEW_FILES) {
+        fs->inode_table[i].flags |= INODE_COMPRESSED;
+      }
+      write_inode(fs, i);
+      pthread_rwlock_unlock(&fs->inode_locks[i]);
+
+      strcpy(fs->dir_table[i].name, name);
+      fs->dir_table[i].mode = 1;
+      write_dir_table(fs);
+
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+// gives back every data block of the file and leaves it empty with no flags,
+// the caller holds its i-node lock for writing and writes the i-node and the
+// bitmap out afterwards
+void free_file_blocks(sfs_t* fs, int nth_inode) {
+  inode* file_inode = &fs->inode_table[nth_inode];
+
+  file_inode->size = 0;
+  if (file_inode->flags & INODE_INLINE) {
+    // no blocks to give back, the "pointers" are file bytes
+    memset(file_inode->indirect, 0, sizeof(file_inode->indirect));
+    file_inode->flags = 0;
+
+    return;
+  }
+
+  // UPDATE FREE BLOCK LIST
+  for (int j = 0; j < MAX_BLOCKS_PER_FILE; j++) {
+    unsigned int* data_block_addr = get_block_ptr(file_inode, j);
+
+    if (*data_block_addr & BLOCK_PTR_COMPRESSED) {
+      // every slot of a packed cluster points at the same run
+      unsigned int* slots[CLUSTER_BLOCKS];
+
+      for (int k = 0; k < CLUSTER_BLOCKS; k++) {
+        slots[k] = get_block_ptr(file_inode, j + k);
+      }
+      release_cluster(fs, slots);
+      j += CLUSTER_BLOCKS - 1;
+    } else if (*data_block_addr > 0) {
+      // holes have nothing to give back (0 isn't a data block address)
+      free_from_block_list(fs, *data_block_addr);
+
+      *data_block_addr = 0;
+    }
+  }
+  file_inode->flags = 0;
+}
+
+int next_file_name(sfs_t* fs, char* fname) {
+  int visited = 0;
+
+  pthread_rwlock_wrlock(&fs->ns_lock); // moves the shared cursor
+  for (int i = 1; i < NUM_INODES; i++) {
+    if (fs->dir_table[i].mode == 1) {
+      if (visited == fs->current_file) {
+        strcpy(fname, fs->dir_table[i].name);
+        fs->current_file++;
+        pthread_rwlock_unlock(&fs->ns_lock);
+
+        return 1;
+      } else {
+        visited++;
+      }
+    }
+  }
+  fs->current_file = 0;
+  pthread_rwlock_unlock(&fs->ns_lock);
+
+  return 0;
+}
+
+int sfs_getnextfilename_r(sfs_t* fs, char* fname) {
+  uint64_t start = now_ns();
+  int result = next_file_name(fs, fname);
+
+  op_done(fs, SFS_OP_READDIR, start);
+
+  return result;
+}
+
+int read_dir(sfs_t* fs, int cookie, sfs_dirent* entry) {
+  // the cookie is the i-node to look from
+  pthread_rwlock_rdlock(&fs->ns_lock);
+  for (int i = cookie < 1 ? 1 : cookie; i < NUM_INODES; i++) {
+    if (fs->dir_table[i].mode == 1) {
+      strcpy(entry->name, fs->dir_table[i].name);
+      entry->inode = i;
+      pthread_rwlock_rdlock(&fs->inode_locks[i]);
+      entry->size = fs->inode_table[i].size;
+      pthread_rwlock_unlock(&fs->inode_locks[i]);
+      pthread_rwlock_unlock(&fs->ns_lock);
+
+      return i + 1;
+    }
+  }
+  pthread_rwlock_unlock(&fs->ns_lock);
+
+  return 0;
+}
+
+int sfs_readdir_r(sfs_t* fs, int cookie, sfs_dirent* entry) {
+  uint64_t start = now_ns();
+  int result = read_dir(fs, cookie, entry);
+
+  op_done(fs, SFS_OP_READDIR, start);
+
+  return result;
+}
+
+int file_size(sfs_t* fs, const char* path) {
+  if (!(0 <= strlen(path) && strlen(path) <= MAXFILENAME)) { // check arg
+    return 0;
+  }
+
+  int size = 0;
+
+  pthread_rwlock_rdlock(&fs->ns_lock);
+  int i = find_file(fs, path);
+  if (i != -1) {
+    pthread_rwlock_rdlock(&fs->inode_locks[i]);
+    size = fs->inode_table[i].size;
+    pthread_rwlock_unlock(&fs->inode_locks[i]);
+  }
+  pthread_rwlock_unlock(&fs->ns_lock);
+
+  return size;
+}
+
+int sfs_getfilesize_r(sfs_t* fs, const char* path) {
+  uint64_t start = now_ns();
+  int result = file_size(fs, path);
+
+  op_done(fs, SFS_OP_STAT, start);
+
+  return result;
+}
+
+// the fd the i-node already has, -1 if it has none
+int find_fd(sfs_t* fs, int nth_inode) {
+  for (int j = 1; j < NUM_INODES; j++) {
+    if (__atomic_load_n(&fs->fdt[j].inode, __ATOMIC_ACQUIRE) == nth_inode) {
+      return j;
+    }
+  }
+
+  return -1;
+}
+
+int open_file(sfs_t* fs, char* name) {
+  if (!(0 <= strlen(name) && strlen(name) <= MAXFILENAME)) {
+    return -1;
+  }
+
+  // filename length is valid
+
+  // must check for three cases: file and descriptor exists, only file exists,
+  // both don't exist
+
+  // the first only needs to look
+  pthread_rwlock_rdlock(&fs->ns_lock);
+  int i = find_file(fs, name);
+  int fileID = i != -1 ? find_fd(fs, i) : -1;
+  pthread_rwlock_unlock(&fs->ns_lock);
+  if (fileID != -1) {
+    return fileID;
+  }
+
+  // the others hold ns_lock for writing from the look to the claim, or two
+  // opens could both find no descriptor and claim one each
+  pthread_rwlock_wrlock(&fs->ns_lock);
+  i = find_file(fs, name);
+  if (i == -1) {
+    i = create_file(fs, name);
+  }
+  if (i != -1) {
+    fileID = find_fd(fs, i);
+    if (fileID == -1) {
+      // starts at the end (or the FDT is full and this stays -1)
+      pthread_rwlock_rdlock(&fs->inode_locks[i]);
+      fileID = claim_fd(fs, i, fs->inode_table[i].size);
+      pthread_rwlock_unlock(&fs->inode_locks[i]);
+    }
+  }
+  pthread_rwlock_unlock(&fs->ns_lock);
+
+  return fileID;
+}
+
+int sfs_fopen_r(sfs_t* fs, char* name) {
+  uint64_t start = now_ns();
+  int result = open_file(fs, name);
+
+  op_done(fs, SFS_OP_OPEN, start);
+
+  return result;
+}
+
+int close_fd(sfs_t* fs, int fileID) {
+  if (!(1 <= fileID && fileID < NUM_INODES)) { // check arg
+    return -1;
+  }
+
+  fd* f = &fs->fdt[fileID];
+  int nth_inode = __atomic_load_n(&f->inode, __ATOMIC_ACQUIRE);
+
+  // if file is already closed (or another thread beat us to it)
+  if (
+    nth_inode == -1
+    || !__atomic_compare_exchange_n(
+      &f->inode, &nth_inode, -1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED
+    )
+  ) {
+    return -1;
+  }
+  // rwptr is reset by whoever claims the slot next
+
+  return 0;
+}
+
+int sfs_fclose_r(sfs_t* fs, int fileID) {
+  uint64_t start = now_ns();
+  int result = close_fd(fs, fileID);
+
+  op_done(fs, SFS_OP_CLOSE, start);
+
+  return result;
+}
+
+// writes length bytes at offset, the caller holds the i-node's write lock
+int write_file(
+  sfs_t* fs, int nth_inode, const char* buf, int length, uint32_t offset
+) {
+  // INITIALIZE VARIABLES
+  bool allocated = false; // new data blocks were taken
+  bool remapped = false; // a block was swapped for a copy of its own
+  bool resized = false; // the file grew
+  int buf_len = length;
+  int bytes_written = 0;
+  inode* file_inode = &fs->inode_table[nth_inode];
+  int nth_inode_block = offset / BLOCK_SIZE; // starts from 0
+  unsigned int* data_block_addr;
+  // whole blocks not written yet, they're contiguous on disk and in buf
+  unsigned int run_addr = 0;
+  const char* run_src = NULL;
+  int run_blocks = 0;
+
+  // SANITY CHECK
+  if (
+    length <= 0
+    || offset >= FILE_CAPACITY
+    || file_inode->mode == 0 // removed while we waited for the lock
+  ) {
+    return 0;
+  }
+
+  // SMALL FILES STAY IN THE I-NODE
+  if (file_inode->flags & INODE_INLINE) {
+    if (offset + length <= INLINE_DATA_CAPACITY) {
+      memcpy(inline_data(file_inode) + offset, buf, length);
+      offset += length;
+      if (file_inode->size < offset) {
+        file_inode->size = offset;
+      }
+      write_inode(fs, nth_inode);
+
+      return length;
+    }
+
+    // outgrew the i-node
+    if (uninline_file(fs, nth_inode) == -1) {
+      return 0;
+    }
+  }
+
+  if (file_inode->flags & INODE_COMPRESSED) {
+    return write_compressed(fs, nth_inode, buf, length, offset);
+  }
+
+  while (bytes_written < buf_len && nth_inode_block < MAX_BLOCKS_PER_FILE) {
+    // GET N-TH I-NODE BLOCK
+    int block_offset = offset % BLOCK_SIZE;
+    char block_buf[BLOCK_SIZE];
+
+    data_block_addr = get_block_ptr(file_inode, nth_inode_block);
+    if (data_block_addr == NULL) {
+      // shouldn't get here
+
+      break;
+    }
+
+    // PREPARE BLOCK BUFFER
+    int chunk = BLOCK_SIZE - block_offset;
+    if (chunk > buf_len - bytes_written) {
+      chunk = buf_len - bytes_written;
+    }
+
+    // whole blocks are written straight from buf
+    const char* src = buf + bytes_written;
+
+    if (chunk < BLOCK_SIZE) {
+      if (*data_block_addr > 0) {
+        // data block is allocated and only partly overwritten
+
+        read_data_blocks(fs, *data_block_addr, 1, block_buf);
+      } else {
+        // a hole (or brand new block), whatever isn't written stays zero
+        memset(block_buf, 0, BLOCK_SIZE);
+      }
+
+      // EDIT BLOCK BUFFER
+      memcpy(block_buf + block_offset, buf + bytes_written, chunk);
+      src = block_buf;
+    }
+
+    // WRITE BLOCK BUFFER INTO DISK
+    if (
+      *data_block_addr == 0
+      || (!is_delayed(*data_block_addr)
+        && block_shared(fs, *data_block_addr))
+    ) {
+      // need a new data block, also for our own copy of a block a clone
+      // shares (block_buf already holds what it keeps of it)
+      int new_data_block_addr = new_data_block(fs, nth_inode, nth_inode_block);
+
+      if (new_data_block_addr == -1) {
+        // no free blocks, keep whatever made it to disk
+
+        break;
+      }
+      if (*data_block_addr > 0) {
+        free_from_block_list(fs, *data_block_addr);
+        remapped = true;
+      }
+      *data_block_addr = new_data_block_addr;
+      // a delayed block takes nothing from the bitmap, and the i-node on
+      // disk has a hole there until it's placed
+      allocated |= !is_delayed(new_data_block_addr);
+    }
+
+    // contiguous whole blocks are written out together
+    if (
+      src == buf + bytes_written && run_blocks > 0
+      && *data_block_addr == run_addr + run_blocks
+    ) {
+      run_blocks++;
+    } else {
+      if (run_blocks > 0) {
+        write_data_blocks(fs, run_addr, run_blocks, run_src);
+        run_blocks = 0;
+      }
+      if (src == block_buf) {
+        write_data_blocks(fs, *data_block_addr, 1, block_buf);
+      } else {
+        run_addr = *data_block_addr;
+        run_src = src;
+        run_blocks = 1;
+      }
+    }
+
+    bytes_written += chunk;
+    offset += chunk;
+    if (file_inode->size < offset) {
+      // a write past EOF leaves the skipped range as a hole
+      file_inode->size = offset;
+      resized = true;
+    }
+    nth_inode_block++;
+  }
+  if (run_blocks > 0) {
+    write_data_blocks(fs, run_addr, run_blocks, run_src);
+  }
+
+  // UPDATE METADATA ONCE FOR THE WHOLE CALL
+  if (allocated || remapped || resized) {
+    write_inode(fs, nth_inode);
+  }
+  if (allocated) {
+    write_free_block_list(fs);
+  }
+
+  return bytes_written;
+}
+
+// reads up to length bytes at offset, the caller holds the i-node's read lock
+int read_file(
+  sfs_t* fs, int nth_inode, char* buf, int length, uint32_t offset
+) {
+  // INITIALIZE VARIABLES
+  int buf_len = length;
+  int bytes_read = 0;
+  inode* file_inode = &fs->inode_table[nth_inode];
+  int nth_inode_block = offset / BLOCK_SIZE; // starts from 0
+  unsigned int* data_block_addr;
+
+  // SANITY CHECK
+  if (length <= 0 || offset >= FILE_CAPACITY || file_inode->mode == 0) {
+    return 0;
+  }
+
+  // never read past EOF
+  if (offset >= file_inode->size) {
+    return 0;
+  }
+  if (buf_len > file_inode->size - offset) {
+    buf_len = file_inode->size - offset;
+  }
+
+  if (file_inode->flags & INODE_INLINE) {
+    // no data blocks to read
+    memcpy(buf, inline_data(file_inode) + offset, buf_len);
+
+    return buf_len;
+  }
+
+  char cluster_buf[CLUSTER_SIZE];
+  int loaded_cluster = -1; // which packed cluster cluster_buf holds
+
+  while (bytes_read < buf_len && nth_inode_block < MAX_BLOCKS_PER_FILE) {
+    // GET N-TH I-NODE BLOCK
+    int block_offset = offset % BLOCK_SIZE;
+    int chunk = BLOCK_SIZE - block_offset;
+    char block_buf[BLOCK_SIZE];
+
+    data_block_addr = get_block_ptr(file_inode, nth_inode_block);
+    if (data_block_addr == NULL) {
+      // shouldn't get here
+
+      return bytes_read;
+    }
+    if (chunk > buf_len - bytes_read) {
+      chunk = buf_len - bytes_read;
+    }
+
+    // READ BLOCK
+    if (*data_block_addr == 0) {
+      // hole, reads back as zeros without touching the disk
+      memset(buf + bytes_read, 0, chunk);
+    } else if (*data_block_addr & BLOCK_PTR_COMPRESSED) {
+      // part of a packed cluster, decompress it once for all its blocks
+      int cluster = nth_inode_block / CLUSTER_BLOCKS;
+
+      if (cluster != loaded_cluster) {
+        if (read_packed_cluster(fs, *data_block_addr, cluster_buf) < 0) {
+          // don't hand out corrupt data
+          return bytes_read;
+        }
+        loaded_cluster = cluster;
+      }
+      memcpy(
+        buf + bytes_read,
+        cluster_buf + (nth_inode_block % CLUSTER_BLOCKS) * BLOCK_SIZE
+          + block_offset,
+        chunk
+      );
+    } else if (chunk == BLOCK_SIZE) {
+      // whole blocks go straight into buf, as many contiguous ones as there
+      // are in one go
+      int nblocks = 1;
+
+      while (
+        bytes_read + (nblocks + 1) * BLOCK_SIZE <= buf_len
+        && nth_inode_block + nblocks < MAX_BLOCKS_PER_FILE
+        && *get_block_ptr(file_inode, nth_inode_block + nblocks)
+          == *data_block_addr + nblocks
+      ) {
+        nblocks++;
+      }
+      if (
+        read_data_blocks(fs, *data_block_addr, nblocks, buf + bytes_read) < 0
+      ) {
+        // one of them failed its checksum, the ones before it are still good
+        // but nothing from it on is handed out
+        for (int i = 0; i < nblocks; i++) {
+          if (
+            read_data_blocks(fs, *data_block_addr + i, 1, buf + bytes_read) < 0
+          ) {
+            break;
+          }
+          bytes_read += BLOCK_SIZE;
+        }
+
+        return bytes_read;
+      }
+      chunk = nblocks * BLOCK_SIZE;
+      nth_inode_block += nblocks - 1;
+    } else {
+      if (read_data_blocks(fs, *data_block_addr, 1, block_buf) < 0) {
+        return bytes_read;
+      }
+      memcpy(buf + bytes_read, block_buf + block_offset, chunk);
+    }
+
+    bytes_read += chunk;
+    offset += chunk;
+    nth_inode_block++;
+  }
+
+  return bytes_read;
+}
+
+// returns the i-node an open fd refers to, or -1 (root and closed fds too)
+int fd_inode(sfs_t* fs, int fileID) {
+  if (!(1 <= fileID && fileID < NUM_INODES)) {
+    return -1;
+  }
+  int nth_inode = __atomic_load_n(&fs->fdt[fileID].inode, __ATOMIC_ACQUIRE);
+
+  return nth_inode > 0 ? nth_inode : -1;
+}
+
+int pwrite_fd(
+  sfs_t* fs, int fileID, const char* buf, int length, int offset
+) {
+  int nth_inode = fd_inode(fs, fileID);
+  if (nth_inode == -1 || offset < 0) {
+    return 0;
+  }
+
+  pthread_rwlock_wrlock(&fs->inode_locks[nth_inode]);
+  int bytes_written = write_file(fs, nth_inode, buf, length, offset);
+  pthread_rwlock_unlock(&fs->inode_locks[nth_inode]);
+
+  return bytes_written;
+}
+
+int sfs_pwrite_r(
+  sfs_t* fs, int fileID, const char* buf, int length, int offset
+) {
+  uint64_t start = now_ns();
+  int result = pwrite_fd(fs, fileID, buf, length, offset);
+
+  op_done(fs, SFS_OP_WRITE, start);
+  if (result > 0) {
+    COUNT(bytes_written, result);
+  }
+
+  return result;
+}
+
+int pread_fd(sfs_t* fs, int fileID, char* buf, int length, int offset) {
+  int nth_inode = fd_inode(fs, fileID);
+  if (nth_inode == -1 || offset < 0) {
+    return 0;
+  }
+
+  pthread_rwlock_rdlock(&fs->inode_locks[nth_inode]);
+  int bytes_read = read_file(fs, nth_inode, buf, length, offset);
+  pthread_rwlock_unlock(&fs->inode_locks[nth_inode]);
+
+  return bytes_read;
+}
+
+int sfs_pread_r(sfs_t* fs, int fileID, char* buf, int length, int offset) {
+  uint64_t start = now_ns();
+  int result = pread_fd(fs, fileID, buf, length, offset);
+
+  op_done(fs, SFS_OP_READ, start);
+  if (result > 0) {
+    COUNT(bytes_read, result);
+  }
+
+  return result;
+}
+
+int sfs_fwrite_r(sfs_t* fs, int fileID, const char* buf, int length) {
+  if (fd_inode(fs, fileID) == -1) {
+    return 0;
+  }
+
+  int bytes_written = sfs_pwrite_r(
+    fs, fileID, buf, length, fs->fdt[fileID].rwptr
+  );
+  fs->fdt[fileID].rwptr += bytes_written;
+
+  return bytes_written;
+}
+
+int sfs_fread_r(sfs_t* fs, int fileID, char* buf, int length) {
+  if (fd_inode(fs, fileID) == -1) {
+    return 0;
+  }
+
+  int bytes_read = sfs_pread_r(fs, fileID, buf, length, fs->fdt[fileID].rwptr);
+  fs->fdt[fileID].rwptr += bytes_read;
+
+  return bytes_read;
+}
+
+int sfs_fseek_r(sfs_t* fs, int fileID, int loc) {
+  if (!(0 <= loc && loc < FILE_CAPACITY)) { // check args
+    return -1;
+  }
+
+  if (fd_inode(fs, fileID) == -1) { // don't allow seeking root
+    return -1;
+  }
+  fs->fdt[fileID].rwptr = loc;
+
+  return 0;
+}
+
+int remove_file(sfs_t* fs, char* file) {
+  // ARGUMENT CHECKING
+  if (!(0 <= strlen(file) && strlen(file) <= MAXFILENAME)) {
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&fs->ns_lock);
+  int i = find_file(fs, file);
+  if (i == -1) {
+    pthread_rwlock_unlock(&fs->ns_lock);
+
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&fs->inode_locks[i]);
+  fs->inode_table[i].mode = 0;
+
+  // DELETE I-NODE
+  free_file_blocks(fs, i);
+
+  // DELETE FDs
+  // the i-node can be reused right away, so nothing may still point at it
+  for (int j = 1; j < NUM_INODES; j++) {
+    int expected = i;
+
+    __atomic_compare_exchange_n(
+      &fs->fdt[j].inode, &expected, -1, false, __ATOMIC_ACQ_REL,
+      __ATOMIC_RELAXED
+    );
+  }
+
+  // DELETE DIR ENTRY
+  fs->dir_table[i].mode = 0;
+
+  // UPDATE DISK
+  write_inode(fs, i);
+  pthread_rwlock_unlock(&fs->inode_locks[i]);
+  write_dir_table(fs);
+  write_free_block_list(fs);
+  pthread_rwlock_unlock(&fs->ns_lock);
+
+  return 0;
+}
+
+int sfs_remove_r(sfs_t* fs, char* file) {
+  uint64_t start = now_ns();
+  int result = remove_file(fs, file);
+
+  op_done(fs, SFS_OP_REMOVE, start);
+
+  return result;
+}
+
+void sfs_set_compression_r(sfs_t* fs, int on) {
+  pthread_rwlock_wrlock(&fs->ns_lock);
+  if (on) {
+    fs->supblock.flags |= SFS_COMPRESS_NEW_FILES;
+  } else {
+    fs->supblock.flags &= ~SFS_COMPRESS_NEW_FILES;
+  }
+  table_blocks_io(fs, true, 0, &fs->supblock, sizeof(fs->supblock), 0, 0);
+  pthread_rwlock_unlock(&fs->ns_lock);
+}
+
+void sfs_get_compress_stats_r(sfs_t* fs, sfs_compress_stats* stats) {
+  *stats = fs->stats.compress;
+}
+
+void sfs_get_stats_r(sfs_t* fs, sfs_stats* stats) {
+  // everything before disk is a uint64_t counter
+  const uint64_t* from = (const uint64_t*)&fs->stats;
+  uint64_t* to = (uint64_t*)stats;
+
+  for (size_t i = 0; i < offsetof(sfs_stats, disk) / sizeof(uint64_t); i++) {
+    to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+  }
+  get_disk_stats_r(fs->disk, &stats->disk);
+}
+
+// the upper end of the bucket the pth fraction of calls falls in
+uint64_t latency_percentile(const sfs_op_stats* op, double p) {
+  uint64_t target = op->count * p;
+  uint64_t seen = 0;
+
+  for (int b = 0; b < SFS_LATENCY_BUCKETS; b++) {
+    seen += op->latency[b];
+    if (seen > target) {
+      return b == SFS_LATENCY_BUCKETS - 1 ? op->max_ns : (2ULL << b) - 1;
+    }
+  }
+
+  return op->max_ns;
+}
+
+// appends a line to the text sfs_format_stats is building. *used keeps
+// counting past len, so the caller learns how much room it needs.
+void stats_printf(char* buf, int len, int* used, const char* fmt, ...) {
+  va_list args;
+  int room = *used < len ? len - *used : 0;
+
+  va_start(args, fmt);
+  *used += vsnprintf(room > 0 ? buf + *used : NULL, room, fmt, args);
+  va_end(args);
+}
+
+void stats_line(
+  char* buf, int len, int* used, const char* prefix, const char* name,
+  uint64_t value
+) {
+  stats_printf(
+    buf, len, used, "%s%s %llu\n", prefix, name, (unsigned long long)value
+  );
+}
+
+int sfs_format_stats(const sfs_stats* stats, char* buf, int len) {
+  static const char* op_names[SFS_NUM_OPS] = {
+    "open", "close", "read", "write", "remove", "truncate", "stat", "readdir",
+    "sync", "clone"
+  };
+  const sfs_compress_stats* compress = &stats->compress;
+  const disk_stats* disk = &stats->disk;
+  int used = 0;
+
+  if (len > 0) {
+    buf[0] = '\0';
+  }
+
+  // OPERATIONS
+  for (int op = 0; op < SFS_NUM_OPS; op++) {
+    const sfs_op_stats* s = &stats->ops[op];
+    char prefix[32];
+
+    sprintf(prefix, "op_%s_", op_names[op]);
+    stats_line(buf, len, &used, prefix, "count", s->count);
+    stats_line(buf, len, &used, prefix, "ns_total", s->total_ns);
+    stats_line(buf, len, &used, prefix, "ns_max", s->max_ns);
+    stats_line(buf, len, &used, prefix, "ns_p50", latency_percentile(s, 0.5));
+    stats_line(buf, len, &used, prefix, "ns_p99", latency_percentile(s, 0.99));
+    stats_line(
+      buf, len, &used, prefix, "ns_p999", latency_percentile(s, 0.999)
+    );
+  }
+
+  // BLOCKS AND BYTES
+  stats_line(buf, len, &used, "", "bytes_read", stats->bytes_read);
+  stats_line(buf, len, &used, "", "bytes_written", stats->bytes_written);
+  stats_line(buf, len, &used, "", "data_blocks_read", stats->data_blocks_read);
+  stats_line(
+    buf, len, &used, "", "data_blocks_written", stats->data_blocks_written
+  );
+  stats_line(buf, len, &used, "", "meta_blocks_read", stats->meta_blocks_read);
+  stats_line(
+    buf, len, &used, "", "meta_blocks_written", stats->meta_blocks_written
+  );
+  stats_line(buf, len, &used, "wb_", "hits", stats->wb_hits);
+  stats_line(buf, len, &used, "wb_", "misses", stats->wb_misses);
+  stats_line(buf, len, &used, "wb_", "overwrites", stats->wb_overwrites);
+
+  // ALLOCATION
+  stats_line(buf, len, &used, "alloc_", "calls", stats->alloc_calls);
+  stats_line(buf, len, &used, "alloc_", "blocks", stats->alloc_blocks);
+  stats_line(buf, len, &used, "alloc_", "failures", stats->alloc_failures);
+  stats_line(
+    buf, len, &used, "alloc_", "groups_scanned", stats->alloc_groups_scanned
+  );
+  stats_line(
+    buf, len, &used, "alloc_", "bits_scanned", stats->alloc_bits_scanned
+  );
+  stats_line(buf, len, &used, "delalloc_", "blocks", stats->delalloc_blocks);
+  stats_line(buf, len, &used, "delalloc_", "runs", stats->delalloc_runs);
+  stats_line(
+    buf, len, &used, "delalloc_", "dropped", stats->delalloc_dropped
+  );
+  stats_line(
+    buf, len, &used, "delalloc_", "failures", stats->delalloc_failures
+  );
+
+  // COMPRESSION
+  stats_line(
+    buf, len, &used, "compress_", "clusters_packed", compress->clusters_packed
+  );
+  stats_line(
+    buf, len, &used, "compress_", "clusters_raw", compress->clusters_raw
+  );
+  stats_line(buf, len, &used, "compress_", "bytes_in", compress->bytes_in);
+  stats_line(buf, len, &used, "compress_", "bytes_out", compress->bytes_out);
+
+  // DISK FILE
+  stats_line(buf, len, &used, "disk_", "reads", disk->reads);
+  stats_line(buf, len, &used, "disk_", "writes", disk->writes);
+  stats_line(buf, len, &used, "disk_", "blocks_read", disk->blocks_read);
+  stats_line(buf, len, &used, "disk_", "blocks_written", disk->blocks_written);
+  stats_line(
+    buf, len, &used, "disk_", "checksum_blocks_written",
+    disk->checksum_blocks_written
+  );
+  stats_line(
+    buf, len, &used, "disk_", "checksum_errors", disk->checksum_errors
+  );
+  stats_line(buf, len, &used, "disk_", "read_ns", disk->read_ns);
+  stats_line(buf, len, &used, "disk_", "write_ns", disk->write_ns);
+
+  // bytes the disk file took per byte written through the API
+  double amplification = stats->bytes_written == 0
+    ? 0
+    : (double)(disk->blocks_written + disk->checksum_blocks_written)
+      * BLOCK_SIZE / stats->bytes_written;
+  stats_printf(
+    buf, len, &used, "write_amplification %.3f\n", amplification
+  );
+
+  return used;
+}
+
+// I-NODE NUMBER API
+
+bool valid_inode(int nth_inode) {
+  return 1 <= nth_inode && nth_inode < NUM_INODES;
+}
+
+int lookup_file(sfs_t* fs, const char* name) {
+  if (strlen(name) > MAXFILENAME) {
+    return -1;
+  }
+
+  pthread_rwlock_rdlock(&fs->ns_lock);
+  int i = find_file(fs, name);
+  pthread_rwlock_unlock(&fs->ns_lock);
+
+  return i;
+}
+
+int sfs_lookup_r(sfs_t* fs, const char* name) {
+  uint64_t start = now_ns();
+  int result = lookup_file(fs, name);
+
+  op_done(fs, SFS_OP_STAT, start);
+
+  return result;
+}
+
+int create_or_find(sfs_t* fs, const char* name) {
+  if (strlen(name) > MAXFILENAME) {
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&fs->ns_lock);
+  int i = find_file(fs, name);
+  if (i == -1) {
+    i = create_file(fs, name);
+  }
+  pthread_rwlock_unlock(&fs->ns_lock);
+
+  return i;
+}
+
+int sfs_create_r(sfs_t* fs, const char* name) {
+  uint64_t start = now_ns();
+  int result = create_or_find(fs, name);
+
+  op_done(fs, SFS_OP_OPEN, start);
+
+  return result;
+}
+
+int inode_size(sfs_t* fs, int nth_inode) {
+  if (!valid_inode(nth_inode)) {
+    return -1;
+  }
+
+  int size = -1;
+
+  pthread_rwlock_rdlock(&fs->inode_locks[nth_inode]);
+  if (fs->inode_table[nth_inode].mode == 1) {
+    size = fs->inode_table[nth_inode].size;
+  }
+  pthread_rwlock_unlock(&fs->inode_locks[nth_inode]);
+
+  return size;
+}
+
+int sfs_inode_size_r(sfs_t* fs, int nth_inode) {
+  uint64_t start = now_ns();
+  int result = inode_size(fs, nth_inode);
+
+  op_done(fs, SFS_OP_STAT, start);
+
+  return result;
+}
+
+int pwrite_inode(
+  sfs_t* fs, int nth_inode, const char* buf, int length, int offset
+) {
+  if (!valid_inode(nth_inode) || offset < 0) {
+    return 0;
+  }
+
+  int bytes_written = 0;
+
+  pthread_rwlock_wrlock(&fs->inode_locks[nth_inode]);
+  if (fs->inode_table[nth_inode].mode == 1) {
+    bytes_written = write_file(fs, nth_inode, buf, length, offset);
+  }
+  pthread_rwlock_unlock(&fs->inode_locks[nth_inode]);
+
+  return bytes_written;
+}
+
+int sfs_pwrite_inode_r(
+  sfs_t* fs, int nth_inode, const char* buf, int length, int offset
+) {
+  uint64_t start = now_ns();
+  int result = pwrite_inode(fs, nth_inode, buf, length, offset);
+
+  op_done(fs, SFS_OP_WRITE, start);
+  if (result > 0) {
+    COUNT(bytes_written, result);
+  }
+
+  return result;
+}
+
+int pread_inode(
+  sfs_t* fs, int nth_inode, char* buf, int length, int offset
+) {
+  if (!valid_inode(nth_inode) || offset < 0) {
+    return 0;
+  }
+
+  int bytes_read = 0;
+
+  pthread_rwlock_rdlock(&fs->inode_locks[nth_inode]);
+  if (fs->inode_table[nth_inode].mode == 1) {
+    bytes_read = read_file(fs, nth_inode, buf, length, offset);
+  }
+  pthread_rwlock_unlock(&fs->inode_locks[nth_inode]);
+
+  return bytes_read;
+}
+
+int sfs_pread_inode_r(
+  sfs_t* fs, int nth_inode, char* buf, int length, int offset
+) {
+  uint64_t start = now_ns();
+  int result = pread_inode(fs, nth_inode, buf, length, offset);
+
+  op_done(fs, SFS_OP_READ, start);
+  if (result > 0) {
+    COUNT(bytes_read, result);
+  }
+
+  return result;
+}
+
+int empty_inode(sfs_t* fs, int nth_inode) {
+  if (!valid_inode(nth_inode)) {
+    return -1;
+  }
+
+  pthread_rwlock_wrlock(&fs->inode_locks[nth_inode]);
+  inode* file_inode = &fs->inode_table[nth_inode];
+  if (file_inode->mode != 1) {
+    pthread_rwlock_unlock(&fs->inode_locks[nth_inode]);
+
+    return -1;
+  }
+
+  // the file keeps its compression setting, and starts out small again
+  unsigned int compressed = file_inode->flags & INODE_COMPRESSED;
+  free_file_blocks(fs, nth_inode);
+  file_inode->flags = INODE_INLINE | compressed;
+  write_inode(fs, nth_inode);
+  pthread_rwlock_unlock(&fs->inode_locks[nth_inode]);
+  write_free_block_list(fs);
+
+  return 0;
+}
+
+int sfs_empty_inode_r(sfs_t* fs, int nth_inode) {
+  uint64_t start = now_ns();
+  int result = empty_inode(fs, nth_inode);
+
+  op_done(fs, SFS_OP_TRUNCATE, start);
+
+  return result;
+}
+
+// CLONES
+
+// makes dst a clone of src, the caller holds both i-node locks for writing;
+// -1 (and dst left alone) if some of src's blocks have no place on disk yet
+int clone_file(sfs_t* fs, int src_inode, int dst_inode) {
+  unsigned int addrs[MAX_BLOCKS_PER_FILE];
+
+  // a delayed block only has a place in wb_table, under src's slot
+  if (place_file(fs, src_inode) > 0) {
+    return -1;
+  }
+
+  int n = file_blocks(&fs->inode_table[src_inode], addrs);
+
+  // src keeps the blocks the two may already share while dst drops them
+  free_file_blocks(fs, dst_inode);
+  // the pointers, or the bytes of an inline file
+  fs->inode_table[dst_inode] = fs->inode_table[src_inode];
+  for (int i = 0; i < n; i++) {
+    share_block(fs, addrs[i]);
+  }
+  if (n > 0) {
+    // so sfs_fsck can tell it from a cross-link
+    fs->inode_table[src_inode].flags |= INODE_SHARED;
+    fs->inode_table[dst_inode].flags |= INODE_SHARED;
+    write_inode(fs, src_inode);
+  }
+  write_inode(fs, dst_inode);
+  write_free_block_list(fs);
+
+  return 0;
+}
+
+int clone_inode(sfs_t* fs, int src_inode, int dst_inode) {
+  if (!valid_inode(src_inode) || !valid_inode(dst_inode)) {
+    return -1;
+  }
+
+  pthread_rwlock_t* src_lock = &fs->inode_locks[src_inode];
+  pthread_rwlock_t* dst_lock = &fs->inode_locks[dst_inode];
+  int result = -1;
+
+  // lowest first, and just the one if it's a clone of itself
+  if (src_inode < dst_inode) {
+    pthread_rwlock_wrlock(src_lock);
+  }
+  pthread_rwlock_wrlock(dst_lock);
+  if (src_inode > dst_inode) {
+    pthread_rwlock_wrlock(src_lock);
+  }
+
+  if (
+    fs->inode_table[src_inode].mode == 1 && fs->inode_table[dst_inode].mode == 1
+  ) {
+    result = dst_inode;
+    if (src_inode != dst_inode && clone_file(fs, src_inode, dst_inode) == -1) {
+      result = -1;
+    }
+  }
+
+  if (src_inode != dst_inode) {
+    pthread_rwlock_unlock(src_lock);
+  }
+  pthread_rwlock_unlock(dst_lock);
+
+  return result;
+}
+
+int sfs_clone_inode_r(sfs_t* fs, int src_inode, int dst_inode) {
+  uint64_t start = now_ns();
+  int result = clone_inode(fs, src_inode, dst_inode);
+
+  op_done(fs, SFS_OP_CLONE, start);
+
+  return result;
+}
+
+int clone_by_name(sfs_t* fs, const char* src, const char* dst) {
+  if (strlen(dst) > MAXFILENAME) {
+    return -1;
+  }
+
+  // held throughout, so neither name can go away or change hands meanwhile
+  pthread_rwlock_wrlock(&fs->ns_lock);
+  int src_inode = find_file(fs, src);
+  int dst_inode = -1;
+
+  if (src_inode != -1) {
+    dst_inode = find_file(fs, dst);
+    if (dst_inode == -1) {
+      dst_inode = create_file(fs, dst);
+    }
+  }
+  if (dst_inode != -1) {
+    dst_inode = clone_inode(fs, src_inode, dst_inode);
+  }
+  pthread_rwlock_unlock(&fs->ns_lock);
+
+  return dst_inode;
+}
+
+int sfs_clone_r(sfs_t* fs, const char* src, const char* dst) {
+  uint64_t start = now_ns();
+  int result = clone_by_name(fs, src, dst);
+
+  op_done(fs, SFS_OP_CLONE, start);
+
+  return result;
+}
+
+// DEDUP
+
+// a block, or a packed cluster's blocks, the pass has seen: the file slot it
+// was first seen through (the first of the cluster's if packed)
+typedef struct {
+  uint32_t hash; // crc32c of the blocks
+  int nth_inode;
+  int nth_inode_block;
+  unsigned int block_ptr; // 0 for an empty entry
+} dedup_entry;
+
+typedef struct {
+  sfs_t* fs;
+  int flags;
+  sfs_dedup_report* report;
+  dedup_entry* index; // open addressing, linear probing
+  int capacity; // a power of two
+  int used;
+} dedup_state;
+
+enum { DEDUP_DIFFERENT, DEDUP_STALE, DEDUP_BUSY, DEDUP_MERGED };
+
+// the blocks block_ptr points at into buf, returns how many or -1 if they
+// fail their checksum
+int dedup_read(sfs_t* fs, unsigned int block_ptr, char* buf) {
+  unsigned int addr = block_ptr;
+  int nblocks = 1;
+
+  if (block_ptr & BLOCK_PTR_COMPRESSED) {
+    addr = BLOCK_PTR_ADDR(block_ptr);
+    nblocks = BLOCK_PTR_NBLOCKS(block_ptr);
+  }
+
+  return read_data_blocks(fs, addr, nblocks, buf) < 0 ? -1 : nblocks;
+}
+
+// points the file's slot first (or the packed cluster starting there) at
+// block_ptr, which holds the same bytes, instead of what it points at now;
+// returns how many blocks that frees. The caller holds the i-node's write
+// lock and a lock of an i-node pointing at block_ptr.
+int dedup_remap(
+  sfs_t* fs, inode* file_inode, int first, unsigned int block_ptr
+) {
+  unsigned int* slots[CLUSTER_BLOCKS];
+  unsigned int old_addr = *get_block_ptr(file_inode, first);
+  unsigned int new_addr = block_ptr;
+  int nblocks = 1;
+  int freed = 0;
+
+  if (block_ptr & BLOCK_PTR_COMPRESSED) {
+    old_addr = BLOCK_PTR_ADDR(old_addr);
+    new_addr = BLOCK_PTR_ADDR(block_ptr);
+    nblocks = BLOCK_PTR_NBLOCKS(block_ptr);
+  }
+  for (int i = 0; i < nblocks; i++) {
+    share_block(fs, new_addr + i);
+    freed += !block_shared(fs, old_addr + i);
+  }
+
+  if (block_ptr & BLOCK_PTR_COMPRESSED) {
+    for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+      slots[i] = get_block_ptr(file_inode, first + i);
+    }
+    release_cluster(fs, slots);
+    for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+      *slots[i] = block_ptr;
+    }
+  } else {
+    free_from_block_list(fs, old_addr);
+    *get_block_ptr(file_inode, first) = block_ptr;
+  }
+
+  return freed;
+}
+
+// merges the file's blocks at slot first (block_ptr, nblocks of them, holding
+// data) into the indexed entry's if they still hold the same bytes; both files
+// are marked INODE_SHARED, so the owner is locked for writing unless it's a
+// dry run
+int dedup_try(
+  dedup_state* st, dedup_entry* entry, int nth_inode, int first,
+  unsigned int block_ptr, const char* data, int nblocks
+) {
+  sfs_t* fs = st->fs;
+  int owner = entry->nth_inode;
+  inode* owner_inode = &fs->inode_table[owner];
+  char other[CLUSTER_SIZE];
+  int result = DEDUP_STALE;
+
+  bool dry_run = st->flags & SFS_DEDUP_DRY_RUN;
+
+  if (
+    owner != nth_inode
+    && (dry_run
+      ? pthread_rwlock_tryrdlock(&fs->inode_locks[owner])
+      : pthread_rwlock_trywrlock(&fs->inode_locks[owner])) != 0
+  ) {
+    // waiting for it would take i-node locks out of order, the next pass
+    // gets this one
+    return DEDUP_BUSY;
+  }
+
+  // while the owner's lock is held nothing writes to its blocks, so they
+  // can't change between the compare and the share
+  if (
+    owner_inode->mode == 1 && !(owner_inode->flags & INODE_INLINE)
+    && *get_block_ptr(owner_inode, entry->nth_inode_block) == entry->block_ptr
+  ) {
+    result = DEDUP_DIFFERENT;
+    if (
+      dedup_read(fs, entry->block_ptr, other) == nblocks
+      && memcmp(data, other, nblocks * BLOCK_SIZE) == 0
+    ) {
+      inode* file_inode = &fs->inode_table[nth_inode];
+
+      if (dry_run) {
+        for (int i = 0; i < nblocks; i++) {
+          st->report->freed_blocks +=
+            !block_shared(fs, BLOCK_PTR_ADDR(block_ptr) + i);
+        }
+      } else {
+        st->report->freed_blocks +=
+          dedup_remap(fs, file_inode, first, entry->block_ptr);
+        // the file itself is written once it's done
+        file_inode->flags |= INODE_SHARED;
+        if (!(owner_inode->flags & INODE_SHARED)) {
+          owner_inode->flags |= INODE_SHARED;
+          write_inode(fs, owner);
+        }
+      }
+      st->report->merged_blocks += nblocks;
+      result = DEDUP_MERGED;
+    }
+  }
+
+  if (owner != nth_inode) {
+    pthread_rwlock_unlock(&fs->inode_locks[owner]);
+  }
+
+  return result;
+}
+
+// looks the file's blocks at slot first up in the index, merging them into
+// an earlier copy if there's one and indexing them if not; returns whether
+// the file changed
+bool dedup_unit(
+  dedup_state* st, int nth_inode, int first, unsigned int block_ptr,
+  const char* data, int nblocks
+) {
+  uint32_t hash = crc32c(0, data, nblocks * BLOCK_SIZE);
+  unsigned int mask = st->capacity - 1;
+  unsigned int h = hash & mask;
+  dedup_entry* stale = NULL;
+
+  for (; st->index[h].block_ptr != 0; h = (h + 1) & mask) {
+    dedup_entry* entry = &st->index[h];
+
+    // a plain block only matches a plain block, a packed cluster one packed
+    // into as many blocks
+    if (entry->hash != hash || entry->block_ptr >> 24 != block_ptr >> 24) {
+      continue;
+    }
+    if (entry->block_ptr == block_ptr) {
+      // already shared
+
+      return false;
+    }
+
+    switch (dedup_try(st, entry, nth_inode, first, block_ptr, data, nblocks)) {
+      case DEDUP_MERGED:
+        return !(st->flags & SFS_DEDUP_DRY_RUN);
+      case DEDUP_BUSY:
+        st->report->skipped_blocks += nblocks;
+
+        return false;
+      case DEDUP_STALE:
+        // its owner wrote or dropped it since, this can take its place
+        stale = entry;
+        break;
+    }
+  }
+
+  // the first time the pass sees these bytes
+  dedup_entry* entry = stale;
+
+  if (entry == NULL) {
+    if ((st->used + 1) * 4 > st->capacity * 3) {
+      // files grew during the pass, keep the probes short
+
+      return false;
+    }
+    entry = &st->index[h];
+    st->used++;
+  }
+  entry->hash = hash;
+  entry->nth_inode = nth_inode;
+  entry->nth_inode_block = first;
+  entry->block_ptr = block_ptr;
+
+  return false;
+}
+
+// runs every block of the file through the index, the caller holds the
+// i-node's write lock; returns whether it changed
+bool dedup_file(dedup_state* st, int nth_inode) {
+  inode* file_inode = &st->fs->inode_table[nth_inode];
+  char data[CLUSTER_SIZE];
+  bool changed = false;
+
+  if (file_inode->flags & INODE_INLINE) {
+    // no blocks, the indirect pointers hold file bytes
+
+    return false;
+  }
+  // a delayed block is only in wb_table, under this file's slot, so it gets
+  // its place first (even on a dry run, the flusher would soon anyway)
+  place_file(st->fs, nth_inode);
+
+  for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+    unsigned int block_ptr = *get_block_ptr(file_inode, i);
+    int first = i;
+
+    if (block_ptr == 0 || is_delayed(block_ptr)) {
+      // a hole, or a block the disk had no room for
+      continue;
+    }
+    if (block_ptr & BLOCK_PTR_COMPRESSED) {
+      // every slot of the cluster holds the same pointer
+      first = i - i % CLUSTER_BLOCKS;
+      i = first + CLUSTER_BLOCKS - 1;
+    }
+
+    int nblocks = dedup_read(st->fs, block_ptr, data);
+    if (nblocks == -1) {
+      // sharing a bad copy would spread it
+      st->report->unreadable_blocks +=
+        block_ptr & BLOCK_PTR_COMPRESSED ? BLOCK_PTR_NBLOCKS(block_ptr) : 1;
+      continue;
+    }
+    st->report->blocks += nblocks;
+    changed |= dedup_unit(st, nth_inode, first, block_ptr, data, nblocks);
+  }
+
+  return changed;
+}
+
+// how many blocks the files point at, and how many distinct ones that is
+void dedup_count(sfs_t* fs, sfs_dedup_report* report) {
+  bool* seen = calloc(MAX_BLOCKS_ALL_FILES, sizeof(bool));
+  unsigned int addrs[MAX_BLOCKS_PER_FILE];
+
+  for (int i = 1; i < NUM_INODES; i++) {
+    pthread_rwlock_rdlock(&fs->inode_locks[i]);
+    int n = file_blocks(&fs->inode_table[i], addrs);
+    pthread_rwlock_unlock(&fs->inode_locks[i]);
+
+    for (int j = 0; j < n; j++) {
+      report->referenced_blocks++;
+      if (in_data_region(addrs[j], 1) && !seen[addrs[j] - DATA_BLOCKS_ADDR]) {
+        seen[addrs[j] - DATA_BLOCKS_ADDR] = true;
+        report->stored_blocks++;
+      }
+    }
+  }
+  free(seen);
+}
+
+int sfs_dedup_r(sfs_t* fs, int flags, sfs_dedup_report* report) {
+  dedup_state st = {fs, flags, report, NULL, 64, 0};
+
+  memset(report, 0, sizeof(sfs_dedup_report));
+
+  // twice the blocks in use (delayed ones included), so most lookups take
+  // one probe
+  int blocks_used = MAX_BLOCKS_ALL_FILES - free_blocks_total(fs)
+    + __atomic_load_n(&fs->reserved_blocks, __ATOMIC_RELAXED);
+  while (st.capacity < 2 * blocks_used) {
+    st.capacity *= 2;
+  }
+  st.index = calloc(st.capacity, sizeof(dedup_entry));
+
+  for (int i = 1; i < NUM_INODES; i++) {
+    pthread_rwlock_wrlock(&fs->inode_locks[i]);
+    if (fs->inode_table[i].mode == 1) {
+      report->files++;
+      if (dedup_file(&st, i)) {
+        write_inode(fs, i);
+        write_free_block_list(fs);
+      }
+    }
+    pthread_rwlock_unlock(&fs->inode_locks[i]);
+  }
+
+  report->index_entries = st.used;
+  report->index_bytes = (long long)st.capacity * sizeof(dedup_entry);
+  free(st.index);
+
+  dedup_count(fs, report);
+  if (flags & SFS_DEDUP_DRY_RUN) {
+    report->stored_blocks -= report->freed_blocks;
+  }
+
+  return report->merged_blocks;
+}
+
+// IMAGE BUILDER
+
+#define BUILD_BUF_BLOCKS 1024 // 1 MiB per write
+
+struct sfs_builder {
+  sfs_t* fs; // never mounted, only its tables and disk are used
+  unsigned int next_addr; // where the next file's data goes
+  // data not written yet, the blocks right before next_addr
+  char* buf;
+  int buf_blocks;
+};
+
+void build_flush(sfs_builder* b) {
+  if (b->buf_blocks > 0) {
+    write_blocks_r(
+      b->fs->disk, b->next_addr - b->buf_blocks, b->buf_blocks, b->buf
+    );
+    b->buf_blocks = 0;
+  }
+}
+
+sfs_builder* sfs_build_start(char* path) {
+  sfs_builder* b = calloc(1, sizeof(sfs_builder));
+  sfs_t* fs = new_fs();
+
+  fs->inode_table[0].mode = 1; // root
+  fs->disk = init_fresh_disk_r(path, BLOCK_SIZE, fs->supblock.fs_size);
+  if (fs->disk == NULL) {
+    sfs_unmount(fs);
+    free(b);
+
+    return NULL;
+  }
+  // not setup_disk, SFS_TRACE is for mounts
+  set_disk_data_area_r(fs->disk, DATA_BLOCKS_ADDR, MAX_BLOCKS_ALL_FILES);
+
+  b->fs = fs;
+  b->next_addr = DATA_BLOCKS_ADDR;
+  b->buf = malloc(BUILD_BUF_BLOCKS * BLOCK_SIZE);
+
+  return b;
+}
+
+int sfs_build_add(sfs_builder* b, const char* name, const char* data, int len) {
+  sfs_t* fs = b->fs;
+  int nblocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  int nth_inode = -1;
+
+  if (
+    strlen(name) > MAXFILENAME || len < 0 || len > FILE_CAPACITY
+    || find_file(fs, name) != -1
+  ) {
+    return -1;
+  }
+  for (int i = 1; i < NUM_INODES && nth_inode == -1; i++) {
+    if (fs->inode_table[i].mode == 0) {
+      nth_inode = i;
+    }
+  }
+  if (nth_inode == -1) {
+    return -1;
+  }
+
+  inode* file_inode = &fs->inode_table[nth_inode];
+
+  if (len <= INLINE_DATA_CAPACITY) {
+    file_inode->flags = INODE_INLINE;
+    memcpy(inline_data(file_inode), data, len);
+  } else {
+    if (b->next_addr + nblocks > DATA_BLOCKS_ADDR + MAX_BLOCKS_ALL_FILES) {
+      return -1;
+    }
+
+    for (int i = 0; i < nblocks; i++) {
+      char* block = b->buf + b->buf_blocks * BLOCK_SIZE;
+      int chunk = len - i * BLOCK_SIZE < BLOCK_SIZE
+        ? len - i * BLOCK_SIZE
+        : BLOCK_SIZE;
+      int nth_data_block = b->next_addr - DATA_BLOCKS_ADDR;
+
+      memcpy(block, data + i * BLOCK_SIZE, chunk);
+      memset(block + chunk, 0, BLOCK_SIZE - chunk);
+      *get_block_ptr(file_inode, i) = b->next_addr;
+      fs->free_block_list[nth_data_block / 64] |=
+        (uint64_t)1 << (63 - nth_data_block % 64);
+
+      b->next_addr++;
+      if (++b->buf_blocks == BUILD_BUF_BLOCKS) {
+        build_flush(b);
+      }
+    }
+  }
+  file_inode->mode = 1;
+  file_inode->size = len;
+  strcpy(fs->dir_table[nth_inode].name, name);
+  fs->dir_table[nth_inode].mode = 1;
+
+  return nth_inode;
+}
+
+void sfs_build_finish(sfs_builder* b) {
+  sfs_t* fs = b->fs;
+
+  build_flush(b);
+
+  // TABLES, each in one write
+  table_blocks_io(fs, true, 0, &fs->supblock, sizeof(fs->supblock), 0, 0);
+  table_blocks_io(
+    fs, true, 1, fs->inode_table, sizeof(fs->inode_table),
+    0, NUM_INODE_BLOCKS - 1
+  );
+  table_blocks_io(
+    fs, true, 1 + NUM_INODE_BLOCKS, fs->dir_table, sizeof(fs->dir_table),
+    0, NUM_ROOT_BLOCKS - 1
+  );
+  table_blocks_io(
+    fs, true, FREE_BLOCK_LIST_ADDR, fs->free_block_list,
+    sizeof(fs->free_block_list), 0, NUM_FREE_BITMAP_BLOCKS - 1
+  );
+
+  sfs_unmount(fs); // there's no flusher, it only closes the disk
+  free(b->buf);
+  free(b);
+}
+
+// FRAGMENTATION
+
+typedef struct {
+  unsigned int addr;
+  int nblocks;
+} block_run;
+
+// the runs of a file's data blocks in file order, ones that follow each other
+// on disk merged, into runs (if not NULL); returns how many and sets *nblocks
+// to the blocks in them. The caller holds the i-node's lock.
+int file_extents(inode* file_inode, block_run* runs, int* nblocks) {
+  unsigned int end = 0; // one past the last run
+  int nruns = 0;
+
+  *nblocks = 0;
+  if (file_inode->flags & INODE_INLINE) {
+    // the indirect pointers hold file bytes
+
+    return 0;
+  }
+
+  for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+    unsigned int block_ptr = *get_block_ptr(file_inode, i);
+    unsigned int addr = block_ptr;
+    int n = 1;
+
+    if (block_ptr == 0 || is_delayed(block_ptr)) {
+      // delayed blocks get one run when they're placed
+      continue;
+    }
+    if (block_ptr & BLOCK_PTR_COMPRESSED) {
+      // every slot of the cluster holds the same pointer
+      addr = BLOCK_PTR_ADDR(block_ptr);
+      n = BLOCK_PTR_NBLOCKS(block_ptr);
+      i += CLUSTER_BLOCKS - 1 - i % CLUSTER_BLOCKS;
+    }
+
+    if (nruns == 0 || addr != end) {
+      if (runs != NULL) {
+        runs[nruns].addr = addr;
+        runs[nruns].nblocks = 0;
+      }
+      nruns++;
+    }
+    if (runs != NULL) {
+      runs[nruns - 1].nblocks += n;
+    }
+    end = addr + n;
+    *nblocks += n;
+  }
+
+  return nruns;
+}
+
+void count_free_run(sfs_frag_report* report, int run) {
+  int bucket = 0;
+
+  while (bucket < SFS_FRAG_BUCKETS - 1 && run >> (bucket + 1) > 0) {
+    bucket++;
+  }
+  report->free_hist[bucket]++;
+  report->free_blocks += run;
+  report->free_extents++;
+  if (run > report->largest_free_extent) {
+    report->largest_free_extent = run;
+  }
+}
+
+int sfs_frag_r(
+  sfs_t* fs, sfs_frag_report* report, sfs_frag_file* files, int max_files
+) {
+  memset(report, 0, sizeof(sfs_frag_report));
+
+  // FILES
+  pthread_rwlock_rdlock(&fs->ns_lock);
+  for (int i = 1; i < NUM_INODES; i++) {
+    if (fs->dir_table[i].mode != 1) {
+      continue;
+    }
+
+    int nblocks;
+
+    pthread_rwlock_rdlock(&fs->inode_locks[i]);
+    int extents = file_extents(&fs->inode_table[i], NULL, &nblocks);
+    unsigned int size = fs->inode_table[i].size;
+    pthread_rwlock_unlock(&fs->inode_locks[i]);
+
+    if (files != NULL && report->files < max_files) {
+      sfs_frag_file* file = &files[report->files];
+
+      file->inode = i;
+      snprintf(
+        file->name, sizeof(file->name), "%.*s", MAXFILENAME,
+        fs->dir_table[i].name
+      );
+      file->size = size;
+      file->blocks = nblocks;
+      file->extents = extents;
+    }
+    report->files++;
+    report->fragmented_files += extents > 1;
+    report->blocks += nblocks;
+    report->extents += extents;
+  }
+  pthread_rwlock_unlock(&fs->ns_lock);
+
+  // FREE SPACE
+  // scanned in a copy, so no group stays locked meanwhile
+  uint64_t* bitmap = malloc(sizeof(fs->free_block_list));
+  int run = 0;
+
+  for (int group = 0; group < NUM_ALLOC_GROUPS; group++) {
+    pthread_mutex_lock(&fs->group_locks[group]);
+  }
+  memcpy(bitmap, fs->free_block_list, sizeof(fs->free_block_list));
+  for (int group = NUM_ALLOC_GROUPS - 1; group >= 0; group--) {
+    pthread_mutex_unlock(&fs->group_locks[group]);
+  }
+
+  for (int i = 0; i < MAX_BLOCKS_ALL_FILES; i++) {
+    if (!((bitmap[i / 64] >> (63 - i % 64)) & 1)) {
+      run++;
+    } else if (run > 0) {
+      count_free_run(report, run);
+      run = 0;
+    }
+  }
+  if (run > 0) {
+    count_free_run(report, run);
+  }
+  free(bitmap);
+
+  return report->files;
+}
+
+// copies the file's blocks into one new run and points the i-node at it, the
+// caller holds the i-node's write lock. The old blocks stay in use, they're
+// put in old_runs (*nold of them) for free_moved_runs.
+int defrag_file(sfs_t* fs, int nth_inode, block_run* old_runs, int* nold) {
+  inode* file_inode = &fs->inode_table[nth_inode];
+  block_run runs[MAX_BLOCKS_PER_FILE];
+  int nblocks;
+
+  // so all of the file moves
+  int unplaced = place_file(fs, nth_inode);
+  int nruns = file_extents(file_inode, runs, &nblocks);
+
+  if (nruns <= 1 || unplaced > 0) {
+    // there'd be no moving the ones the disk had no room for along
+    return nruns;
+  }
+  for (int r = 0; r < nruns; r++) {
+    for (int i = 0; i < runs[r].nblocks; i++) {
+      if (block_shared(fs, runs[r].addr + i)) {
+        // moving it would leave the file its own copy, undoing the clone
+
+        return nruns;
+      }
+    }
+  }
+
+  int new_addr = alloc_data_run(fs, nth_inode, 0, nblocks);
+  if (new_addr == -1) {
+    // no free run is long enough
+
+    return nruns;
+  }
+
+  // COPY
+  // packed clusters move as they are, without decompressing them
+  char* buf = malloc(nblocks * BLOCK_SIZE);
+  int copied = 0;
+
+  for (int r = 0; r < nruns; r++) {
+    if (
+      read_data_blocks(
+        fs, runs[r].addr, runs[r].nblocks, buf + copied * BLOCK_SIZE
+      ) < 0
+    ) {
+      // failed its checksum, leave the file where it is rather than spread a
+      // bad copy
+      free(buf);
+      for (int i = 0; i < nblocks; i++) {
+        free_from_block_list(fs, new_addr + i);
+      }
+
+      return nruns;
+    }
+    copied += runs[r].nblocks;
+  }
+  write_data_blocks(fs, new_addr, nblocks, buf);
+  free(buf);
+
+  // REMAP
+  // same walk as file_extents, so the blocks land in the order they were
+  // copied
+  unsigned int next = new_addr;
+
+  for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+    unsigned int* block_ptr = get_block_ptr(file_inode, i);
+
+    if (*block_ptr == 0) {
+      continue;
+    }
+    if (*block_ptr & BLOCK_PTR_COMPRESSED) {
+      int n = BLOCK_PTR_NBLOCKS(*block_ptr);
+      int first = i - i % CLUSTER_BLOCKS;
+
+      for (int j = first; j < first + CLUSTER_BLOCKS; j++) {
+        *get_block_ptr(file_inode, j) = BLOCK_PTR_COMPRESSED | (n << 24) | next;
+      }
+      next += n;
+      i = first + CLUSTER_BLOCKS - 1;
+    } else {
+      *block_ptr = next++;
+    }
+  }
+
+  write_inode(fs, nth_inode);
+
+  // the i-node no longer points at the old blocks, but the one on disk may
+  // until it's written, so they can't go yet
+  memcpy(old_runs, runs, nruns * sizeof(block_run));
+  *nold = nruns;
+
+  return 1;
+}
+
+// Frees a moved file's old blocks once the new run and the i-node pointing at
+// it are on disk: reused any earlier, they could be written over while the
+// i-node on disk still points at them. The caller holds no locks (the sync
+// waits on writers).
+void free_moved_runs(sfs_t* fs, block_run* runs, int nruns) {
+  sync_fs(fs);
+  for (int r = 0; r < nruns; r++) {
+    for (int i = 0; i < runs[r].nblocks; i++) {
+      free_from_block_list(fs, runs[r].addr + i);
+    }
+  }
+  write_free_block_list(fs);
+}
+
+int sfs_defrag_inode_r(sfs_t* fs, int nth_inode) {
+  if (!valid_inode(nth_inode)) {
+    return -1;
+  }
+
+  int extents = -1;
+  block_run old_runs[MAX_BLOCKS_PER_FILE];
+  int nold = 0;
+
+  pthread_rwlock_wrlock(&fs->inode_locks[nth_inode]);
+  if (fs->inode_table[nth_inode].mode == 1) {
+    extents = defrag_file(fs, nth_inode, old_runs, &nold);
+  }
+  pthread_rwlock_unlock(&fs->inode_locks[nth_inode]);
+  if (nold > 0) {
+    free_moved_runs(fs, old_runs, nold);
+  }
+
+  return extents;
+}
+
+int sfs_defrag_r(sfs_t* fs) {
+  int defragged = 0;
+
+  for (int i = 1; i < NUM_INODES; i++) {
+    int nblocks;
+
+    pthread_rwlock_rdlock(&fs->inode_locks[i]);
+    int extents = fs->inode_table[i].mode == 1
+      ? file_extents(&fs->inode_table[i], NULL, &nblocks)
+      : 0;
+    pthread_rwlock_unlock(&fs->inode_locks[i]);
+
+    // it may have changed in between, sfs_defrag_inode_r looks again
+    if (extents > 1 && sfs_defrag_inode_r(fs, i) == 1) {
+      defragged++;
+    }
+  }
+
+  return defragged;
+}
+
+// EXPORT
+
+#define EXPORT_READ_BLOCKS 1024 // 1 MiB per read at most
+
+// a file's data block, or a packed cluster's blocks
+typedef struct {
+  unsigned int addr;
+  int nblocks;
+  bool packed;
+  int nth_inode;
+  int nth_block; // the first file block it holds
+} export_piece;
+
+typedef struct {
+  char* data; // allocated when its first piece is read
+  int pending; // pieces not read yet
+  bool damaged;
+} export_file;
+
+int export_piece_cmp(const void* a, const void* b) {
+  const export_piece* x = a;
+  const export_piece* y = b;
+
+  return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+// hands a finished file to fn
+void export_done(
+  sfs_t* fs, int nth_inode, const char* data, bool damaged, sfs_export_fn fn,
+  void* arg, sfs_export_report* report
+) {
+  int size = fs->inode_table[nth_inode].size;
+
+  fn(arg, nth_inode, fs->dir_table[nth_inode].name, data, size, damaged);
+  report->files++;
+  report->damaged_files += damaged;
+  report->bytes += size;
+}
+
+// copies one piece, read into blocks, into its file
+void export_copy(
+  sfs_t* fs, const export_piece* piece, const char* blocks,
+  export_file* file, char* cluster_buf
+) {
+  int size = fs->inode_table[piece->nth_inode].size;
+  int offset = piece->nth_block * BLOCK_SIZE;
+  const char* src = blocks;
+  int len = BLOCK_SIZE;
+
+  if (file->data == NULL) {
+    // holes stay zeros
+    file->data = calloc(size + 1, 1);
+  }
+  if (piece->packed) {
+    if (unpack_cluster(fs, blocks, cluster_buf) < 0) {
+      file->damaged = true;
+    }
+    src = cluster_buf;
+    len = CLUSTER_SIZE;
+  }
+  if (offset < size) {
+    memcpy(file->data + offset, src, len < size - offset ? len : size - offset);
+  }
+}
+
+int sfs_export_r(
+  sfs_t* fs, sfs_export_fn fn, void* arg, sfs_export_report* report
+) {
+  sfs_export_report local;
+  export_piece* pieces = malloc(sizeof(export_piece) * MAX_BLOCKS_ALL_FILES);
+  export_file* files = calloc(NUM_INODES, sizeof(export_file));
+  int npieces = 0;
+
+  if (report == NULL) {
+    report = &local;
+  }
+  memset(report, 0, sizeof(sfs_export_report));
+
+  // every i-node lock, in order, so nothing changes until the last file is out
+  pthread_rwlock_rdlock(&fs->ns_lock);
+  for (int i = 1; i < NUM_INODES; i++) {
+    pthread_rwlock_rdlock(&fs->inode_locks[i]);
+  }
+
+  // GATHER
+  // the tables are in memory, so this costs no disk reads
+  for (int i = 1; i < NUM_INODES; i++) {
+    inode* file_inode = &fs->inode_table[i];
+
+    if (fs->dir_table[i].mode != 1) {
+      continue;
+    }
+    if (file_inode->flags & INODE_INLINE) {
+      export_done(fs, i, inline_data(file_inode), false, fn, arg, report);
+      continue;
+    }
+
+    for (int b = 0; b < MAX_BLOCKS_PER_FILE; b++) {
+      unsigned int block_ptr = *get_block_ptr(file_inode, b);
+      export_piece* piece = &pieces[npieces];
+
+      if (block_ptr == 0) {
+        continue;
+      }
+      piece->addr = block_ptr;
+      piece->nblocks = 1;
+      piece->packed = false;
+      piece->nth_inode = i;
+      piece->nth_block = b;
+      if (block_ptr & BLOCK_PTR_COMPRESSED) {
+        // every slot of the cluster holds the same pointer
+        piece->addr = BLOCK_PTR_ADDR(block_ptr);
+        piece->nblocks = BLOCK_PTR_NBLOCKS(block_ptr);
+        piece->packed = true;
+        piece->nth_block = b - b % CLUSTER_BLOCKS;
+        b = piece->nth_block + CLUSTER_BLOCKS - 1;
+      }
+      npieces++;
+      files[i].pending++;
+    }
+
+    if (files[i].pending == 0) {
+      // empty, or all holes
+      char* zeros = calloc(file_inode->size + 1, 1);
+
+      export_done(fs, i, zeros, false, fn, arg, report);
+      free(zeros);
+    }
+  }
+  qsort(pieces, npieces, sizeof(export_piece), export_piece_cmp);
+
+  // READ
+  // pieces that follow each other on disk are read together, whatever files
+  // they belong to, and blocks clones share are read once for all of them
+  char* buf = malloc(EXPORT_READ_BLOCKS * BLOCK_SIZE);
+  char cluster_buf[CLUSTER_SIZE];
+  int next;
+
+  for (int p = 0; p < npieces; p = next) {
+    unsigned int start = pieces[p].addr;
+    int nblocks = pieces[p].nblocks;
+
+    for (next = p + 1; next < npieces; next++) {
+      unsigned int end = pieces[next].addr + pieces[next].nblocks;
+
+      if (end <= start + nblocks) {
+        // shared, already in the run
+        continue;
+      }
+      if (
+        pieces[next].addr != start + nblocks
+        || nblocks + pieces[next].nblocks > EXPORT_READ_BLOCKS
+      ) {
+        break;
+      }
+      nblocks += pieces[next].nblocks;
+    }
+    bool bad = read_data_blocks(fs, start, nblocks, buf) < 0;
+    report->reads++;
+    report->blocks += nblocks;
+
+    for (int q = p; q < next; q++) {
+      export_piece* piece = &pieces[q];
+      export_file* file = &files[piece->nth_inode];
+      char* blocks = buf + (piece->addr - start) * BLOCK_SIZE;
+
+      // somewhere in the run failed its checksum, find out which files
+      if (
+        bad && read_data_blocks(fs, piece->addr, piece->nblocks, blocks) < 0
+      ) {
+        file->damaged = true;
+      }
+      export_copy(fs, piece, blocks, file, cluster_buf);
+
+      if (--file->pending == 0) {
+        export_done(
+          fs, piece->nth_inode, file->data, file->damaged, fn, arg, report
+        );
+        free(file->data);
+        file->data = NULL;
+      }
+    }
+  }
+
+  for (int i = NUM_INODES - 1; i >= 1; i--) {
+    pthread_rwlock_unlock(&fs->inode_locks[i]);
+  }
+  pthread_rwlock_unlock(&fs->ns_lock);
+
+  free(buf);
+  free(pieces);
+  free(files);
+
+  return report->files;
+}
+
+// CONSISTENCY CHECK
+
+#define FSCK_MAX_THREADS 64
+
+typedef struct {
+  sfs_t* fs;
+  int flags;
+  sfs_fsck_report* report;
+  int* owner; // i-node using each data block, 0 if none
+  // the block pointer each data block was first claimed through: a clone's
+  // claims come through the same pointers as its source's
+  unsigned int* claimed_by;
+  bool* shared; // claimed more than once, by clones or dedup
+  bool shares_blocks[NUM_INODES]; // lost a block to an earlier claim
+  int next; // next i-node/bitmap row a worker picks up
+} fsck_state;
+
+// prints one problem and counts it, fixed says whether the caller fixes it
+void fsck_problem(
+  fsck_state* ck, int* counter, bool fixed, const char* format, ...
+) {
+  char msg[256];
+  va_list args;
+
+  va_start(args, format);
+  vsnprintf(msg, sizeof(msg), format, args);
+  va_end(args);
+  printf("%s%s\n", msg, fixed ? " (fixed)" : "");
+
+  __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+  if (fixed) {
+    __atomic_fetch_add(&ck->report->repaired, 1, __ATOMIC_RELAXED);
+  }
+}
+
+const char* fsck_name(sfs_t* fs, int nth_inode) {
+  return fs->dir_table[nth_inode].mode == 1
+    ? fs->dir_table[nth_inode].name : "?";
+}
+
+// every i-node in use needs a directory entry and the other way around, runs
+// before the workers so they see the repaired namespace
+void fsck_check_names(fsck_state* ck) {
+  sfs_t* fs = ck->fs;
+  bool repair = ck->flags & SFS_FSCK_REPAIR;
+
+  if (fs->inode_table[0].mode != 1) {
+    fsck_problem(ck, &ck->report->bad_inodes, repair, "root i-node not in use");
+    if (repair) {
+      fs->inode_table[0].mode = 1;
+    }
+  }
+
+  for (int i = 1; i < NUM_INODES; i++) {
+    dir_entry* entry = &fs->dir_table[i];
+    inode* file_inode = &fs->inode_table[i];
+
+    if (entry->mode > 1) {
+      fsck_problem(
+        ck, &ck->report->bad_inodes, repair,
+        "directory entry %d: bad mode %u", i, entry->mode
+      );
+      if (repair) {
+        entry->mode = 0;
+      }
+    }
+    if (file_inode->mode > 1) {
+      fsck_problem(
+        ck, &ck->report->bad_inodes, repair,
+        "i-node %d: bad mode %u", i, file_inode->mode
+      );
+      if (repair) {
+        file_inode->mode = entry->mode == 1;
+      }
+    }
+    if (entry->mode == 1 && memchr(entry->name, 0, MAXFILENAME + 1) == NULL) {
+      fsck_problem(
+        ck, &ck->report->bad_inodes, repair,
+        "directory entry %d: name longer than %d characters", i, MAXFILENAME
+      );
+      if (repair) {
+        entry->name[MAXFILENAME] = '\0';
+      }
+    }
+
+    if (entry->mode == 1 && file_inode->mode == 0) {
+      fsck_problem(
+        ck, &ck->report->bad_inodes, repair,
+        "directory entry %d (%.*s): i-node not in use", i, MAXFILENAME,
+        entry->name
+      );
+      if (repair) {
+        entry->mode = 0;
+      }
+    } else if (file_inode->mode == 1 && entry->mode != 1) {
+      // keep the data, under a name it can be found by
+      fsck_problem(
+        ck, &ck->report->bad_inodes, repair,
+        "i-node %d: in use but has no directory entry", i
+      );
+      if (repair) {
+        sprintf(entry->name, "lost+found.%d", i);
+        entry->mode = 1;
+      }
+    }
+  }
+}
+
+// whether the i-node is marked as sharing its blocks (read while other
+// workers may be repairing its flags)
+bool fsck_may_share(fsck_state* ck, int nth_inode) {
+  return __atomic_load_n(
+    &ck->fs->inode_table[nth_inode].flags, __ATOMIC_RELAXED
+  ) & INODE_SHARED;
+}
+
+// marks nblocks data blocks starting at addr as used by the i-node, through
+// block_ptr (addr itself, or a packed cluster's pointer)
+void fsck_claim(
+  fsck_state* ck, int nth_inode, unsigned int block_ptr, unsigned int addr,
+  int nblocks
+) {
+  for (unsigned int block = addr; block < addr + nblocks; block++) {
+    int nth_data_block = block - DATA_BLOCKS_ADDR;
+    unsigned int expected = 0;
+
+    if (
+      __atomic_compare_exchange_n(
+        &ck->claimed_by[nth_data_block], &expected, block_ptr, false,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED
+      )
+    ) {
+      __atomic_store_n(&ck->owner[nth_data_block], nth_inode, __ATOMIC_RELEASE);
+      continue;
+    }
+
+    // an i-node's own claims come from one worker, so an earlier one of them
+    // is seen here; another's owner may not be stored yet
+    int owner;
+    while (
+      (owner = __atomic_load_n(&ck->owner[nth_data_block], __ATOMIC_ACQUIRE))
+      == 0
+    ) {
+      // it's right behind the compare-exchange
+    }
+    if (
+      expected == block_ptr
+      && fsck_may_share(ck, owner) && fsck_may_share(ck, nth_inode)
+    ) {
+      // the same pointer again, from a clone or dedup
+      __atomic_store_n(&ck->shared[nth_data_block], true, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    // fixed once every claim is in, see fsck_unshare
+    fsck_problem(
+      ck, &ck->report->dup_blocks, false,
+      "block %u: used by i-node %d (%.*s) and i-node %d (%.*s)", block,
+      owner, MAXFILENAME, fsck_name(ck->fs, owner), nth_inode,
+      MAXFILENAME, fsck_name(ck->fs, nth_inode)
+    );
+    ck->shares_blocks[nth_inode] = true;
+  }
+}
+
+// checks the CLUSTER_BLOCKS pointers starting at the first-th one, plain files
+// are walked the same way as compressed ones
+void fsck_scan_cluster(fsck_state* ck, int nth_inode, int first) {
+  sfs_t* fs = ck->fs;
+  bool repair = ck->flags & SFS_FSCK_REPAIR;
+  inode* file_inode = &fs->inode_table[nth_inode];
+  const char* name = fsck_name(fs, nth_inode);
+  unsigned int* slots[CLUSTER_BLOCKS];
+
+  for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+    slots[i] = get_block_ptr(file_inode, first + i);
+  }
+
+  if (*slots[0] & BLOCK_PTR_COMPRESSED) {
+    // PACKED CLUSTER
+    unsigned int block_ptr = *slots[0];
+    unsigned int addr = BLOCK_PTR_ADDR(block_ptr);
+    int nblocks = BLOCK_PTR_NBLOCKS(block_ptr);
+    bool valid = (file_inode->flags & INODE_COMPRESSED)
+      && 1 <= nblocks && nblocks < CLUSTER_BLOCKS
+      && in_data_region(addr, nblocks);
+
+    for (int i = 1; i < CLUSTER_BLOCKS; i++) {
+      valid = valid && *slots[i] == block_ptr;
+    }
+    if (!valid) {
+      fsck_problem(
+        ck, &ck->report->bad_pointers, repair,
+        "i-node %d (%.*s): broken compressed cluster at block %d", nth_inode,
+        MAXFILENAME, name, first
+      );
+      if (repair) {
+        for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+          *slots[i] = 0;
+        }
+      }
+
+      return;
+    }
+
+    fsck_claim(ck, nth_inode, block_ptr, addr, nblocks);
+    if (ck->flags & SFS_FSCK_VERIFY_DATA) {
+      char cluster_buf[CLUSTER_SIZE];
+
+      if (read_packed_cluster(fs, block_ptr, cluster_buf) < 0) {
+        fsck_problem(
+          ck, &ck->report->checksum_errors, false,
+          "i-node %d (%.*s): compressed cluster at block %d is unreadable",
+          nth_inode, MAXFILENAME, name, first
+        );
+      }
+    }
+
+    return;
+  }
+
+  // PLAIN BLOCKS
+  for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+    char block_buf[BLOCK_SIZE];
+
+    if (*slots[i] == 0) {
+      // hole
+      continue;
+    }
+    if ((*slots[i] & BLOCK_PTR_COMPRESSED) || !in_data_region(*slots[i], 1)) {
+      fsck_problem(
+        ck, &ck->report->bad_pointers, repair,
+        "i-node %d (%.*s): block %d points outside the data region (%#x)",
+        nth_inode, MAXFILENAME, name, first + i, *slots[i]
+      );
+      if (repair) {
+        *slots[i] = 0;
+      }
+      continue;
+    }
+
+    fsck_claim(ck, nth_inode, *slots[i], *slots[i], 1);
+    if (
+      (ck->flags & SFS_FSCK_VERIFY_DATA)
+      && read_data_blocks(fs, *slots[i], 1, block_buf) < 0
+    ) {
+      fsck_problem(
+        ck, &ck->report->checksum_errors, false,
+        "i-node %d (%.*s): block %d fails its checksum", nth_inode,
+        MAXFILENAME, name, first + i
+      );
+    }
+  }
+}
+
+void fsck_scan_inode(fsck_state* ck, int nth_inode) {
+  sfs_t* fs = ck->fs;
+  bool repair = ck->flags & SFS_FSCK_REPAIR;
+  inode* file_inode = &fs->inode_table[nth_inode];
+  const char* name = fsck_name(fs, nth_inode);
+  inode empty;
+
+  memset(&empty, 0, sizeof(empty));
+  if (file_inode->mode == 0) {
+    // sfs_remove clears everything, anything left over is garbage
+    if (memcmp(file_inode, &empty, sizeof(inode)) != 0) {
+      fsck_problem(
+        ck, &ck->report->bad_inodes, repair,
+        "i-node %d: not in use but not cleared", nth_inode
+      );
+      if (repair) {
+        *file_inode = empty;
+      }
+    }
+
+    return;
+  }
+  __atomic_fetch_add(&ck->report->files, 1, __ATOMIC_RELAXED);
+
+  unsigned int known_flags = INODE_INLINE | INODE_COMPRESSED | INODE_SHARED;
+  if (file_inode->flags & ~known_flags) {
+    fsck_problem(
+      ck, &ck->report->bad_inodes, repair,
+      "i-node %d (%.*s): unknown flags %#x", nth_inode, MAXFILENAME, name,
+      file_inode->flags
+    );
+    if (repair) {
+      // other workers may be reading INODE_SHARED
+      __atomic_fetch_and(&file_inode->flags, known_flags, __ATOMIC_RELAXED);
+    }
+  }
+
+  if (file_inode->flags & INODE_INLINE) {
+    // the indirect pointers are file bytes, only the direct ones are checked
+    if (file_inode->size > INLINE_DATA_CAPACITY) {
+      fsck_problem(
+        ck, &ck->report->bad_inodes, repair,
+        "i-node %d (%.*s): inline file claims %u bytes", nth_inode,
+        MAXFILENAME, name, file_inode->size
+      );
+      if (repair) {
+        file_inode->size = INLINE_DATA_CAPACITY;
+      }
+    }
+    if (memcmp(file_inode->direct, empty.direct, sizeof(empty.direct)) != 0) {
+      fsck_problem(
+        ck, &ck->report->bad_pointers, repair,
+        "i-node %d (%.*s): inline file has block pointers", nth_inode,
+        MAXFILENAME, name
+      );
+      if (repair) {
+        memset(file_inode->direct, 0, sizeof(file_inode->direct));
+      }
+    }
+
+    return;
+  }
+
+  if (file_inode->size > FILE_CAPACITY) {
+    fsck_problem(
+      ck, &ck->report->bad_inodes, repair,
+      "i-node %d (%.*s): size %u is past the largest possible file",
+      nth_inode, MAXFILENAME, name, file_inode->size
+    );
+    if (repair) {
+      file_inode->size = FILE_CAPACITY;
+    }
+  }
+
+  // MAX_BLOCKS_PER_FILE is a whole number of clusters
+  for (int first = 0; first < MAX_BLOCKS_PER_FILE; first += CLUSTER_BLOCKS) {
+    fsck_scan_cluster(ck, nth_inode, first);
+  }
+}
+
+void* fsck_scan_worker(void* arg) {
+  fsck_state* ck = arg;
+
+  for (;;) {
+    int nth_inode = __atomic_fetch_add(&ck->next, 1, __ATOMIC_RELAXED);
+
+    if (nth_inode >= NUM_INODES) {
+      return NULL;
+    }
+    if (nth_inode > 0) { // root has no blocks
+      fsck_scan_inode(ck, nth_inode);
+    }
+  }
+}
+
+// first fit on the rebuilt map, -1 if there's no run of nblocks free blocks
+int fsck_alloc_run(fsck_state* ck, int nth_inode, int nblocks) {
+  int run = 0;
+
+  for (int nth_data_block = 0; nth_data_block < MAX_BLOCKS_ALL_FILES; nth_data_block++) {
+    if (ck->owner[nth_data_block] != 0) {
+      run = 0;
+      continue;
+    }
+    if (++run < nblocks) {
+      continue;
+    }
+
+    // the bitmap gets them too, so they don't show up as missing from it
+    int first = nth_data_block - nblocks + 1;
+    for (int i = first; i <= nth_data_block; i++) {
+      ck->owner[i] = nth_inode;
+      ck->fs->free_block_list[i / 64] |= (uint64_t)1 << (63 - i % 64);
+    }
+
+    return DATA_BLOCKS_ADDR + first;
+  }
+
+  return -1;
+}
+
+bool fsck_seen(unsigned int* seen, int nseen, unsigned int block) {
+  for (int i = 0; i < nseen; i++) {
+    if (seen[i] == block) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// gives the i-node its own copy of the run at addr (which it points at through
+// block_ptr) if anything else uses part of it: another file or another of its
+// own pointers, other than the same pointer again from files marked
+// INODE_SHARED (a clone's, or what dedup left). Returns the address it should
+// point at.
+unsigned int fsck_unshare_run(
+  fsck_state* ck, int nth_inode, unsigned int block_ptr, unsigned int addr,
+  int nblocks, unsigned int* seen, int* nseen
+) {
+  sfs_t* fs = ck->fs;
+  int shared = 0; // the claims fsck_claim reported for this run
+
+  for (unsigned int block = addr; block < addr + nblocks; block++) {
+    int nth_data_block = block - DATA_BLOCKS_ADDR;
+    int owner = ck->owner[nth_data_block];
+    bool sharing = ck->claimed_by[nth_data_block] == block_ptr
+      && fsck_may_share(ck, owner) && fsck_may_share(ck, nth_inode);
+
+    if (
+      !sharing && (owner != nth_inode || fsck_seen(seen, *nseen, block))
+    ) {
+      shared++;
+    }
+  }
+  if (shared == 0) {
+    for (unsigned int block = addr; block < addr + nblocks; block++) {
+      seen[(*nseen)++] = block;
+    }
+
+    return addr;
+  }
+
+  int new_addr = fsck_alloc_run(ck, nth_inode, nblocks);
+  if (new_addr == -1) {
+    printf(
+      "i-node %d (%.*s): no room to copy shared block %u\n", nth_inode,
+      MAXFILENAME, fsck_name(fs, nth_inode), addr
+    );
+
+    return addr;
+  }
+
+  // a block that fails its checksum is copied as is, like any other
+  char run_buf[CLUSTER_SIZE];
+  read_data_blocks(fs, addr, nblocks, run_buf);
+  write_data_blocks(fs, new_addr, nblocks, run_buf);
+
+  // whatever part of the old run was only ours is free now
+  for (unsigned int block = addr; block < addr + nblocks; block++) {
+    if (
+      ck->owner[block - DATA_BLOCKS_ADDR] == nth_inode
+      && !fsck_seen(seen, *nseen, block)
+    ) {
+      ck->owner[block - DATA_BLOCKS_ADDR] = 0;
+    }
+  }
+  for (int i = 0; i < nblocks; i++) {
+    seen[(*nseen)++] = new_addr + i;
+  }
+
+  printf(
+    "i-node %d (%.*s): copied shared block %u to %d (fixed)\n", nth_inode,
+    MAXFILENAME, fsck_name(fs, nth_inode), addr, new_addr
+  );
+  ck->report->repaired += shared;
+
+  return new_addr;
+}
+
+// runs after all the workers, when the claims are final
+void fsck_unshare(fsck_state* ck, int nth_inode) {
+  inode* file_inode = &ck->fs->inode_table[nth_inode];
+  unsigned int seen[MAX_BLOCKS_PER_FILE]; // blocks this i-node keeps
+  int nseen = 0;
+
+  for (int first = 0; first < MAX_BLOCKS_PER_FILE; first += CLUSTER_BLOCKS) {
+    unsigned int* slots[CLUSTER_BLOCKS];
+
+    for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+      slots[i] = get_block_ptr(file_inode, first + i);
+    }
+
+    if (*slots[0] & BLOCK_PTR_COMPRESSED) {
+      unsigned int nblocks = BLOCK_PTR_NBLOCKS(*slots[0]);
+      unsigned int addr = fsck_unshare_run(
+        ck, nth_inode, *slots[0], BLOCK_PTR_ADDR(*slots[0]), nblocks, seen,
+        &nseen
+      );
+
+      for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+        *slots[i] = BLOCK_PTR_COMPRESSED | (nblocks << 24) | addr;
+      }
+    } else {
+      for (int i = 0; i < CLUSTER_BLOCKS; i++) {
+        if (*slots[i] > 0) {
+          *slots[i] = fsck_unshare_run(
+            ck, nth_inode, *slots[i], *slots[i], 1, seen, &nseen
+          );
+        }
+      }
+    }
+  }
+}
+
+// compares the rebuilt map with the on-disk bitmap one row at a time
+void* fsck_bitmap_worker(void* arg) {
+  fsck_state* ck = arg;
+  sfs_t* fs = ck->fs;
+  bool repair = ck->flags & SFS_FSCK_REPAIR;
+
+  for (;;) {
+    int row_num = __atomic_fetch_add(&ck->next, 1, __ATOMIC_RELAXED);
+    uint64_t expected = 0;
+    int used = 0;
+    int shared = 0;
+
+    if (row_num >= NUM_FREE_BITMAP_ROWS) {
+      return NULL;
+    }
+
+    for (int col_num = 0; col_num < 64; col_num++) {
+      int nth_data_block = row_num * 64 + col_num;
+
+      if (
+        nth_data_block < MAX_BLOCKS_ALL_FILES && ck->owner[nth_data_block] != 0
+      ) {
+        expected |= (uint64_t)1 << (63 - col_num);
+        used++;
+        shared += ck->shared[nth_data_block];
+      }
+    }
+    __atomic_fetch_add(&ck->report->blocks_used, used, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ck->report->shared_blocks, shared, __ATOMIC_RELAXED);
+
+    uint64_t row = fs->free_block_list[row_num];
+    if (row == expected) {
+      continue;
+    }
+    for (int col_num = 0; col_num < 64; col_num++) {
+      uint64_t bit_mask = (uint64_t)1 << (63 - col_num);
+      int nth_data_block = row_num * 64 + col_num;
+
+      if ((row & bit_mask) && !(expected & bit_mask)) {
+        fsck_problem(
+          ck, &ck->report->leaked_blocks, repair,
+          "block %d: marked used but nothing points at it",
+          DATA_BLOCKS_ADDR + nth_data_block
+        );
+      } else if (!(row & bit_mask) && (expected & bit_mask)) {
+        int owner = ck->owner[nth_data_block];
+
+        fsck_problem(
+          ck, &ck->report->missing_blocks, repair,
+          "block %d: used by i-node %d (%.*s) but marked free",
+          DATA_BLOCKS_ADDR + nth_data_block, owner, MAXFILENAME,
+          fsck_name(fs, owner)
+        );
+      }
+    }
+    if (repair) {
+      fs->free_block_list[row_num] = expected;
+    }
+  }
+}
+
+void fsck_run_workers(fsck_state* ck, void* (*worker)(void*), int nthreads) {
+  pthread_t threads[FSCK_MAX_THREADS];
+
+  ck->next = 0;
+  for (int i = 0; i < nthreads; i++) {
+    pthread_create(&threads[i], NULL, worker, ck);
+  }
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+// the tables were read at mount time, this reads them again to see whether
+// they passed their checksums
+void fsck_verify_metadata(fsck_state* ck) {
+  char block_buf[BLOCK_SIZE];
+  bool repair = ck->flags & SFS_FSCK_REPAIR;
+  int first_bitmap_block = FREE_BLOCK_LIST_ADDR;
+
+  for (int addr = 0; addr < DATA_BLOCKS_ADDR; addr++) {
+    if (read_blocks_r(ck->fs->disk, addr, 1, block_buf) < 0) {
+      // rewriting the tables gives them fresh checksums
+      fsck_problem(
+        ck, &ck->report->checksum_errors, repair,
+        "block %d (metadata): fails its checksum", addr
+      );
+    }
+  }
+  for (int i = 0; i < NUM_FREE_BITMAP_BLOCKS; i++) {
+    if (read_blocks_r(ck->fs->disk, first_bitmap_block + i, 1, block_buf) < 0) {
+      fsck_problem(
+        ck, &ck->report->checksum_errors, repair,
+        "block %d (bitmap): fails its checksum", first_bitmap_block + i
+      );
+    }
+  }
+}
+
+int sfs_fsck_r(sfs_t* fs, int flags, int nthreads, sfs_fsck_report* report) {
+  fsck_state ck;
+
+  memset(report, 0, sizeof(*report));
+  if (fs->supblock.magic != SFS_MAGIC || fs->supblock.block_size != BLOCK_SIZE) {
+    printf("not an sfs image (bad superblock)\n");
+
+    return -1;
+  }
+
+  if (nthreads <= 0) {
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (nthreads > FSCK_MAX_THREADS) {
+    nthreads = FSCK_MAX_THREADS;
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+
+  // the checks below read the disk, so it has to be current. Blocks still
+  // delayed have no address yet, and would look like bad pointers.
+  if (sfs_sync_r(fs) == -1) {
+    printf("delayed blocks can't be placed, the disk is full\n");
+
+    return -1;
+  }
+
+  memset(&ck, 0, sizeof(ck));
+  ck.fs = fs;
+  ck.flags = flags;
+  ck.report = report;
+  ck.owner = calloc(MAX_BLOCKS_ALL_FILES, sizeof(int));
+  ck.claimed_by = calloc(MAX_BLOCKS_ALL_FILES, sizeof(unsigned int));
+  ck.shared = calloc(MAX_BLOCKS_ALL_FILES, sizeof(bool));
+
+  // always, an image whose tables fail them doesn't mount
+  fsck_verify_metadata(&ck);
+  fsck_check_names(&ck);
+
+  // REBUILD THE ALLOCATION MAP FROM THE I-NODES
+  fsck_run_workers(&ck, fsck_scan_worker, nthreads);
+  if (flags & SFS_FSCK_REPAIR) {
+    for (int i = 1; i < NUM_INODES; i++) {
+      if (ck.shares_blocks[i]) {
+        fsck_unshare(&ck, i);
+      }
+    }
+  }
+
+  // COMPARE IT WITH THE BITMAP
+  fsck_run_workers(&ck, fsck_bitmap_worker, nthreads);
+
+  // UPDATE DISK
+  if (report->repaired > 0) {
+    count_free_blocks(fs);
+    count_block_shares(fs);
+    table_blocks_io(fs, true, 0, &fs->supblock, sizeof(fs->supblock), 0, 0);
+    write_inode_table(fs);
+    write_dir_table(fs);
+    write_free_block_list(fs);
+  }
+  free(ck.owner);
+  free(ck.claimed_by);
+  free(ck.shared);
+
+  return report->bad_inodes + report->bad_pointers + report->dup_blocks
+    + report->leaked_blocks + report->missing_blocks + report->checksum_errors;
+}
+
+// THE ORIGINAL API, ON default_fs
+
+int sfs_getnextfilename(char* fname) {
+  return sfs_getnextfilename_r(default_fs, fname);
+}
+
+int sfs_readdir(int cookie, sfs_dirent* entry) {
+  return sfs_readdir_r(default_fs, cookie, entry);
+}
+
+int sfs_getfilesize(const char* path) {
+  return sfs_getfilesize_r(default_fs, path);
+}
+
+int sfs_lookup(const char* name) {
+  return sfs_lookup_r(default_fs, name);
+}
+
+int sfs_fopen(char* name) {
+  return sfs_fopen_r(default_fs, name);
+}
+
+int sfs_fclose(int fileID) {
+  return sfs_fclose_r(default_fs, fileID);
+}
+
+int sfs_fwrite(int fileID, const char* buf, int length) {
+  return sfs_fwrite_r(default_fs, fileID, buf, length);
+}
+
+int sfs_fread(int fileID, char* buf, int length) {
+  return sfs_fread_r(default_fs, fileID, buf, length);
+}
+
+int sfs_pwrite(int fileID, const char* buf, int length, int offset) {
+  return sfs_pwrite_r(default_fs, fileID, buf, length, offset);
+}
+
+int sfs_pread(int fileID, char* buf, int length, int offset) {
+  return sfs_pread_r(default_fs, fileID, buf, length, offset);
+}
+
+int sfs_fseek(int fileID, int loc) {
+  return sfs_fseek_r(default_fs, fileID, loc);
+}
+
+int sfs_remove(char* file) {
+  return sfs_remove_r(default_fs, file);
+}
+
+int sfs_clone(const char* src, const char* dst) {
+  return sfs_clone_r(default_fs, src, dst);
+}
+
+void sfs_set_compression(int on) {
+  sfs_set_compression_r(default_fs, on);
+}
+
+void sfs_get_compress_stats(sfs_compress_stats* stats) {
+  sfs_get_compress_stats_r(default_fs, stats);
+}
+
+void sfs_get_stats(sfs_stats* stats) {
+  sfs_get_stats_r(default_fs, stats);
+}
+
+int sfs_sync() {
+  return sfs_sync_r(default_fs);
+}
+
+void sfs_set_writeback(int max_dirty_blocks, int max_age_ms) {
+  sfs_set_writeback_r(default_fs, max_dirty_blocks, max_age_ms);
 }
@@ -7,15 +7,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 
 #include "disk_emu.h"
 
+// Everything below may be called from several threads at once, except mksfs,
+// which has to finish before anything else runs.
 void mksfs(int);
 
 int sfs_getnextfilename(char*);
 
+// 0 for a file that doesn't exist, sfs_lookup tells the two apart
 int sfs_getfilesize(const char*);
 
+// the file's i-node, -1 if there is no such file
+int sfs_lookup(const char*);
+
 int sfs_fopen(char*);
 
 int sfs_fclose(int);
@@ -24,17 +31,58 @@ int sfs_fwrite(int, const char*, int);
 
 int sfs_fread(int, char*, int);
 
-// don't seek to a location beyond what is written
-// i-node size depends on this assumption
+// like sfs_fwrite/sfs_fread but at the given offset, without using or moving
+// the fd's read/write pointer (sfs_fopen hands out one fd per file, so threads
+// sharing a file should use these)
+int sfs_pwrite(int, const char*, int, int);
+
+int sfs_pread(int, char*, int, int);
+
+// seeking beyond what is written is allowed, the gap becomes a hole that reads
+// back as zeros and takes no data blocks until something is written into it
 int sfs_fseek(int, int);
 
 int sfs_remove(char*);
 
+// makes dst (created if it doesn't exist) a copy of src that shares src's data
+// blocks instead of copying them, see CLONES below
+int sfs_clone(const char* src, const char* dst);
+
+// files created from now on get their data compressed (on != 0) or not, files
+// that already exist keep whatever they were created with
+void sfs_set_compression(int on);
+
+// Writes only reach memory, a background thread writes them to disk: blocks
+// dirty for longer than max_age_ms, everything once more than half of
+// max_dirty_blocks are dirty, and everything on sfs_sync and unmount. Writers
+// wait while max_dirty_blocks are dirty. max_dirty_blocks = 0 writes through,
+// so every call is on disk when it returns.
+// New blocks of uncompressed files only get a place on disk when they're
+// written out, all of a file's at once, so a file written in small pieces
+// still ends up in one run, and a file removed before then never reaches the
+// disk. Until then the file has a hole there on disk, so a crash loses them
+// like any other unwritten data. Writes only take a new block while there's
+// one free for every block waiting for a place, so each has one; should that
+// fail anyway, the blocks stay in memory, are tried again and sfs_sync reports
+// it.
+#define SFS_WB_MAX_DIRTY_BLOCKS 4096
+#define SFS_WB_MAX_AGE_MS 500
+
+void sfs_set_writeback(int max_dirty_blocks, int max_age_ms);
+
+// returns once everything written before the call is on disk: 0, or -1 if
+// since the last call some written blocks couldn't be given a place on disk
+// (it's full), which stay in memory until they can
+int sfs_sync(void);
+
 #define MAXFILENAME 20
 
 #define BLOCK_SIZE 1024
 
 #define NUM_INDIRECT_PTR_ENTRIES (BLOCK_SIZE / sizeof(unsigned int))
+#define MAX_BLOCKS_PER_FILE (12 + NUM_INDIRECT_PTR_ENTRIES)
+// writes past it return 0
+#define FILE_CAPACITY (BLOCK_SIZE * MAX_BLOCKS_PER_FILE)
 
 typedef struct {
   uint32_t magic;
@@ -42,8 +90,11 @@ typedef struct {
   uint32_t fs_size; // # blocks
   uint32_t inode_table_len;
   uint32_t root_dir_inode;
+  uint32_t flags; // SFS_* bits below
 } superblock;
 
+#define SFS_COMPRESS_NEW_FILES 0x1
+
 typedef struct {
   int inode; // nth inode, -1 if no i-node allocated
   uint32_t rwptr; // read/write pointer
@@ -57,6 +108,7 @@ typedef struct {
   // unsigned int gid;
   //
   unsigned int size;
+  unsigned int flags; // INODE_* bits below
   unsigned int direct[12]; // set to 0 if unassigned
   // technically not an indirect pointer, but it won't take up too much memory
   // since we don't have double or triple indirect
@@ -64,6 +116,366 @@ typedef struct {
   //
 } inode;
 
+// Small files keep their bytes in the i-node itself, in the space the indirect
+// pointers would otherwise take (they're unused until a file needs more than 12
+// blocks anyway). The file moves to regular data blocks once it outgrows it.
+#define INODE_INLINE 0x1
+#define INLINE_DATA_CAPACITY (NUM_INDIRECT_PTR_ENTRIES * sizeof(unsigned int))
+
+// Compressed files are compressed CLUSTER_BLOCKS logical blocks at a time. A
+// cluster that shrinks is packed into fewer contiguous data blocks, and all of
+// its block pointers hold the same tagged value (start address + number of data
+// blocks used). The packed data starts with its compressed length as a
+// uint32_t. Clusters that don't shrink are stored as plain blocks.
+#define INODE_COMPRESSED 0x2
+#define CLUSTER_BLOCKS 4
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * BLOCK_SIZE)
+
+// A file that shares data blocks, set by clones (on both files) and dedup (on
+// both the file and the one its blocks were merged into). sfs_fsck only takes
+// the same pointer showing up more than once for sharing when every file it
+// shows up in has this, anywhere else it's a cross-link. Dropped once the file
+// gives up its blocks.
+#define INODE_SHARED 0x4
+
+#define BLOCK_PTR_COMPRESSED 0x80000000u
+#define BLOCK_PTR_ADDR(p) ((p) & 0x00FFFFFFu)
+#define BLOCK_PTR_NBLOCKS(p) (((p) >> 24) & 0x7Fu)
+
+typedef struct {
+  uint64_t clusters_packed; // clusters written compressed
+  uint64_t clusters_raw; // clusters that didn't shrink, written as is
+  uint64_t bytes_in; // uncompressed bytes handed to the codec
+  uint64_t bytes_out; // bytes written to disk for them (ratio = in / out)
+  uint64_t compress_ns;
+  uint64_t bytes_decompressed;
+  uint64_t decompress_ns;
+} sfs_compress_stats;
+
+void sfs_get_compress_stats(sfs_compress_stats*);
+
+// STATISTICS
+// Counters since the image was mounted, for monitoring. Every call below
+// counts as one of these operations (fwrite/fread as the pwrite/pread they
+// make, the i-node number calls as the matching ones).
+enum {
+  SFS_OP_OPEN, // sfs_fopen, sfs_create_r
+  SFS_OP_CLOSE,
+  SFS_OP_READ,
+  SFS_OP_WRITE,
+  SFS_OP_REMOVE,
+  SFS_OP_TRUNCATE, // sfs_empty_inode_r
+  SFS_OP_STAT, // sfs_getfilesize, sfs_lookup(_r), sfs_inode_size_r
+  SFS_OP_READDIR, // sfs_getnextfilename, sfs_readdir
+  SFS_OP_SYNC,
+  SFS_OP_CLONE, // sfs_clone, sfs_clone_inode_r
+  SFS_NUM_OPS
+};
+
+// latency[b] counts calls that took 2^b to 2^(b+1) - 1 ns, the last bucket
+// everything slower
+#define SFS_LATENCY_BUCKETS 32
+
+typedef struct {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint64_t latency[SFS_LATENCY_BUCKETS];
+} sfs_op_stats;
+
+typedef struct {
+  sfs_op_stats ops[SFS_NUM_OPS];
+  uint64_t bytes_read; // handed back by reads
+  uint64_t bytes_written; // taken by writes
+  // blocks moved to/from the disk: file data, and the superblock, i-node,
+  // directory and bitmap tables
+  uint64_t data_blocks_read;
+  uint64_t data_blocks_written;
+  uint64_t meta_blocks_read;
+  uint64_t meta_blocks_written;
+  // the writeback buffer: data block reads it served (hits) or not, and
+  // writes to a block that was still dirty, which the disk never sees
+  uint64_t wb_hits;
+  uint64_t wb_misses;
+  uint64_t wb_overwrites;
+  // block allocation: calls, blocks handed out, calls that found nothing,
+  // groups searched and bitmap bits looked at on the way
+  uint64_t alloc_calls;
+  uint64_t alloc_blocks;
+  uint64_t alloc_failures;
+  uint64_t alloc_groups_scanned;
+  uint64_t alloc_bits_scanned;
+  // delayed allocation: new blocks written before they had a place on disk,
+  // runs the flusher placed them in, ones removed before they had one (which
+  // cost no allocation or disk write), and times one couldn't be placed for
+  // lack of room (it stays in memory and is tried again)
+  uint64_t delalloc_blocks;
+  uint64_t delalloc_runs;
+  uint64_t delalloc_dropped;
+  uint64_t delalloc_failures;
+  sfs_compress_stats compress;
+  disk_stats disk; // everything the disk file saw, checksums included
+} sfs_stats;
+
+void sfs_get_stats(sfs_stats*);
+
+// writes the stats as "name value" lines, like snprintf: returns the length
+// the whole text needs, and writes at most len bytes including the '\0'
+int sfs_format_stats(const sfs_stats*, char* buf, int len);
+
+// DIRECTORY LISTING
+// Unlike sfs_getnextfilename there's no shared cursor: the caller keeps a
+// cookie saying where its listing is, so any number of listings can run at
+// once, and each call costs the same however far along it is. Start from
+// SFS_DIR_START. Files created or removed meanwhile may or may not show up.
+typedef struct {
+  char name[MAXFILENAME + 1];
+  int inode; // what the I-NODE NUMBER API below takes
+  unsigned int size;
+} sfs_dirent;
+
+#define SFS_DIR_START 0
+
+// fills in the next file from cookie on and returns the cookie to carry on
+// from, or returns 0 once there are none left
+int sfs_readdir(int cookie, sfs_dirent*);
+
+// REENTRANT API
+// One sfs_t per mounted image, any number of them can be open at once. The
+// functions above are the same calls on an image mksfs mounts at "fs.sfs".
+typedef struct sfs_t sfs_t;
+
+// fresh != 0 formats a new image at path, otherwise opens the existing one.
+// Returns NULL if the disk file can't be created/opened, isn't an sfs image
+// with this layout, or its tables (superblock, i-nodes, directory, bitmap)
+// fail their checksums.
+sfs_t* sfs_mount(char* path, int fresh);
+
+// opens an existing image even if its tables fail their checksums, with what
+// could be read of them, for sfs_fsck_r to repair; still NULL if it isn't an
+// sfs image
+sfs_t* sfs_mount_damaged(char* path);
+
+// nothing else may be using the image while it's unmounted
+void sfs_unmount(sfs_t*);
+
+int sfs_getnextfilename_r(sfs_t*, char*);
+int sfs_getfilesize_r(sfs_t*, const char*);
+int sfs_readdir_r(sfs_t*, int cookie, sfs_dirent*);
+int sfs_fopen_r(sfs_t*, char*);
+int sfs_fclose_r(sfs_t*, int);
+int sfs_fwrite_r(sfs_t*, int, const char*, int);
+int sfs_fread_r(sfs_t*, int, char*, int);
+int sfs_pwrite_r(sfs_t*, int, const char*, int, int);
+int sfs_pread_r(sfs_t*, int, char*, int, int);
+int sfs_fseek_r(sfs_t*, int, int);
+int sfs_remove_r(sfs_t*, char*);
+void sfs_set_compression_r(sfs_t*, int);
+void sfs_get_compress_stats_r(sfs_t*, sfs_compress_stats*);
+void sfs_get_stats_r(sfs_t*, sfs_stats*);
+void sfs_set_writeback_r(sfs_t*, int max_dirty_blocks, int max_age_ms);
+int sfs_sync_r(sfs_t*);
+
+// I-NODE NUMBER API
+// Files by i-node number instead of by name, for callers like the low-level
+// FUSE wrapper that resolve a name once and keep the number. Numbers start at
+// 1 and are reused once a file is removed. Nothing here uses an fd.
+
+// the file's i-node, -1 if there is no such file
+int sfs_lookup_r(sfs_t*, const char* name);
+// creates an empty file (or finds the existing one), returns its i-node or -1
+int sfs_create_r(sfs_t*, const char* name);
+// -1 if the i-node isn't in use
+int sfs_inode_size_r(sfs_t*, int nth_inode);
+int sfs_pwrite_inode_r(sfs_t*, int nth_inode, const char*, int, int);
+int sfs_pread_inode_r(sfs_t*, int nth_inode, char*, int, int);
+// truncates the file to 0 bytes, -1 if the i-node isn't in use
+int sfs_empty_inode_r(sfs_t*, int nth_inode);
+
+// CLONES
+// A clone starts out pointing at the same data blocks as its source, so
+// making one takes the same short time and next to no space however large the
+// file is. Every data block knows how many i-nodes point at it, and a file
+// that writes to a block it shares gets its own copy of that block first:
+// neither side ever sees the other's writes, and only what they change takes
+// space. The counts aren't stored anywhere, mounting recounts them from the
+// i-nodes; both files are marked INODE_SHARED.
+
+// makes dst a clone of src, dst is created if it doesn't exist and loses what
+// it held if it does; returns dst's i-node, or -1 if src doesn't exist, dst's
+// name is too long, no i-node is free or some of src's blocks have no place on
+// disk yet because it's full
+int sfs_clone_r(sfs_t*, const char* src, const char* dst);
+// the same on i-node numbers, -1 if either isn't in use
+int sfs_clone_inode_r(sfs_t*, int src_inode, int dst_inode);
+
+// The FUSE wrappers make the open file this ioctl is made on a clone of the
+// file named in src (its name in the mount, no directory), see sfs_clone.c.
+// copy_file_range would be the standard way, but the libfuse 2 API they're
+// built on doesn't have it.
+typedef struct {
+  char src[MAXFILENAME + 1];
+} sfs_clone_ioctl;
+
+#define SFS_IOC_CLONE _IOW('S', 1, sfs_clone_ioctl)
+
+// DEDUP
+// One pass over every file hashes its data blocks (a packed cluster's as one)
+// into an index of what the pass has seen so far, and a file whose blocks hold
+// the same bytes as ones already indexed is pointed at those instead, sharing
+// them the way clones do (see CLONES). Matches are compared byte for byte
+// before they're shared, so the hash only has to find them. Safe while the
+// image is in use: a file's readers and writers wait while its blocks are
+// done, and a match in a file that's busy right then is left for the next
+// pass. The index only lives for the pass.
+typedef struct {
+  int files;
+  int blocks; // data blocks read and hashed
+  int merged_blocks; // pointed at another block holding the same bytes
+  int freed_blocks; // of those, ones nothing else pointed at any more
+  int skipped_blocks; // matched a block of a file that was busy
+  int unreadable_blocks; // failed their checksum, left alone
+  int index_entries;
+  long long index_bytes; // memory the index took
+  // afterwards (or what they'd be, for a dry run): pointers to data blocks in
+  // all files, and the distinct blocks they point at. The first over the
+  // second is the dedup ratio, clones count too.
+  int referenced_blocks;
+  int stored_blocks;
+} sfs_dedup_report;
+
+#define SFS_DEDUP_DRY_RUN 0x1 // only find the matches, change nothing
+
+// fills in the report, returns the blocks merged
+int sfs_dedup_r(sfs_t*, int flags, sfs_dedup_report*);
+
+// BLOCK I/O TRACE
+// Records every block read and write the image's disk gets, each marked as
+// metadata or file data, for sfs_replay to play back (the format is in
+// disk_emu.h). sfs_mount starts one at $SFS_TRACE if that is set, so a FUSE
+// mount can be traced as it is; every mount starts the file afresh.
+
+// -1 if the trace file can't be created
+int sfs_start_trace_r(sfs_t*, const char* path);
+void sfs_stop_trace_r(sfs_t*);
+
+// CONSISTENCY CHECK
+typedef struct {
+  int files; // files checked
+  int blocks_used; // data blocks the files point at
+  int shared_blocks; // of those, ones clones or dedup share, not a problem
+  int bad_inodes; // i-nodes/directory entries whose fields don't add up
+  int bad_pointers; // block pointers outside the data region, broken clusters
+  // data blocks something else points at too, other than files marked
+  // INODE_SHARED pointing at them the same way
+  int dup_blocks;
+  int leaked_blocks; // marked used in the bitmap, but nothing points at them
+  int missing_blocks; // in use, but marked free in the bitmap
+  // blocks failing their checksum, data blocks only looked at with
+  // SFS_FSCK_VERIFY_DATA (the tables always are)
+  int checksum_errors;
+  int repaired; // problems fixed, with SFS_FSCK_REPAIR
+} sfs_fsck_report;
+
+#define SFS_FSCK_REPAIR 0x1 // fix what can be fixed and write it back
+#define SFS_FSCK_VERIFY_DATA 0x2 // also read every block and check its checksum
+
+// Rebuilds the block allocation map from the i-nodes with nthreads threads
+// (<= 0 for one per CPU) and compares it with the bitmap, printing each
+// problem it finds. Returns the number of problems, -1 if it isn't an sfs
+// image or the blocks still delayed can't all be placed (nothing is checked
+// then). Nothing else may be using the image while it runs.
+int sfs_fsck_r(sfs_t*, int flags, int nthreads, sfs_fsck_report*);
+
+// IMAGE BUILDER
+// Writes a new image in one go without mounting it, much faster than creating
+// the files through the API: each file's data goes right after the one
+// before's, in one run, all of it streamed out in large writes, and every
+// table is written once at the end. Small files are kept in their i-node like
+// sfs does. Names are stored as given.
+typedef struct sfs_builder sfs_builder;
+
+// NULL if the disk file can't be created
+sfs_builder* sfs_build_start(char* path);
+
+// adds a file of len bytes, returns its i-node or -1 if the name is too long
+// or taken, there are no i-nodes left, or it doesn't fit
+int sfs_build_add(sfs_builder*, const char* name, const char* data, int len);
+
+// writes the tables and closes the image
+void sfs_build_finish(sfs_builder*);
+
+// FRAGMENTATION
+// A file's extents are its runs of data blocks that follow each other on disk
+// in file order (a compressed cluster is one run). Reading a file through
+// costs one disk access per extent.
+typedef struct {
+  int inode;
+  char name[MAXFILENAME + 1];
+  unsigned int size;
+  int blocks; // data blocks it uses
+  int extents; // 0 if it has no data blocks
+} sfs_frag_file;
+
+#define SFS_FRAG_BUCKETS 16
+
+typedef struct {
+  int files;
+  int fragmented_files; // more than one extent
+  int blocks, extents; // over all files
+  int free_blocks;
+  int free_extents; // runs of free data blocks
+  int largest_free_extent;
+  // free_hist[b] counts free runs of 2^b up to 2^(b+1) - 1 blocks, the last
+  // bucket everything longer
+  int free_hist[SFS_FRAG_BUCKETS];
+} sfs_frag_report;
+
+// Fills in the report and, if files isn't NULL, up to max_files per-file
+// entries. Returns the number of files. Safe while the image is in use.
+int sfs_frag_r(sfs_t*, sfs_frag_report*, sfs_frag_file* files, int max_files);
+
+// Moves a file's data blocks into one contiguous run while the image stays in
+// use: its readers and writers wait, everyone else carries on. Returns the
+// extents the file has afterwards, which stays what it was if no free run is
+// long enough or the file shares blocks with a clone (moving them would undo
+// the sharing), or -1 if the i-node isn't in use. The old blocks are only
+// freed once the moved file is on disk, so a crash leaves the file either
+// where it was or where it moved (at worst with the old blocks still marked
+// in use, which sfs_fsck -y frees).
+int sfs_defrag_inode_r(sfs_t*, int nth_inode);
+
+// sfs_defrag_inode_r on every file with more than one extent, returns how
+// many ended up in one
+int sfs_defrag_r(sfs_t*);
+
+// EXPORT
+// Reads every file out of the image in one pass over the disk: the tables
+// are already in memory, so all the files' data blocks are sorted by address
+// and read in long sequential runs, each piece copied into its file as it
+// goes by. A file is handed out as soon as its last block has been read, so
+// files come out in the order their data ends on disk, not by name. Holes
+// read as zeros.
+typedef struct {
+  int files;
+  int damaged_files; // some of their blocks failed their checksum
+  long long bytes;
+  int blocks; // data blocks read
+  int reads; // disk reads it took
+} sfs_export_report;
+
+// data is the whole file, len bytes of it, and only good during the call;
+// damaged files come out too, with what could be read
+typedef void (*sfs_export_fn)(
+  void* arg, int nth_inode, const char* name, const char* data, int len,
+  int damaged
+);
+
+// Calls fn once per file, with every writer held off meanwhile, so what comes
+// out is one moment's image. fn mustn't call back into fs. Fills in the report
+// if it isn't NULL, returns the number of files.
+int sfs_export_r(sfs_t*, sfs_export_fn fn, void* arg, sfs_export_report*);
+
 typedef struct {
   // idk why, but if I don't times 9 or more it segfaults. Otherwise works
   // perfectly. It results in 32 wasted blocks total with 1024B-sized blocks, so 
@@ -0,0 +1,293 @@
+#include "sfs_async.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define MAX_WORKERS 64
+#define MIN_DEFAULT_WORKERS 4
+
+typedef enum { AIO_OPEN, AIO_READ, AIO_WRITE, AIO_SYNC } aio_op;
+
+typedef struct aio_req {
+  aio_op op;
+  int fileID;
+  char* buf; // only read from for writes
+  int length;
+  int offset;
+  char name[MAXFILENAME + 1];
+  sfs_aio_cb cb;
+  void* arg;
+  int result;
+  struct aio_req* next;
+} aio_req;
+
+struct sfs_aio {
+  sfs_t* fs;
+  int flags;
+  int efd;
+  int nworkers;
+  pthread_t workers[MAX_WORKERS];
+
+  pthread_mutex_t lock; // everything below
+  pthread_cond_t work; // something was queued, or stopping
+  pthread_cond_t progress; // a request completed or its callback ran
+  aio_req* queue_head; // submitted, not picked up yet
+  aio_req* queue_tail;
+  aio_req* done_head; // completed, callback not run yet
+  aio_req* done_tail;
+  int inflight; // submitted and callback not run yet
+  bool stopping;
+};
+
+static void append(aio_req** head, aio_req** tail, aio_req* req) {
+  req->next = NULL;
+  if (*tail == NULL) {
+    *head = req;
+  } else {
+    (*tail)->next = req;
+  }
+  *tail = req;
+}
+
+static void run(sfs_t* fs, aio_req* req) {
+  switch (req->op) {
+    case AIO_OPEN:
+      req->result = sfs_fopen_r(fs, req->name);
+      break;
+    case AIO_READ:
+      req->result = sfs_pread_r(
+        fs, req->fileID, req->buf, req->length, req->offset
+      );
+      break;
+    case AIO_WRITE:
+      req->result = sfs_pwrite_r(
+        fs, req->fileID, req->buf, req->length, req->offset
+      );
+      break;
+    case AIO_SYNC:
+      req->result = sfs_sync_r(fs);
+      break;
+  }
+}
+
+static void* worker_main(void* arg) {
+  sfs_aio* aio = arg;
+  uint64_t one = 1;
+
+  pthread_mutex_lock(&aio->lock);
+  for (;;) {
+    while (aio->queue_head == NULL && !aio->stopping) {
+      pthread_cond_wait(&aio->work, &aio->lock);
+    }
+    if (aio->queue_head == NULL) {
+      // stopping, and nothing left to run
+      break;
+    }
+
+    aio_req* req = aio->queue_head;
+    aio->queue_head = req->next;
+    if (aio->queue_head == NULL) {
+      aio->queue_tail = NULL;
+    }
+    pthread_mutex_unlock(&aio->lock);
+
+    run(aio->fs, req);
+
+    if (aio->flags & SFS_AIO_WORKER_CALLBACKS) {
+      if (req->cb != NULL) {
+        req->cb(req->arg, req->result);
+      }
+      free(req);
+      pthread_mutex_lock(&aio->lock);
+      aio->inflight--;
+    } else {
+      pthread_mutex_lock(&aio->lock);
+      append(&aio->done_head, &aio->done_tail, req);
+      if (write(aio->efd, &one, sizeof(one)) < 0) {
+        // EAGAIN, the counter is full and the fd readable anyway
+      }
+    }
+    pthread_cond_broadcast(&aio->progress);
+  }
+  pthread_mutex_unlock(&aio->lock);
+
+  return NULL;
+}
+
+sfs_aio* sfs_aio_create(sfs_t* fs, int nworkers, int flags) {
+  sfs_aio* aio = calloc(1, sizeof(sfs_aio));
+
+  if (nworkers <= 0) {
+    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < MIN_DEFAULT_WORKERS) {
+      nworkers = MIN_DEFAULT_WORKERS;
+    }
+  }
+  if (nworkers > MAX_WORKERS) {
+    nworkers = MAX_WORKERS;
+  }
+
+  aio->fs = fs;
+  aio->flags = flags;
+  aio->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (aio->efd < 0) {
+    free(aio);
+
+    return NULL;
+  }
+  pthread_mutex_init(&aio->lock, NULL);
+  pthread_cond_init(&aio->work, NULL);
+  pthread_cond_init(&aio->progress, NULL);
+
+  for (int i = 0; i < nworkers; i++) {
+    if (pthread_create(&aio->workers[i], NULL, worker_main, aio) != 0) {
+      aio->nworkers = i;
+      sfs_aio_destroy(aio);
+
+      return NULL;
+    }
+  }
+  aio->nworkers = nworkers;
+
+  return aio;
+}
+
+void sfs_aio_destroy(sfs_aio* aio) {
+  if (aio == NULL) {
+    return;
+  }
+
+  // DRAIN
+  pthread_mutex_lock(&aio->lock);
+  while (aio->inflight > 0) {
+    if (aio->done_head != NULL) {
+      pthread_mutex_unlock(&aio->lock);
+      sfs_aio_dispatch(aio);
+      pthread_mutex_lock(&aio->lock);
+      continue;
+    }
+    pthread_cond_wait(&aio->progress, &aio->lock);
+  }
+  aio->stopping = true;
+  pthread_cond_broadcast(&aio->work);
+  pthread_mutex_unlock(&aio->lock);
+
+  for (int i = 0; i < aio->nworkers; i++) {
+    pthread_join(aio->workers[i], NULL);
+  }
+  close(aio->efd);
+  pthread_mutex_destroy(&aio->lock);
+  pthread_cond_destroy(&aio->work);
+  pthread_cond_destroy(&aio->progress);
+  free(aio);
+}
+
+int sfs_aio_fd(sfs_aio* aio) {
+  return aio->efd;
+}
+
+int sfs_aio_dispatch(sfs_aio* aio) {
+  uint64_t count;
+  int n = 0;
+
+  // reset the fd first, so whatever completes from here on signals it again
+  if (read(aio->efd, &count, sizeof(count)) < 0) {
+    // EAGAIN, nothing was signalled (or callbacks run on the workers)
+  }
+
+  pthread_mutex_lock(&aio->lock);
+  aio_req* req = aio->done_head;
+  aio->done_head = NULL;
+  aio->done_tail = NULL;
+  pthread_mutex_unlock(&aio->lock);
+
+  while (req != NULL) {
+    aio_req* next = req->next;
+
+    if (req->cb != NULL) {
+      req->cb(req->arg, req->result);
+    }
+    free(req);
+    req = next;
+    n++;
+  }
+
+  if (n > 0) {
+    pthread_mutex_lock(&aio->lock);
+    aio->inflight -= n;
+    pthread_cond_broadcast(&aio->progress);
+    pthread_mutex_unlock(&aio->lock);
+  }
+
+  return n;
+}
+
+static aio_req* new_req(aio_op op, sfs_aio_cb cb, void* arg) {
+  aio_req* req = calloc(1, sizeof(aio_req));
+
+  req->op = op;
+  req->cb = cb;
+  req->arg = arg;
+
+  return req;
+}
+
+static int submit(sfs_aio* aio, aio_req* req) {
+  pthread_mutex_lock(&aio->lock);
+  if (aio->inflight >= SFS_AIO_MAX_INFLIGHT || aio->stopping) {
+    pthread_mutex_unlock(&aio->lock);
+    free(req);
+
+    return -1;
+  }
+  aio->inflight++;
+  append(&aio->queue_head, &aio->queue_tail, req);
+  pthread_cond_signal(&aio->work);
+  pthread_mutex_unlock(&aio->lock);
+
+  return 0;
+}
+
+int sfs_open_async(sfs_aio* aio, const char* name, sfs_aio_cb cb, void* arg) {
+  if (strlen(name) > MAXFILENAME) {
+    return -1;
+  }
+
+  aio_req* req = new_req(AIO_OPEN, cb, arg);
+  strcpy(req->name, name);
+
+  return submit(aio, req);
+}
+
+int sfs_read_async(
+  sfs_aio* aio, int fileID, char* buf, int length, int offset, sfs_aio_cb cb,
+  void* arg
+) {
+  aio_req* req = new_req(AIO_READ, cb, arg);
+
+  req->fileID = fileID;
+  req->buf = buf;
+  req->length = length;
+  req->offset = offset;
+
+  return submit(aio, req);
+}
+
+int sfs_write_async(
+  sfs_aio* aio, int fileID, const char* buf, int length, int offset,
+  sfs_aio_cb cb, void* arg
+) {
+  aio_req* req = new_req(AIO_WRITE, cb, arg);
+
+  req->fileID = fileID;
+  req->buf = (char*)buf;
+  req->length = length;
+  req->offset = offset;
+
+  return submit(aio, req);
+}
+
+int sfs_sync_async(sfs_aio* aio, sfs_aio_cb cb, void* arg) {
+  return submit(aio, new_req(AIO_SYNC, cb, arg));
+}
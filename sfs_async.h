@@ -0,0 +1,55 @@
+#ifndef SFS_ASYNC_H
+#define SFS_ASYNC_H
+
+#include "sfs_api.h"
+
+// Non-blocking sfs calls for event loops. Each call queues a request and
+// returns at once; a pool of worker threads runs it with the matching _r call
+// and reports the result (what the blocking call would have returned) through
+// the request's callback. Requests may complete in any order.
+//
+// By default callbacks run on the thread that calls sfs_aio_dispatch: poll
+// sfs_aio_fd for readability and dispatch when it fires. With
+// SFS_AIO_WORKER_CALLBACKS they run on the worker threads instead, as soon as
+// the request is done, and the fd is never signalled.
+
+typedef struct sfs_aio sfs_aio;
+
+typedef void (*sfs_aio_cb)(void* arg, int result);
+
+#define SFS_AIO_WORKER_CALLBACKS 0x1
+
+// requests queued or running at once, past this submitting fails
+#define SFS_AIO_MAX_INFLIGHT 4096
+
+// nworkers <= 0 picks one per CPU (at least 4, since sfs calls can block on
+// writeback). Returns NULL if the threads or the eventfd can't be created.
+sfs_aio* sfs_aio_create(sfs_t* fs, int nworkers, int flags);
+
+// waits for every request already submitted, runs callbacks still pending and
+// stops the workers
+void sfs_aio_destroy(sfs_aio*);
+
+// eventfd that becomes readable when completions are waiting for dispatch
+int sfs_aio_fd(sfs_aio*);
+
+// runs the callbacks of completed requests on this thread, returns how many
+int sfs_aio_dispatch(sfs_aio*);
+
+// cb may be NULL if the result isn't needed.
+// All of these return 0 once queued, or -1 (nothing queued, the callback is
+// never called) if SFS_AIO_MAX_INFLIGHT requests are already in flight or the
+// name is too long. Buffers must stay valid until the callback runs.
+int sfs_open_async(sfs_aio*, const char* name, sfs_aio_cb cb, void* arg);
+int sfs_read_async(
+  sfs_aio*, int fileID, char* buf, int length, int offset, sfs_aio_cb cb,
+  void* arg
+);
+int sfs_write_async(
+  sfs_aio*, int fileID, const char* buf, int length, int offset,
+  sfs_aio_cb cb, void* arg
+);
+// sfs_sync_r, the result is what it returns
+int sfs_sync_async(sfs_aio*, sfs_aio_cb cb, void* arg);
+
+#endif
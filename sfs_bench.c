@@ -0,0 +1,521 @@
+// sfs_bench: runs workloads against a fresh sfs image and prints the results
+// as JSON, so runs of different sfs_api.c/disk_emu.c versions can be compared.
+//
+//   sfs_bench [-w workloads] [-s sizes] [-n ops] [-S seed] [-d] [-f image]
+//
+//   -w  comma-separated workloads (all of them by default):
+//         seq_write, seq_read, rand_write, rand_read  one file, at each size
+//         create, open, remove                         one file per op
+//         churn                                       small files created,
+//                                                     rewritten and removed
+//         fill                                        4 KiB writes until the
+//                                                     image is full
+//   -s  comma-separated I/O sizes in bytes for the read/write workloads
+//       (1024,4096,65536 by default)
+//   -n  operations per run (2000 by default)
+//   -S  random seed, so runs can be repeated exactly
+//   -d  write-through instead of the default writeback limits
+//   -f  image file to use (sfs_bench.sfs by default), formatted for every
+//       run and removed at the end
+//
+// Every run reports ops/s, MB/s and per-operation latency (min, mean, p50,
+// p99, p999, max and a power-of-two histogram). Only the operations are
+// timed, not setting files up for them. Runs that write end with an
+// sfs_sync_r, which counts towards the run's time but not any operation's
+// latency.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+
+#define FILE_BYTES (BLOCK_SIZE * (12 + NUM_INDIRECT_PTR_ENTRIES))
+#define MAX_FILES 199 // every i-node but the root's
+#define MAX_SIZES 16
+#define HISTOGRAM_BUCKETS 48
+
+typedef struct {
+  const char* name;
+  bool sized; // runs once per I/O size
+  int (*run)(sfs_t* fs, int io_size, int nops);
+} workload;
+
+// state of the current run
+static uint64_t* latencies;
+static int nlatencies;
+static uint64_t timed_ns; // the operations plus syncs, not any setup
+static uint64_t bytes_moved;
+static uint64_t rng_state;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t next_random() {
+  // xorshift64*
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+
+  return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+static void record(uint64_t start, int bytes) {
+  uint64_t latency = now_ns() - start;
+
+  latencies[nlatencies++] = latency;
+  timed_ns += latency;
+  bytes_moved += bytes;
+}
+
+// counts towards the run's time, but isn't an operation
+static void timed_sync(sfs_t* fs) {
+  uint64_t start = now_ns();
+
+  sfs_sync_r(fs);
+  timed_ns += now_ns() - start;
+}
+
+static void file_name(char* name, int n) {
+  sprintf(name, "bench%d", n);
+}
+
+// a file of FILE_BYTES, for the read workloads
+static int full_file(sfs_t* fs, char* buf) {
+  int fd = sfs_fopen_r(fs, "data");
+
+  for (int off = 0; off < FILE_BYTES; off += BLOCK_SIZE) {
+    sfs_pwrite_r(fs, fd, buf, BLOCK_SIZE, off);
+  }
+  sfs_sync_r(fs);
+
+  return fd;
+}
+
+// WORKLOADS
+// Each one returns the number of operations that failed.
+
+static int seq_write(sfs_t* fs, int io_size, int nops) {
+  char* buf = malloc(io_size);
+  int fd = sfs_fopen_r(fs, "data");
+  int failed = 0;
+
+  memset(buf, 'w', io_size);
+  for (int i = 0, off = 0; i < nops; i++) {
+    if (off + io_size > FILE_BYTES) {
+      off = 0;
+    }
+    uint64_t start = now_ns();
+    int n = sfs_pwrite_r(fs, fd, buf, io_size, off);
+    record(start, n);
+    failed += n != io_size;
+    off += io_size;
+  }
+  timed_sync(fs);
+  free(buf);
+
+  return failed;
+}
+
+static int seq_read(sfs_t* fs, int io_size, int nops) {
+  char* buf = malloc(io_size > BLOCK_SIZE ? io_size : BLOCK_SIZE);
+  int failed = 0;
+
+  memset(buf, 'r', BLOCK_SIZE);
+  int fd = full_file(fs, buf);
+  for (int i = 0, off = 0; i < nops; i++) {
+    if (off + io_size > FILE_BYTES) {
+      off = 0;
+    }
+    uint64_t start = now_ns();
+    int n = sfs_pread_r(fs, fd, buf, io_size, off);
+    record(start, n);
+    failed += n != io_size;
+    off += io_size;
+  }
+  free(buf);
+
+  return failed;
+}
+
+static int rand_write(sfs_t* fs, int io_size, int nops) {
+  char* buf = malloc(io_size);
+  int fd = sfs_fopen_r(fs, "data");
+  int slots = FILE_BYTES / io_size;
+  int failed = 0;
+
+  memset(buf, 'w', io_size);
+  for (int i = 0; i < nops; i++) {
+    int off = next_random() % slots * io_size;
+    uint64_t start = now_ns();
+    int n = sfs_pwrite_r(fs, fd, buf, io_size, off);
+    record(start, n);
+    failed += n != io_size;
+  }
+  timed_sync(fs);
+  free(buf);
+
+  return failed;
+}
+
+static int rand_read(sfs_t* fs, int io_size, int nops) {
+  char* buf = malloc(io_size > BLOCK_SIZE ? io_size : BLOCK_SIZE);
+  int slots = FILE_BYTES / io_size;
+  int failed = 0;
+
+  memset(buf, 'r', BLOCK_SIZE);
+  int fd = full_file(fs, buf);
+  for (int i = 0; i < nops; i++) {
+    int off = next_random() % slots * io_size;
+    uint64_t start = now_ns();
+    int n = sfs_pread_r(fs, fd, buf, io_size, off);
+    record(start, n);
+    failed += n != io_size;
+  }
+  free(buf);
+
+  return failed;
+}
+
+// removes files 0..n-1 without timing it
+static void remove_files(sfs_t* fs, int n) {
+  char name[MAXFILENAME + 1];
+
+  for (int i = 0; i < n; i++) {
+    file_name(name, i);
+    sfs_remove_r(fs, name);
+  }
+}
+
+static int create_storm(sfs_t* fs, int io_size, int nops) {
+  char name[MAXFILENAME + 1];
+  int failed = 0;
+
+  for (int i = 0; i < nops; i++) {
+    if (i % MAX_FILES == 0) {
+      // out of i-nodes, start over
+      remove_files(fs, MAX_FILES);
+    }
+    file_name(name, i % MAX_FILES);
+    uint64_t start = now_ns();
+    int fd = sfs_fopen_r(fs, name);
+    record(start, 0);
+    failed += fd < 0;
+    sfs_fclose_r(fs, fd);
+  }
+
+  return failed;
+}
+
+static int open_storm(sfs_t* fs, int io_size, int nops) {
+  char name[MAXFILENAME + 1];
+  int failed = 0;
+
+  for (int i = 0; i < MAX_FILES; i++) {
+    file_name(name, i);
+    sfs_fclose_r(fs, sfs_fopen_r(fs, name));
+  }
+  for (int i = 0; i < nops; i++) {
+    file_name(name, next_random() % MAX_FILES);
+    uint64_t start = now_ns();
+    int fd = sfs_fopen_r(fs, name);
+    sfs_fclose_r(fs, fd);
+    record(start, 0);
+    failed += fd < 0;
+  }
+
+  return failed;
+}
+
+static int remove_storm(sfs_t* fs, int io_size, int nops) {
+  char name[MAXFILENAME + 1];
+  char buf[BLOCK_SIZE * 4];
+  int failed = 0;
+
+  memset(buf, 'x', sizeof(buf));
+  for (int i = 0; i < nops; i++) {
+    if (i % MAX_FILES == 0) {
+      // (re)create a batch of files with a few blocks each
+      for (int j = 0; j < MAX_FILES; j++) {
+        file_name(name, j);
+        int fd = sfs_fopen_r(fs, name);
+        sfs_pwrite_r(fs, fd, buf, sizeof(buf), 0);
+        sfs_fclose_r(fs, fd);
+      }
+    }
+    file_name(name, i % MAX_FILES);
+    uint64_t start = now_ns();
+    int res = sfs_remove_r(fs, name);
+    record(start, 0);
+    failed += res < 0;
+  }
+
+  return failed;
+}
+
+// small files: a random one of 100 is created and written if it doesn't
+// exist, rewritten half the time if it does, removed otherwise
+static int churn(sfs_t* fs, int io_size, int nops) {
+  bool exists[100] = {false};
+  char name[MAXFILENAME + 1];
+  char buf[BLOCK_SIZE * 4];
+  int failed = 0;
+
+  memset(buf, 'c', sizeof(buf));
+  for (int i = 0; i < nops; i++) {
+    int n = next_random() % 100;
+    int len = next_random() % sizeof(buf) + 1;
+
+    file_name(name, n);
+    uint64_t start = now_ns();
+    if (exists[n] && next_random() % 2) {
+      failed += sfs_remove_r(fs, name) < 0;
+      record(start, 0);
+      exists[n] = false;
+    } else {
+      int fd = sfs_fopen_r(fs, name);
+      int written = sfs_pwrite_r(fs, fd, buf, len, 0);
+      sfs_fclose_r(fs, fd);
+      record(start, written);
+      failed += written != len;
+      exists[n] = true;
+    }
+  }
+  timed_sync(fs);
+
+  return failed;
+}
+
+// 4 KiB writes into one file after another until nothing more fits, nops is
+// ignored
+static int fill(sfs_t* fs, int io_size, int nops) {
+  char name[MAXFILENAME + 1];
+  char buf[4096];
+
+  memset(buf, 'f', sizeof(buf));
+  for (int i = 0; i < MAX_FILES; i++) {
+    file_name(name, i);
+    int fd = sfs_fopen_r(fs, name);
+    if (fd < 0) {
+      break;
+    }
+    for (int off = 0; off < FILE_BYTES; off += sizeof(buf)) {
+      uint64_t start = now_ns();
+      int n = sfs_pwrite_r(fs, fd, buf, sizeof(buf), off);
+      record(start, n);
+      if (n < (int)sizeof(buf) && off + n < FILE_BYTES) {
+        // the image is full
+        i = MAX_FILES;
+        break;
+      }
+    }
+    sfs_fclose_r(fs, fd);
+  }
+  timed_sync(fs);
+
+  return 0;
+}
+
+static const workload workloads[] = {
+  {"seq_write", true, seq_write},
+  {"seq_read", true, seq_read},
+  {"rand_write", true, rand_write},
+  {"rand_read", true, rand_read},
+  {"create", false, create_storm},
+  {"open", false, open_storm},
+  {"remove", false, remove_storm},
+  {"churn", false, churn},
+  {"fill", false, fill},
+};
+#define NUM_WORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+// REPORTING
+
+static int cmp_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(double p) {
+  int i = (int)(p * nlatencies);
+
+  return latencies[i < nlatencies ? i : nlatencies - 1];
+}
+
+static void print_result(
+  const char* name, int io_size, double seconds, int failed, bool first
+) {
+  uint64_t total = 0;
+  int histogram[HISTOGRAM_BUCKETS] = {0};
+  bool first_bucket = true;
+
+  qsort(latencies, nlatencies, sizeof(uint64_t), cmp_u64);
+  for (int i = 0; i < nlatencies; i++) {
+    int bucket = 0;
+
+    total += latencies[i];
+    while (bucket < HISTOGRAM_BUCKETS - 1 && latencies[i] >> bucket > 1) {
+      bucket++;
+    }
+    histogram[bucket]++;
+  }
+
+  printf(
+    "%s    {\"workload\": \"%s\", \"io_size\": %d, \"ops\": %d, "
+    "\"failed\": %d, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+    "\"mb_per_sec\": %.2f,\n",
+    first ? "" : ",\n", name, io_size, nlatencies, failed, seconds,
+    nlatencies / seconds, bytes_moved / seconds / (1024 * 1024)
+  );
+  if (nlatencies == 0) {
+    printf("     \"latency_ns\": null, \"histogram\": []}");
+
+    return;
+  }
+  printf(
+    "     \"latency_ns\": {\"min\": %llu, \"mean\": %llu, \"p50\": %llu, "
+    "\"p99\": %llu, \"p999\": %llu, \"max\": %llu},\n",
+    (unsigned long long)latencies[0],
+    (unsigned long long)(total / nlatencies),
+    (unsigned long long)percentile(0.50), (unsigned long long)percentile(0.99),
+    (unsigned long long)percentile(0.999),
+    (unsigned long long)latencies[nlatencies - 1]
+  );
+  // bucket b counts latencies up to 2^(b+1) ns
+  printf("     \"histogram\": [");
+  for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+    if (histogram[b] > 0) {
+      printf(
+        "%s{\"le_ns\": %llu, \"count\": %d}", first_bucket ? "" : ", ",
+        1ull << (b + 1), histogram[b]
+      );
+      first_bucket = false;
+    }
+  }
+  printf("]}");
+}
+
+// RUNNING
+
+static bool selected(const char* list, const char* name) {
+  if (list == NULL) {
+    return true;
+  }
+
+  size_t len = strlen(name);
+  for (const char* p = list; (p = strstr(p, name)) != NULL; p += len) {
+    if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0')) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+int main(int argc, char** argv) {
+  const char* selection = NULL;
+  int sizes[MAX_SIZES] = {1024, 4096, 65536};
+  int nsizes = 3;
+  int nops = 2000;
+  uint64_t seed = 1;
+  bool write_through = false;
+  char* path = "sfs_bench.sfs";
+  bool first = true;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "w:s:n:S:df:")) != -1) {
+    switch (opt) {
+      case 'w':
+        selection = optarg;
+        break;
+      case 's':
+        nsizes = 0;
+        for (char* p = strtok(optarg, ","); p != NULL && nsizes < MAX_SIZES;
+             p = strtok(NULL, ",")) {
+          int size = atoi(p);
+          if (size > 0 && size <= FILE_BYTES) {
+            sizes[nsizes++] = size;
+          }
+        }
+        break;
+      case 'n':
+        nops = atoi(optarg);
+        break;
+      case 'S':
+        seed = strtoull(optarg, NULL, 0);
+        break;
+      case 'd':
+        write_through = true;
+        break;
+      case 'f':
+        path = optarg;
+        break;
+      default:
+        fprintf(
+          stderr,
+          "usage: %s [-w workloads] [-s sizes] [-n ops] [-S seed] [-d] "
+          "[-f image]\n",
+          argv[0]
+        );
+        return 1;
+    }
+  }
+  if (nsizes == 0 || nops <= 0) {
+    fprintf(stderr, "%s: need at least one size and one op\n", argv[0]);
+    return 1;
+  }
+
+  // fill writes at most one 4 KiB chunk per data block
+  int max_ops = (MAX_FILES * FILE_BYTES) / 4096 + MAX_FILES;
+  latencies = malloc(sizeof(uint64_t) * (nops > max_ops ? nops : max_ops));
+
+  printf(
+    "{\"image\": \"%s\", \"writeback\": %s, \"ops\": %d, \"seed\": %llu,\n"
+    " \"results\": [\n",
+    path, write_through ? "false" : "true", nops, (unsigned long long)seed
+  );
+  for (int w = 0; w < NUM_WORKLOADS; w++) {
+    if (!selected(selection, workloads[w].name)) {
+      continue;
+    }
+    for (int s = 0; s < (workloads[w].sized ? nsizes : 1); s++) {
+      int io_size = workloads[w].sized ? sizes[s] : 0;
+      sfs_t* fs = sfs_mount(path, 1);
+
+      if (fs == NULL) {
+        fprintf(stderr, "%s: can't create %s\n", argv[0], path);
+        return 1;
+      }
+      if (write_through) {
+        sfs_set_writeback_r(fs, 0, 0);
+      }
+      nlatencies = 0;
+      timed_ns = 0;
+      bytes_moved = 0;
+      rng_state = seed;
+
+      int failed = workloads[w].run(fs, io_size, nops);
+      double seconds = timed_ns / 1e9;
+
+      sfs_unmount(fs);
+      print_result(workloads[w].name, io_size, seconds, failed, first);
+      first = false;
+      fflush(stdout);
+    }
+  }
+  printf("\n ]}\n");
+  unlink(path);
+  free(latencies);
+
+  return 0;
+}
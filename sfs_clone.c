@@ -0,0 +1,70 @@
+// sfs_clone: makes a file in a mounted sfs image a clone of another one, like
+// cp --reflink: dst shares src's data blocks instead of getting a copy, so it
+// takes no time and no space until one of them changes.
+//
+//   sfs_clone src dst
+//
+// Both have to be in the same sfs FUSE mount (any of the wrappers). dst is
+// created if it isn't there, and loses what it held if it is. This is the
+// SFS_IOC_CLONE ioctl on dst; programs can make it themselves.
+//
+// Exit status: 0 if dst is a clone, 1 if not.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s src dst\n", argv[0]);
+    return 1;
+  }
+  const char* src = argv[1];
+  const char* dst = argv[2];
+  const char* slash = strrchr(src, '/');
+  const char* src_name = slash != NULL ? slash + 1 : src; // the mount is flat
+  sfs_clone_ioctl arg;
+  struct stat src_st, dst_st;
+
+  if (stat(src, &src_st) != 0) {
+    fprintf(stderr, "%s: can't find %s\n", argv[0], src);
+    return 1;
+  }
+  if (strlen(src_name) >= sizeof(arg.src)) {
+    fprintf(stderr, "%s: %s: name too long for sfs\n", argv[0], src);
+    return 1;
+  }
+
+  int fd = open(dst, O_WRONLY | O_CREAT, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "%s: can't open %s: %s\n", argv[0], dst, strerror(errno));
+    return 1;
+  }
+  if (fstat(fd, &dst_st) != 0 || dst_st.st_dev != src_st.st_dev) {
+    fprintf(
+      stderr, "%s: %s and %s aren't in the same mount\n", argv[0], src, dst
+    );
+    close(fd);
+    return 1;
+  }
+
+  memset(&arg, 0, sizeof(arg));
+  strcpy(arg.src, src_name);
+  if (ioctl(fd, SFS_IOC_CLONE, &arg) != 0) {
+    fprintf(
+      stderr, "%s: can't clone %s to %s: %s\n", argv[0], src, dst,
+      strerror(errno)
+    );
+    close(fd);
+    return 1;
+  }
+  close(fd);
+
+  return 0;
+}
@@ -0,0 +1,132 @@
+#include "sfs_crc32c.h"
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_PATH
+#endif
+
+#define POLY 0x82F63B78u // reflected Castagnoli polynomial
+
+// Built once, by whichever thread checksums first (pthread_once also makes
+// them visible to every other thread), along with the CPU check.
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static uint32_t table[256];
+
+static void init_table() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (crc & 1 ? POLY : 0);
+    }
+    table[i] = crc;
+  }
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t len) {
+  while (len--) {
+    crc = (crc >> 8) ^ table[(crc ^ *p++) & 0xFF];
+  }
+
+  return crc;
+}
+
+#ifdef HAVE_SSE42_PATH
+// The crc32 instruction has a latency of 3 cycles but can start one every
+// cycle, so a single chain of them runs at a third of the possible speed. Long
+// buffers are done as three interleaved lanes of LANE bytes whose checksums are
+// stitched back together with shift_table (the effect of LANE zero bytes on a
+// checksum, which is linear, so it works a byte of the checksum at a time).
+#define LANE 336
+static uint32_t shift_table[4][256];
+static int has_sse42 = 0;
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw_serial(uint32_t crc, const unsigned char* p, size_t len) {
+#ifdef __x86_64__
+  uint64_t crc64 = crc;
+
+  for (; len >= 8; len -= 8, p += 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    crc64 = _mm_crc32_u64(crc64, v);
+  }
+  crc = (uint32_t)crc64;
+#endif
+  for (; len >= 4; len -= 4, p += 4) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    crc = _mm_crc32_u32(crc, v);
+  }
+  while (len--) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+
+  return crc;
+}
+
+static void init_shift_table() {
+  unsigned char zeros[LANE];
+
+  memset(zeros, 0, LANE);
+  for (int byte = 0; byte < 4; byte++) {
+    for (uint32_t b = 0; b < 256; b++) {
+      shift_table[byte][b] = crc32c_hw_serial(b << (8 * byte), zeros, LANE);
+    }
+  }
+}
+
+static uint32_t shift(uint32_t crc) {
+  return shift_table[0][crc & 0xFF] ^ shift_table[1][(crc >> 8) & 0xFF]
+    ^ shift_table[2][(crc >> 16) & 0xFF] ^ shift_table[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t len) {
+#ifdef __x86_64__
+  for (; len >= 3 * LANE; len -= 3 * LANE, p += 3 * LANE) {
+    uint64_t a = crc, b = 0, c = 0;
+
+    for (int i = 0; i < LANE; i += 8) {
+      uint64_t va, vb, vc;
+      memcpy(&va, p + i, 8);
+      memcpy(&vb, p + LANE + i, 8);
+      memcpy(&vc, p + 2 * LANE + i, 8);
+      a = _mm_crc32_u64(a, va);
+      b = _mm_crc32_u64(b, vb);
+      c = _mm_crc32_u64(c, vc);
+    }
+    crc = shift(shift((uint32_t)a) ^ (uint32_t)b) ^ (uint32_t)c;
+  }
+#endif
+
+  return crc32c_hw_serial(crc, p, len);
+}
+#endif
+
+static void init_tables() {
+  init_table();
+#ifdef HAVE_SSE42_PATH
+  __builtin_cpu_init();
+  has_sse42 = __builtin_cpu_supports("sse4.2") ? 1 : 0;
+  if (has_sse42) {
+    init_shift_table();
+  }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len) {
+  pthread_once(&tables_once, init_tables);
+
+  crc = ~crc;
+#ifdef HAVE_SSE42_PATH
+  if (has_sse42) {
+    return ~crc32c_hw(crc, buf, len);
+  }
+#endif
+
+  return ~crc32c_sw(crc, buf, len);
+}
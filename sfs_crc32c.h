@@ -0,0 +1,12 @@
+#ifndef SFS_CRC32C_H
+#define SFS_CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has it
+// and a lookup table otherwise; both give the same result.
+// Start with crc = 0, pass the previous result to continue a running checksum.
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+
+#endif
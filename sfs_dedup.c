@@ -0,0 +1,80 @@
+// sfs_dedup: finds data blocks in an sfs disk image that hold the same bytes
+// and makes the files share one copy of each, like clones do.
+//
+//   sfs_dedup [-n] [image]
+//
+//   -n  only report what would be merged, change nothing
+//
+// Reports the blocks merged and freed, the dedup ratio afterwards (pointers
+// to data blocks over the distinct blocks they point at) and the memory the
+// pass's hash index took. See sfs_dedup_r for how it finds the matches.
+//
+// Exit status: 0 if the pass ran, 2 if the image couldn't be opened.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+
+int main(int argc, char** argv) {
+  int flags = 0;
+  char* path = "fs.sfs";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n")) != -1) {
+    switch (opt) {
+      case 'n':
+        flags |= SFS_DEDUP_DRY_RUN;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n] [image]\n", argv[0]);
+        return 2;
+    }
+  }
+  if (optind < argc) {
+    path = argv[optind];
+  }
+
+  sfs_t* fs = sfs_mount(path, 0);
+  if (fs == NULL) {
+    fprintf(stderr, "%s: can't open %s\n", argv[0], path);
+    return 2;
+  }
+
+  struct timespec start, end;
+  sfs_dedup_report report;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  sfs_dedup_r(fs, flags, &report);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  sfs_unmount(fs);
+
+  double seconds = (end.tv_sec - start.tv_sec)
+    + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf(
+    "%s: %d files, %d blocks hashed, %d %s (%d freed) in %.3f s\n", path,
+    report.files, report.blocks, report.merged_blocks,
+    flags & SFS_DEDUP_DRY_RUN ? "could be merged" : "merged",
+    report.freed_blocks, seconds
+  );
+  printf(
+    "%s: %d block pointers to %d blocks, dedup ratio %.2f\n", path,
+    report.referenced_blocks, report.stored_blocks,
+    report.stored_blocks > 0
+      ? (double)report.referenced_blocks / report.stored_blocks : 1.0
+  );
+  printf(
+    "%s: index of %d entries, %lld KiB\n", path, report.index_entries,
+    report.index_bytes / 1024
+  );
+  if (report.skipped_blocks > 0 || report.unreadable_blocks > 0) {
+    printf(
+      "%s: %d blocks skipped (file busy), %d failed their checksum\n", path,
+      report.skipped_blocks, report.unreadable_blocks
+    );
+  }
+
+  return 0;
+}
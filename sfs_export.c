@@ -0,0 +1,237 @@
+// sfs_export: copies every file out of an sfs disk image, as a tar stream or
+// into a directory, in one sequential pass over the image.
+//
+//   sfs_export [-d dir] [-o tarfile] [-v] [image]
+//
+//   -d  write the files into dir (made if it isn't there) instead of a tar
+//       stream
+//   -o  write the tar stream to tarfile instead of standard output
+//   -v  print every file to standard error as it comes out
+//
+// Files come out in the order their data ends on disk (see sfs_export_r), not
+// by name. Names lose the leading '/' the FUSE wrappers give them, and any
+// other '/' becomes '_', so nothing lands outside the archive or dir. The
+// summary goes to standard error, since the tar stream may be on standard
+// output.
+//
+// Exit status: 0 if every file came out whole, 1 if some were damaged or
+// couldn't be written, 2 if the image couldn't be read or the tar stream
+// couldn't be written.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+
+#define TAR_BLOCK 512
+#define TAR_NAME_LEN 100
+
+typedef struct {
+  const char* prog;
+  const char* dir; // NULL for a tar stream
+  FILE* tar;
+  time_t mtime; // sfs keeps no times, every file gets the export's
+  bool verbose;
+  int failed; // files that couldn't be written
+} export_state;
+
+// the name a file gets outside the image
+static void host_name(const char* name, char* out, int len) {
+  if (name[0] == '/') {
+    name++;
+  }
+  bool special = name[0] == '\0' || strcmp(name, ".") == 0
+    || strcmp(name, "..") == 0;
+
+  snprintf(out, len, "%s%s", special ? "_" : "", name);
+  for (char* c = out; *c != '\0'; c++) {
+    if (*c == '/') {
+      *c = '_';
+    }
+  }
+}
+
+// TAR
+
+// a ustar header for a regular file
+static void tar_header(char* h, const char* name, int size, time_t mtime) {
+  unsigned int sum = 0;
+
+  memset(h, 0, TAR_BLOCK);
+  snprintf(h, TAR_NAME_LEN, "%s", name);
+  snprintf(h + 100, 8, "%07o", 0644);
+  snprintf(h + 108, 8, "%07o", 0); // uid
+  snprintf(h + 116, 8, "%07o", 0); // gid
+  snprintf(h + 124, 12, "%011o", size);
+  snprintf(h + 136, 12, "%011lo", (unsigned long)mtime);
+  h[156] = '0'; // regular file
+  memcpy(h + 257, "ustar", 6);
+  memcpy(h + 263, "00", 2);
+
+  // the checksum counts its own field as spaces
+  memset(h + 148, ' ', 8);
+  for (int i = 0; i < TAR_BLOCK; i++) {
+    sum += (unsigned char)h[i];
+  }
+  snprintf(h + 148, 7, "%06o", sum);
+}
+
+static void tar_file(
+  export_state* st, const char* name, const char* data, int len
+) {
+  char block[TAR_BLOCK];
+
+  tar_header(block, name, len, st->mtime);
+  fwrite(block, TAR_BLOCK, 1, st->tar);
+  fwrite(data, 1, len, st->tar);
+  if (len % TAR_BLOCK != 0) {
+    memset(block, 0, TAR_BLOCK);
+    fwrite(block, 1, TAR_BLOCK - len % TAR_BLOCK, st->tar);
+  }
+}
+
+// DIRECTORY
+
+static int dir_file(
+  export_state* st, const char* name, const char* data, int len
+) {
+  char path[4096];
+  int done = 0;
+
+  snprintf(path, sizeof(path), "%s/%s", st->dir, name);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  while (done < len) {
+    ssize_t n = write(fd, data + done, len - done);
+
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+
+  return close(fd) == 0 && done == len ? 0 : -1;
+}
+
+static void export_file(
+  void* arg, int nth_inode, const char* name, const char* data, int len,
+  int damaged
+) {
+  export_state* st = arg;
+  char out[TAR_NAME_LEN];
+
+  host_name(name, out, sizeof(out));
+  if (st->dir != NULL) {
+    if (dir_file(st, out, data, len) != 0) {
+      fprintf(
+        stderr, "%s: can't write %s/%s: %s\n", st->prog, st->dir, out,
+        strerror(errno)
+      );
+      st->failed++;
+      return;
+    }
+  } else {
+    tar_file(st, out, data, len);
+  }
+
+  if (damaged) {
+    fprintf(
+      stderr, "%s: %s is damaged, some blocks failed their checksum\n",
+      st->prog, out
+    );
+  }
+  if (st->verbose) {
+    fprintf(stderr, "%s (i-node %d, %d bytes)\n", out, nth_inode, len);
+  }
+}
+
+int main(int argc, char** argv) {
+  export_state st = {argv[0], NULL, stdout, time(NULL), false, 0};
+  char* tar_path = NULL;
+  char* image = "fs.sfs";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:o:v")) != -1) {
+    switch (opt) {
+      case 'd':
+        st.dir = optarg;
+        break;
+      case 'o':
+        tar_path = optarg;
+        break;
+      case 'v':
+        st.verbose = true;
+        break;
+      default:
+        fprintf(
+          stderr, "usage: %s [-d dir] [-o tarfile] [-v] [image]\n", argv[0]
+        );
+        return 2;
+    }
+  }
+  if (optind < argc) {
+    image = argv[optind];
+  }
+
+  if (st.dir != NULL) {
+    if (mkdir(st.dir, 0755) != 0 && errno != EEXIST) {
+      fprintf(stderr, "%s: can't make %s\n", argv[0], st.dir);
+      return 2;
+    }
+  } else if (tar_path != NULL) {
+    st.tar = fopen(tar_path, "wb");
+    if (st.tar == NULL) {
+      fprintf(stderr, "%s: can't create %s\n", argv[0], tar_path);
+      return 2;
+    }
+  }
+
+  sfs_t* fs = sfs_mount(image, 0);
+  if (fs == NULL) {
+    fprintf(stderr, "%s: can't open %s\n", argv[0], image);
+    return 2;
+  }
+
+  struct timespec start, end;
+  sfs_export_report report;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  sfs_export_r(fs, export_file, &st, &report);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  sfs_unmount(fs);
+
+  if (st.dir == NULL) {
+    // the end of the archive is two zero blocks
+    char zeros[2 * TAR_BLOCK] = {0};
+
+    fwrite(zeros, sizeof(zeros), 1, st.tar);
+    if (fflush(st.tar) != 0 || ferror(st.tar)) {
+      fprintf(stderr, "%s: can't write the tar stream\n", argv[0]);
+      return 2;
+    }
+    if (tar_path != NULL) {
+      fclose(st.tar);
+    }
+  }
+
+  double seconds = (end.tv_sec - start.tv_sec)
+    + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(
+    stderr,
+    "%s: %d files, %lld bytes, %d blocks in %d reads, %.3f s (%.1f MB/s), "
+    "%d damaged\n", image, report.files, report.bytes, report.blocks,
+    report.reads, seconds, report.bytes / seconds / (1024 * 1024),
+    report.damaged_files
+  );
+
+  return report.damaged_files > 0 || st.failed > 0;
+}
@@ -0,0 +1,108 @@
+// sfs_frag: reports how fragmented an sfs disk image is, and can defragment
+// it.
+//
+//   sfs_frag [-v] [-d] [image]
+//
+//   -v  one line per file: i-node, extents, blocks, size and name
+//   -d  move every fragmented file's blocks into one run, then report again
+//
+// Files are only as fragmented as their extents say (runs of blocks that
+// follow each other on disk, in file order). Free space is reported as its
+// runs, with a histogram of their lengths: a long file can only be written
+// in one run if there is a free one that long.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+
+#define MAX_FILES 256 // more than sfs can hold
+
+static void print_report(
+  const char* path, const sfs_frag_report* report, const sfs_frag_file* files,
+  int nfiles, int verbose
+) {
+  if (verbose) {
+    printf("%6s %8s %7s %9s  %s\n", "inode", "extents", "blocks", "size", "name");
+    for (int i = 0; i < nfiles; i++) {
+      printf(
+        "%6d %8d %7d %9u  %s\n", files[i].inode, files[i].extents,
+        files[i].blocks, files[i].size, files[i].name
+      );
+    }
+  }
+
+  printf(
+    "%s: %d files, %d fragmented, %d blocks in %d extents (%.2f per file)\n",
+    path, report->files, report->fragmented_files, report->blocks,
+    report->extents,
+    report->files > 0 ? (double)report->extents / report->files : 0
+  );
+  printf(
+    "%s: %d free blocks in %d runs, largest %d\n", path, report->free_blocks,
+    report->free_extents, report->largest_free_extent
+  );
+  for (int b = 0; b < SFS_FRAG_BUCKETS; b++) {
+    if (report->free_hist[b] == 0) {
+      continue;
+    }
+    if (b == SFS_FRAG_BUCKETS - 1) {
+      printf("  free runs of %d+ blocks: %d\n", 1 << b, report->free_hist[b]);
+    } else {
+      printf(
+        "  free runs of %d-%d blocks: %d\n", 1 << b, (1 << (b + 1)) - 1,
+        report->free_hist[b]
+      );
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  int verbose = 0;
+  int defrag = 0;
+  char* path = "fs.sfs";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "vd")) != -1) {
+    switch (opt) {
+      case 'v':
+        verbose = 1;
+        break;
+      case 'd':
+        defrag = 1;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-v] [-d] [image]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (optind < argc) {
+    path = argv[optind];
+  }
+
+  sfs_t* fs = sfs_mount(path, 0);
+  if (fs == NULL) {
+    return 1;
+  }
+
+  sfs_frag_report report;
+  sfs_frag_file files[MAX_FILES];
+  int nfiles = sfs_frag_r(fs, &report, files, MAX_FILES);
+
+  print_report(path, &report, files, nfiles, verbose);
+  if (defrag) {
+    int fragmented = report.fragmented_files;
+    int defragged = sfs_defrag_r(fs);
+
+    printf(
+      "%s: defragmented %d of %d fragmented files\n", path, defragged,
+      fragmented
+    );
+    nfiles = sfs_frag_r(fs, &report, files, MAX_FILES);
+    print_report(path, &report, files, nfiles, verbose);
+  }
+  sfs_unmount(fs);
+
+  return 0;
+}
@@ -0,0 +1,83 @@
+// sfs_fsck: checks (and optionally repairs) an sfs disk image.
+//
+//   sfs_fsck [-y] [-c] [-j threads] [image]
+//
+//   -y  repair what can be repaired (the default only reports)
+//   -c  also read every data block in use and check its checksum (the
+//       tables' are always checked)
+//   -j  number of threads, one per CPU by default
+//
+// Exit status follows e2fsck: 0 clean, 1 problems fixed, 4 problems left,
+// 8 couldn't check the image.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+
+int main(int argc, char** argv) {
+  int flags = 0;
+  int nthreads = 0;
+  char* path = "fs.sfs";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "ycj:")) != -1) {
+    switch (opt) {
+      case 'y':
+        flags |= SFS_FSCK_REPAIR;
+        break;
+      case 'c':
+        flags |= SFS_FSCK_VERIFY_DATA;
+        break;
+      case 'j':
+        nthreads = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-y] [-c] [-j threads] [image]\n", argv[0]);
+        return 8;
+    }
+  }
+  if (optind < argc) {
+    path = argv[optind];
+  }
+
+  // damaged tables are what it's for
+  sfs_t* fs = sfs_mount_damaged(path);
+  if (fs == NULL) {
+    return 8;
+  }
+
+  struct timespec start, end;
+  sfs_fsck_report report;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int problems = sfs_fsck_r(fs, flags, nthreads, &report);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  sfs_unmount(fs);
+
+  if (problems < 0) {
+    return 8;
+  }
+
+  printf(
+    "%s: %d files, %d data blocks in use (%d shared), checked in "
+    "%.3f s\n", path, report.files, report.blocks_used, report.shared_blocks,
+    (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9
+  );
+  if (problems == 0) {
+    printf("%s: clean\n", path);
+
+    return 0;
+  }
+  printf(
+    "%s: %d problems (%d i-node, %d pointer, %d shared, %d leaked, "
+    "%d missing, %d checksum), %d fixed\n",
+    path, problems, report.bad_inodes, report.bad_pointers, report.dup_blocks,
+    report.leaked_blocks, report.missing_blocks, report.checksum_errors,
+    report.repaired
+  );
+
+  return report.repaired >= problems ? 1 : 4;
+}
@@ -0,0 +1,200 @@
+#include "sfs_lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+// the format wants the last 5 bytes to be literals and the last match to start
+// at least 12 bytes before the end
+#define LAST_LITERALS 5
+#define MATCH_LIMIT 12
+
+static uint32_t read32(const char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t hash32(uint32_t v) {
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// writes a 4 bit length field's overflow (255, 255, ..., rest), returns the
+// new output position or -1 if out of room
+static int put_length(char* dst, int op, int dst_cap, int len) {
+  for (len -= 15; len >= 255; len -= 255) {
+    if (op >= dst_cap) {
+      return -1;
+    }
+    dst[op++] = (char)255;
+  }
+  if (op >= dst_cap) {
+    return -1;
+  }
+  dst[op++] = (char)len;
+
+  return op;
+}
+
+// emits one sequence: literals src[anchor, anchor + lit_len) followed by a
+// match (skipped if match_len is 0, which only the last sequence does)
+static int put_sequence(
+  const char* src, int anchor, int lit_len, int offset, int match_len,
+  char* dst, int op, int dst_cap
+) {
+  int lit_nibble = lit_len < 15 ? lit_len : 15;
+  int match_nibble = 0;
+
+  if (match_len > 0) {
+    match_nibble = match_len - MIN_MATCH < 15 ? match_len - MIN_MATCH : 15;
+  }
+
+  if (op >= dst_cap) {
+    return -1;
+  }
+  dst[op++] = (char)((lit_nibble << 4) | match_nibble);
+
+  if (lit_nibble == 15 && (op = put_length(dst, op, dst_cap, lit_len)) < 0) {
+    return -1;
+  }
+  if (op + lit_len > dst_cap) {
+    return -1;
+  }
+  memcpy(dst + op, src + anchor, lit_len);
+  op += lit_len;
+
+  if (match_len == 0) {
+    return op;
+  }
+
+  if (op + 2 > dst_cap) {
+    return -1;
+  }
+  dst[op++] = (char)(offset & 0xFF);
+  dst[op++] = (char)(offset >> 8);
+
+  if (match_nibble == 15) {
+    op = put_length(dst, op, dst_cap, match_len - MIN_MATCH);
+  }
+
+  return op;
+}
+
+int lz_compress(const char* src, int src_len, char* dst, int dst_cap) {
+  int table[1 << HASH_BITS]; // last position each hash was seen at
+  int ip = 0;
+  int anchor = 0;
+  int op = 0;
+
+  for (int i = 0; i < (1 << HASH_BITS); i++) {
+    table[i] = -1;
+  }
+
+  while (ip < src_len - MATCH_LIMIT) {
+    uint32_t seq = read32(src + ip);
+    uint32_t h = hash32(seq);
+    int ref = table[h];
+
+    table[h] = ip;
+    if (ref < 0 || ip - ref > MAX_OFFSET || read32(src + ref) != seq) {
+      ip++;
+      continue;
+    }
+
+    // FOUND A MATCH, EXTEND IT
+    int match_len = MIN_MATCH;
+    while (
+      ip + match_len < src_len - LAST_LITERALS
+      && src[ref + match_len] == src[ip + match_len]
+    ) {
+      match_len++;
+    }
+
+    op = put_sequence(
+      src, anchor, ip - anchor, ip - ref, match_len, dst, op, dst_cap
+    );
+    if (op < 0) {
+      return 0;
+    }
+
+    ip += match_len;
+    anchor = ip;
+  }
+
+  // LAST LITERALS
+  op = put_sequence(src, anchor, src_len - anchor, 0, 0, dst, op, dst_cap);
+  if (op < 0) {
+    return 0;
+  }
+
+  return op;
+}
+
+// reads a length field's overflow bytes, -1 if src runs out
+static int get_length(const char* src, int* ip, int src_len, int len) {
+  unsigned char b;
+
+  do {
+    if (*ip >= src_len) {
+      return -1;
+    }
+    b = (unsigned char)src[(*ip)++];
+    len += b;
+  } while (b == 255);
+
+  return len;
+}
+
+int lz_decompress(const char* src, int src_len, char* dst, int dst_cap) {
+  int ip = 0;
+  int op = 0;
+
+  while (ip < src_len) {
+    unsigned char token = (unsigned char)src[ip++];
+
+    // LITERALS
+    int lit_len = token >> 4;
+    if (lit_len == 15 && (lit_len = get_length(src, &ip, src_len, 15)) < 0) {
+      return -1;
+    }
+    if (ip + lit_len > src_len || op + lit_len > dst_cap) {
+      return -1;
+    }
+    memcpy(dst + op, src + ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+
+    if (ip == src_len) {
+      // the last sequence has no match
+      break;
+    }
+
+    // MATCH
+    if (ip + 2 > src_len) {
+      return -1;
+    }
+    int offset = (unsigned char)src[ip] | ((unsigned char)src[ip + 1] << 8);
+    ip += 2;
+
+    int match_len = token & 0x0F;
+    if (
+      match_len == 15
+      && (match_len = get_length(src, &ip, src_len, 15)) < 0
+    ) {
+      return -1;
+    }
+    match_len += MIN_MATCH;
+
+    if (offset == 0 || offset > op || op + match_len > dst_cap) {
+      return -1;
+    }
+    // byte by byte, matches are allowed to overlap what they produce
+    for (int i = 0; i < match_len; i++) {
+      dst[op + i] = dst[op - offset + i];
+    }
+    op += match_len;
+  }
+
+  return op;
+}
@@ -0,0 +1,16 @@
+#ifndef SFS_LZ_H
+#define SFS_LZ_H
+
+// Small LZ77 codec using the LZ4 block format (token, literals, 2 byte offset,
+// match length). Meant for a few KB at a time, not for streams.
+
+// worst case size of lz_compress's output for n input bytes
+#define LZ_COMPRESS_BOUND(n) ((n) + (n) / 255 + 16)
+
+// returns the compressed length, or 0 if it doesn't fit in dst_cap bytes
+int lz_compress(const char* src, int src_len, char* dst, int dst_cap);
+
+// returns the decompressed length, or -1 if src is malformed or doesn't fit
+int lz_decompress(const char* src, int src_len, char* dst, int dst_cap);
+
+#endif
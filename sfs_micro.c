@@ -0,0 +1,371 @@
+// sfs_micro: times sfs' inner loops on their own, away from the disk, and
+// prints the results as JSON. `make micro` builds and runs it.
+//
+//   sfs_micro [-k kernels]
+//
+//   -k  comma-separated kernels (all of them by default):
+//         alloc_scan   group_alloc_run, first fit in one allocation group,
+//                      swept over fill level, layout and run length
+//         name_lookup  find_file, swept over files in the directory, for the
+//                      newest file and for a name that isn't there
+//         block_map    get_block_ptr over a whole file, and alloc_goal for the
+//                      last block swept over how many earlier blocks are mapped
+//         wb_copy      write_data_blocks/read_data_blocks on blocks already in
+//                      the writeback buffer, swept over how many blocks it holds
+//
+// Every measurement runs its kernel a few thousand times to warm up, picks a
+// batch size that takes about 100 us, then times SAMPLES batches and reports
+// the fastest and the median per call, in TSC ticks on x86 (ns elsewhere) and
+// in ns. sfs_api.c is compiled into this file, so the kernels are the real
+// ones, built with the same flags as everything else.
+
+#include "sfs_api.c"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#define WARMUP_CALLS 2000
+#define SAMPLES 15
+#define BATCH_NS 100000
+
+// what a kernel returns is summed here, so no call can be optimized out
+static volatile uint64_t sink;
+
+static uint64_t ticks() {
+#if HAVE_TSC
+  _mm_lfence();
+  return __rdtsc();
+#else
+  return now_ns();
+#endif
+}
+
+static int cmp_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+
+  return x < y ? -1 : x > y;
+}
+
+// MEASURING
+
+typedef uint64_t (*kernel_fn)(sfs_t* fs, void* arg);
+
+static bool first_result = true;
+
+static void measure(
+  const char* kernel, const char* variant, const char* sweep, int value,
+  kernel_fn fn, sfs_t* fs, void* arg
+) {
+  uint64_t sum = 0;
+  uint64_t tick_samples[SAMPLES], ns_samples[SAMPLES];
+  int batch = 1;
+
+  for (int i = 0; i < WARMUP_CALLS; i++) {
+    sum += fn(fs, arg);
+  }
+  for (;;) {
+    uint64_t start = now_ns();
+
+    for (int i = 0; i < batch; i++) {
+      sum += fn(fs, arg);
+    }
+    if (now_ns() - start >= BATCH_NS || batch >= 1 << 24) {
+      break;
+    }
+    batch *= 2;
+  }
+
+  for (int s = 0; s < SAMPLES; s++) {
+    uint64_t start_ns = now_ns();
+    uint64_t start_ticks = ticks();
+
+    for (int i = 0; i < batch; i++) {
+      sum += fn(fs, arg);
+    }
+    tick_samples[s] = ticks() - start_ticks;
+    ns_samples[s] = now_ns() - start_ns;
+  }
+  sink += sum;
+
+  qsort(tick_samples, SAMPLES, sizeof(uint64_t), cmp_u64);
+  qsort(ns_samples, SAMPLES, sizeof(uint64_t), cmp_u64);
+  printf(
+    "%s    {\"kernel\": \"%s\", \"variant\": \"%s\", \"%s\": %d, "
+    "\"batch\": %d, \"ticks_per_call\": {\"min\": %.1f, \"median\": %.1f}, "
+    "\"ns_per_call\": {\"min\": %.2f, \"median\": %.2f}}",
+    first_result ? "" : ",\n", kernel, variant, sweep, value, batch,
+    (double)tick_samples[0] / batch, (double)tick_samples[SAMPLES / 2] / batch,
+    (double)ns_samples[0] / batch, (double)ns_samples[SAMPLES / 2] / batch
+  );
+  first_result = false;
+  fflush(stdout);
+}
+
+// ALLOCATOR
+// Group 0's bitmap is set to a fill level, then every call takes a run and
+// gives it straight back, so the bitmap looks the same for every call.
+
+static uint64_t rng_state = 1;
+
+static uint64_t next_random() {
+  // xorshift64*
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+
+  return rng_state * 0x2545F4914F6CDD1Dull;
+}
+
+static void set_group_fill(sfs_t* fs, int fill_pct, bool random_layout) {
+  int end = group_end(0);
+
+  for (int i = 0; i < end; i++) {
+    bool used = random_layout
+      ? (int)(next_random() % 100) < fill_pct
+      : i < (int64_t)end * fill_pct / 100;
+    uint64_t bit = (uint64_t)1 << (63 - i % 64);
+
+    if (used) {
+      fs->free_block_list[i / 64] |= bit;
+    } else {
+      fs->free_block_list[i / 64] &= ~bit;
+    }
+  }
+  count_free_blocks(fs);
+}
+
+static uint64_t alloc_scan(sfs_t* fs, void* arg) {
+  int n = *(int*)arg;
+  int start = group_alloc_run(fs, 0, -1, n);
+
+  if (start != -1) {
+    for (int i = start; i < start + n; i++) {
+      fs->free_block_list[i / 64] &= ~((uint64_t)1 << (63 - i % 64));
+    }
+    __atomic_fetch_add(&fs->group_free[0], n, __ATOMIC_RELAXED);
+  }
+
+  return start;
+}
+
+static void bench_alloc_scan(sfs_t* fs) {
+  static const int fills[] = {0, 50, 90, 99, 100};
+  static const int runs[] = {1, 8};
+
+  for (int layout = 0; layout < 2; layout++) {
+    for (int r = 0; r < 2; r++) {
+      for (int f = 0; f < 5; f++) {
+        char variant[32];
+        int n = runs[r];
+
+        sprintf(variant, "%s_run%d", layout ? "random" : "packed", n);
+        rng_state = 1;
+        set_group_fill(fs, fills[f], layout);
+        measure(
+          "alloc_scan", variant, "fill_pct", fills[f], alloc_scan, fs, &n
+        );
+      }
+    }
+  }
+  set_group_fill(fs, 0, false);
+}
+
+// NAME LOOKUP
+// Names look like the FUSE wrappers', with a leading '/' and a long shared
+// prefix, so strcmp has to go past the first few bytes.
+
+static void bench_name(char* name, int n) {
+  sprintf(name, "/microbench_%d", n);
+}
+
+static uint64_t name_lookup(sfs_t* fs, void* arg) {
+  return find_file(fs, arg);
+}
+
+static void bench_name_lookup(sfs_t* fs) {
+  static const int sizes[] = {1, 8, 32, 64, 128, NUM_INODES - 1};
+  char newest[MAXFILENAME + 1], missing[MAXFILENAME + 1];
+  int files = 0;
+
+  bench_name(missing, NUM_INODES);
+  for (int s = 0; s < 6; s++) {
+    while (files < sizes[s]) {
+      bench_name(newest, files++);
+      sfs_create_r(fs, newest);
+    }
+    measure(
+      "name_lookup", "hit_newest", "files", files, name_lookup, fs, newest
+    );
+    measure("name_lookup", "miss", "files", files, name_lookup, fs, missing);
+  }
+  for (int i = 0; i < files; i++) {
+    bench_name(newest, i);
+    sfs_remove_r(fs, newest);
+  }
+}
+
+// BLOCK MAPPING
+
+static uint64_t map_whole_file(sfs_t* fs, void* arg) {
+  uint64_t sum = 0;
+
+  for (int i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+    sum += *get_block_ptr(arg, i);
+  }
+
+  return sum;
+}
+
+static uint64_t goal_last_block(sfs_t* fs, void* arg) {
+  return alloc_goal(arg, MAX_BLOCKS_PER_FILE - 1);
+}
+
+static void bench_block_map(sfs_t* fs) {
+  static const int fills[] = {100, 50, 10, 0};
+  inode file_inode;
+
+  for (int f = 0; f < 4; f++) {
+    memset(&file_inode, 0, sizeof(inode));
+    rng_state = 1;
+    for (int i = 0; i < MAX_BLOCKS_PER_FILE - 1; i++) {
+      if ((int)(next_random() % 100) < fills[f]) {
+        *get_block_ptr(&file_inode, i) = DATA_BLOCKS_ADDR + i;
+      }
+    }
+    // one call maps every block of the file
+    measure(
+      "block_map", "get_block_ptr_file", "mapped_pct", fills[f],
+      map_whole_file, fs, &file_inode
+    );
+    measure(
+      "block_map", "alloc_goal_last", "mapped_pct", fills[f], goal_last_block,
+      fs, &file_inode
+    );
+  }
+}
+
+// WRITEBACK COPIES
+// The buffer holds `blocks` dirty blocks, and every call copies one of them
+// in or out, walking the addresses so hash chains of every length are hit.
+
+typedef struct {
+  int blocks;
+  int next;
+  char buf[BLOCK_SIZE];
+} wb_arg;
+
+static uint64_t wb_write(sfs_t* fs, void* arg) {
+  wb_arg* a = arg;
+
+  write_data_blocks(fs, DATA_BLOCKS_ADDR + a->next, 1, a->buf);
+  a->next = (a->next + 1) % a->blocks;
+
+  return a->next;
+}
+
+static uint64_t wb_read(sfs_t* fs, void* arg) {
+  wb_arg* a = arg;
+
+  read_data_blocks(fs, DATA_BLOCKS_ADDR + a->next, 1, a->buf);
+  a->next = (a->next + 1) % a->blocks;
+
+  return a->buf[0];
+}
+
+static void bench_wb_copy(sfs_t* fs) {
+  static const int sizes[] = {256, 4096, 32768};
+  wb_arg* a = calloc(1, sizeof(wb_arg));
+
+  for (int s = 0; s < 3; s++) {
+    a->blocks = sizes[s];
+    a->next = 0;
+    memset(a->buf, 'm', BLOCK_SIZE);
+    for (int i = 0; i < a->blocks; i++) {
+      write_data_blocks(fs, DATA_BLOCKS_ADDR + i, 1, a->buf);
+    }
+    measure("wb_copy", "write", "dirty_blocks", a->blocks, wb_write, fs, a);
+    measure("wb_copy", "read", "dirty_blocks", a->blocks, wb_read, fs, a);
+    for (int i = 0; i < a->blocks; i++) {
+      wb_forget(fs, DATA_BLOCKS_ADDR + i);
+    }
+  }
+  free(a);
+}
+
+// RUNNING
+
+typedef struct {
+  const char* name;
+  void (*run)(sfs_t* fs);
+} kernel;
+
+static const kernel kernels[] = {
+  {"alloc_scan", bench_alloc_scan},
+  {"name_lookup", bench_name_lookup},
+  {"block_map", bench_block_map},
+  {"wb_copy", bench_wb_copy},
+};
+
+#define NUM_KERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+static bool selected(const char* list, const char* name) {
+  if (list == NULL) {
+    return true;
+  }
+
+  size_t len = strlen(name);
+  for (const char* p = list; (p = strstr(p, name)) != NULL; p += len) {
+    if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0')) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+int main(int argc, char** argv) {
+  const char* selection = NULL;
+  char* path = "sfs_micro.sfs";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "k:")) != -1) {
+    switch (opt) {
+      case 'k':
+        selection = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-k kernels]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  sfs_t* fs = sfs_mount(path, 1);
+  if (fs == NULL) {
+    fprintf(stderr, "%s: can't create %s\n", argv[0], path);
+    return 1;
+  }
+  // nothing gets written back while the kernels run: the buffer can hold
+  // every data block and nothing comes of age for an hour
+  sfs_set_writeback_r(fs, 2 * MAX_BLOCKS_ALL_FILES, 3600 * 1000);
+
+  printf(
+    "{\"clock\": \"%s\", \"samples\": %d, \"results\": [\n",
+    HAVE_TSC ? "tsc" : "ns", SAMPLES
+  );
+  for (int k = 0; k < NUM_KERNELS; k++) {
+    if (selected(selection, kernels[k].name)) {
+      kernels[k].run(fs);
+    }
+  }
+  printf("\n ]}\n");
+
+  sfs_unmount(fs);
+  unlink(path);
+
+  return 0;
+}
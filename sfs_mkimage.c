@@ -0,0 +1,176 @@
+// sfs_mkimage: builds an sfs disk image from the files in a host directory,
+// without mounting it.
+//
+//   sfs_mkimage [-n] [-v] dir [image]
+//
+//   -n  store names as they are, instead of with the leading '/' the FUSE
+//       wrappers give them (for programs that use the sfs API directly)
+//   -v  print every file as it's added
+//
+// The image (fs.sfs by default) is created afresh. sfs has a single
+// directory, so only the regular files right in dir are added, in name order
+// so the same tree always gives the same image. Anything else, and files
+// that are too large or whose names are too long, are skipped with a warning.
+//
+// Exit status: 0 if every file was added, 1 if some were skipped, 2 if the
+// image couldn't be built.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+
+#define MAX_FILE_BYTES (BLOCK_SIZE * (12 + NUM_INDIRECT_PTR_ENTRIES))
+
+static int cmp_names(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// reads a whole file of size bytes into buf, -1 if that fails
+static int read_file(const char* path, char* buf, int size) {
+  int fd = open(path, O_RDONLY);
+  int done = 0;
+
+  if (fd < 0) {
+    return -1;
+  }
+  while (done < size) {
+    ssize_t n = read(fd, buf + done, size - done);
+
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  close(fd);
+
+  return done == size ? 0 : -1;
+}
+
+int main(int argc, char** argv) {
+  int raw_names = 0;
+  int verbose = 0;
+  char* image = "fs.sfs";
+  int opt;
+
+  while ((opt = getopt(argc, argv, "nv")) != -1) {
+    switch (opt) {
+      case 'n':
+        raw_names = 1;
+        break;
+      case 'v':
+        verbose = 1;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n] [-v] dir [image]\n", argv[0]);
+        return 2;
+    }
+  }
+  if (optind >= argc || argc - optind > 2) {
+    fprintf(stderr, "usage: %s [-n] [-v] dir [image]\n", argv[0]);
+    return 2;
+  }
+  const char* dir_path = argv[optind];
+  if (optind + 1 < argc) {
+    image = argv[optind + 1];
+  }
+
+  // LIST
+  DIR* dir = opendir(dir_path);
+  char** names = NULL;
+  int nnames = 0;
+  struct dirent* entry;
+
+  if (dir == NULL) {
+    fprintf(stderr, "%s: can't open %s\n", argv[0], dir_path);
+    return 2;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+      names = realloc(names, sizeof(char*) * (nnames + 1));
+      names[nnames++] = strdup(entry->d_name);
+    }
+  }
+  closedir(dir);
+  qsort(names, nnames, sizeof(char*), cmp_names);
+
+  // BUILD
+  struct timespec start, end;
+  sfs_builder* b;
+  char* data = malloc(MAX_FILE_BYTES);
+  int added = 0, skipped = 0;
+  long long bytes = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  b = sfs_build_start(image);
+  if (b == NULL) {
+    return 2;
+  }
+  for (int i = 0; i < nnames; i++) {
+    char path[4096], name[MAXFILENAME + 2];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s/%s", dir_path, names[i]);
+    if (lstat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+      fprintf(stderr, "%s: skipping %s, not a regular file\n", argv[0], path);
+      skipped++;
+      continue;
+    }
+    if (st.st_size > MAX_FILE_BYTES) {
+      fprintf(
+        stderr, "%s: skipping %s, larger than an sfs file can be (%d bytes)\n",
+        argv[0], path, (int)MAX_FILE_BYTES
+      );
+      skipped++;
+      continue;
+    }
+    if (strlen(names[i]) + !raw_names > MAXFILENAME) {
+      fprintf(stderr, "%s: skipping %s, name too long\n", argv[0], path);
+      skipped++;
+      continue;
+    }
+    if (read_file(path, data, st.st_size) != 0) {
+      fprintf(stderr, "%s: skipping %s, can't read it\n", argv[0], path);
+      skipped++;
+      continue;
+    }
+
+    snprintf(name, sizeof(name), "%s%s", raw_names ? "" : "/", names[i]);
+    if (sfs_build_add(b, name, data, st.st_size) == -1) {
+      fprintf(
+        stderr, "%s: skipping %s, the image is out of i-nodes or space\n",
+        argv[0], path
+      );
+      skipped++;
+      continue;
+    }
+    if (verbose) {
+      printf("%s (%lld bytes)\n", name, (long long)st.st_size);
+    }
+    added++;
+    bytes += st.st_size;
+  }
+  sfs_build_finish(b);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double seconds = (end.tv_sec - start.tv_sec)
+    + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf(
+    "%s: %d files, %lld bytes in %.3f s (%.1f MB/s), %d skipped\n", image,
+    added, bytes, seconds, bytes / seconds / (1024 * 1024), skipped
+  );
+
+  for (int i = 0; i < nnames; i++) {
+    free(names[i]);
+  }
+  free(names);
+  free(data);
+
+  return skipped > 0;
+}
@@ -0,0 +1,329 @@
+// sfs_replay: plays a block I/O trace back against a disk and prints how it
+// went as JSON, so I/O layer changes can be compared on recorded workloads.
+// Traces come from sfs_start_trace_r or from mounting with SFS_TRACE set.
+//
+//   sfs_replay [-f] [-x factor] [-b backend] [-o target] [-k] trace
+//
+//   -f  as fast as possible, instead of at the pace the calls were recorded
+//   -x  pace factor, 2 replays twice as fast as recorded (1 by default)
+//   -b  what the calls go to:
+//         disk  a disk_emu image, with its checksums (the default)
+//         raw   pread/pwrite on a plain file or block device
+//   -o  target (sfs_replay.sfs by default). A disk image is created fresh,
+//       with the trace's geometry, and removed at the end.
+//   -k  replay on the existing disk image at the target instead
+//
+// Calls are made one after the other, from one thread, with what was written
+// replaced by a fixed pattern. At the recorded pace a call that's due while
+// the one before it still runs goes right after it, and how far behind the
+// trace the replay fell is reported as lag.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk_emu.h"
+
+#define HISTOGRAM_BUCKETS 48
+
+typedef struct {
+  uint64_t calls, blocks;
+  uint64_t meta_calls, data_calls;
+  uint64_t* latencies;
+  uint64_t nlatencies, cap;
+  uint64_t total_ns;
+} op_result;
+
+static disk_t* disk; // the disk backend
+static int raw_fd = -1; // the raw backend
+static uint32_t block_size;
+
+static uint64_t now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline) {
+  struct timespec ts;
+
+  ts.tv_sec = deadline / 1000000000;
+  ts.tv_nsec = deadline % 1000000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+  }
+}
+
+static int issue(const disk_trace_record* rec, char* buf) {
+  size_t len = (size_t)rec->nblocks * block_size;
+  off_t off = (off_t)rec->address * block_size;
+
+  if (disk != NULL) {
+    return rec->op == DISK_TRACE_WRITE
+      ? write_blocks_r(disk, rec->address, rec->nblocks, buf)
+      : read_blocks_r(disk, rec->address, rec->nblocks, buf);
+  }
+
+  ssize_t n = rec->op == DISK_TRACE_WRITE ? pwrite(raw_fd, buf, len, off)
+                                          : pread(raw_fd, buf, len, off);
+
+  return n < 0 ? -1 : 0;
+}
+
+static void record(op_result* r, const disk_trace_record* rec, uint64_t ns) {
+  if (r->nlatencies == r->cap) {
+    r->cap = r->cap == 0 ? 4096 : r->cap * 2;
+    r->latencies = realloc(r->latencies, sizeof(uint64_t) * r->cap);
+  }
+  r->latencies[r->nlatencies++] = ns;
+  r->total_ns += ns;
+  r->calls++;
+  r->blocks += rec->nblocks;
+  if (rec->kind == DISK_TRACE_DATA) {
+    r->data_calls++;
+  } else {
+    r->meta_calls++;
+  }
+}
+
+// REPORTING
+
+static int cmp_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const op_result* r, double p) {
+  uint64_t i = (uint64_t)(p * r->nlatencies);
+
+  return r->latencies[i < r->nlatencies ? i : r->nlatencies - 1];
+}
+
+static void print_op(const char* name, op_result* r, double seconds, bool last) {
+  int histogram[HISTOGRAM_BUCKETS] = {0};
+  bool first_bucket = true;
+
+  printf(
+    "  \"%s\": {\"calls\": %llu, \"blocks\": %llu, \"meta_calls\": %llu, "
+    "\"data_calls\": %llu, \"calls_per_sec\": %.1f, \"mb_per_sec\": %.2f,\n",
+    name, (unsigned long long)r->calls, (unsigned long long)r->blocks,
+    (unsigned long long)r->meta_calls, (unsigned long long)r->data_calls,
+    seconds > 0 ? r->calls / seconds : 0,
+    seconds > 0 ? r->blocks * block_size / seconds / (1024 * 1024) : 0
+  );
+  if (r->nlatencies == 0) {
+    printf("   \"latency_ns\": null, \"histogram\": []}%s\n", last ? "" : ",");
+
+    return;
+  }
+
+  qsort(r->latencies, r->nlatencies, sizeof(uint64_t), cmp_u64);
+  for (uint64_t i = 0; i < r->nlatencies; i++) {
+    int bucket = 0;
+
+    while (bucket < HISTOGRAM_BUCKETS - 1 && r->latencies[i] >> bucket > 1) {
+      bucket++;
+    }
+    histogram[bucket]++;
+  }
+  printf(
+    "   \"latency_ns\": {\"min\": %llu, \"mean\": %llu, \"p50\": %llu, "
+    "\"p99\": %llu, \"p999\": %llu, \"max\": %llu},\n",
+    (unsigned long long)r->latencies[0],
+    (unsigned long long)(r->total_ns / r->nlatencies),
+    (unsigned long long)percentile(r, 0.50),
+    (unsigned long long)percentile(r, 0.99),
+    (unsigned long long)percentile(r, 0.999),
+    (unsigned long long)r->latencies[r->nlatencies - 1]
+  );
+  // bucket b counts latencies up to 2^(b+1) ns
+  printf("   \"histogram\": [");
+  for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+    if (histogram[b] > 0) {
+      printf(
+        "%s{\"le_ns\": %llu, \"count\": %d}", first_bucket ? "" : ", ",
+        1ull << (b + 1), histogram[b]
+      );
+      first_bucket = false;
+    }
+  }
+  printf("]}%s\n", last ? "" : ",");
+}
+
+// RUNNING
+
+static void usage(const char* prog) {
+  fprintf(
+    stderr,
+    "usage: %s [-f] [-x factor] [-b disk|raw] [-o target] [-k] trace\n", prog
+  );
+}
+
+int main(int argc, char** argv) {
+  bool fast = false;
+  double factor = 1;
+  bool raw = false;
+  char* target = "sfs_replay.sfs";
+  bool keep = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "fx:b:o:k")) != -1) {
+    switch (opt) {
+      case 'f':
+        fast = true;
+        break;
+      case 'x':
+        factor = atof(optarg);
+        break;
+      case 'b':
+        if (strcmp(optarg, "raw") == 0) {
+          raw = true;
+        } else if (strcmp(optarg, "disk") != 0) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'o':
+        target = optarg;
+        break;
+      case 'k':
+        keep = true;
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+  if (optind != argc - 1 || factor <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  // TRACE
+  const char* trace_path = argv[optind];
+  FILE* trace = fopen(trace_path, "rb");
+  disk_trace_header header;
+
+  if (trace == NULL) {
+    fprintf(stderr, "%s: can't open %s\n", argv[0], trace_path);
+    return 1;
+  }
+  if (fread(&header, sizeof(header), 1, trace) != 1
+      || header.magic != DISK_TRACE_MAGIC) {
+    fprintf(
+      stderr, "%s: %s isn't a trace (or is from a host of the other byte "
+      "order)\n", argv[0], trace_path
+    );
+    return 1;
+  }
+  if (header.version != DISK_TRACE_VERSION) {
+    fprintf(
+      stderr, "%s: %s is a version %u trace, this is version %d\n", argv[0],
+      trace_path, header.version, DISK_TRACE_VERSION
+    );
+    return 1;
+  }
+  block_size = header.block_size;
+
+  // BACKEND
+  if (raw) {
+    raw_fd = open(target, O_RDWR | O_CREAT, 0644);
+    if (raw_fd < 0) {
+      fprintf(stderr, "%s: can't open %s\n", argv[0], target);
+      return 1;
+    }
+  } else {
+    disk = keep
+      ? init_disk_r(target, header.block_size, header.num_blocks)
+      : init_fresh_disk_r(target, header.block_size, header.num_blocks);
+    if (disk == NULL) {
+      return 1;
+    }
+  }
+
+  // REPLAY
+  disk_trace_record rec;
+  op_result results[2];
+  size_t buf_len = (size_t)UINT16_MAX * block_size;
+  char* write_buf = malloc(buf_len);
+  char* read_buf = malloc(buf_len);
+  uint64_t trace_ns = 0, lag_total = 0, lag_max = 0;
+  uint64_t failed = 0;
+
+  memset(results, 0, sizeof(results));
+  memset(write_buf, 'R', buf_len);
+  uint64_t start = now_ns();
+  while (fread(&rec, sizeof(rec), 1, trace) == 1) {
+    if (rec.op != DISK_TRACE_READ && rec.op != DISK_TRACE_WRITE) {
+      fprintf(stderr, "%s: bad record in %s\n", argv[0], trace_path);
+      return 1;
+    }
+    trace_ns = rec.ns;
+
+    uint64_t due = start + (uint64_t)(rec.ns / factor);
+    uint64_t issued = now_ns();
+    if (!fast) {
+      if (issued < due) {
+        sleep_until(due);
+        issued = now_ns();
+      } else {
+        lag_total += issued - due;
+        lag_max = issued - due > lag_max ? issued - due : lag_max;
+      }
+    }
+
+    failed += issue(&rec, rec.op == DISK_TRACE_WRITE ? write_buf : read_buf)
+      < 0;
+    record(&results[rec.op], &rec, now_ns() - issued);
+  }
+  double seconds = (now_ns() - start) / 1e9;
+  uint64_t calls = results[0].calls + results[1].calls;
+
+  fclose(trace);
+  if (disk != NULL) {
+    close_disk_r(disk);
+    if (!keep) {
+      unlink(target);
+    }
+  } else {
+    close(raw_fd);
+  }
+
+  printf(
+    "{\"trace\": \"%s\", \"backend\": \"%s\", \"pace\": ", trace_path,
+    raw ? "raw" : "disk"
+  );
+  if (fast) {
+    printf("null,\n");
+  } else {
+    printf("%g,\n", factor);
+  }
+  printf(
+    " \"block_size\": %u, \"num_blocks\": %u, \"calls\": %llu, "
+    "\"failed\": %llu,\n"
+    " \"trace_seconds\": %.6f, \"seconds\": %.6f, "
+    "\"lag_ns\": {\"mean\": %llu, \"max\": %llu},\n",
+    header.block_size, header.num_blocks, (unsigned long long)calls,
+    (unsigned long long)failed, trace_ns / 1e9, seconds,
+    (unsigned long long)(calls > 0 ? lag_total / calls : 0),
+    (unsigned long long)lag_max
+  );
+  print_op("reads", &results[DISK_TRACE_READ], seconds, false);
+  print_op("writes", &results[DISK_TRACE_WRITE], seconds, true);
+  printf("}\n");
+
+  free(write_buf);
+  free(read_buf);
+  free(results[0].latencies);
+  free(results[1].latencies);
+
+  return failed > 0;
+}
@@ -0,0 +1,904 @@
+// sfs_test3: checks what the features past the original assignment promise,
+// end to end on a scratch image. `make test3` builds and runs it.
+//
+//   sfs_test3
+//
+// Prints a line for every check that fails and exits with the number of them
+// (0 if everything passed). sfs_api.c is compiled into this file, like
+// sfs_micro.c, so the checks can look at its tables and damage images through
+// its internals.
+
+#include "sfs_api.c"
+#include "sfs_async.h"
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#define IMAGE "sfs_test3.sfs"
+#define IMAGE2 "sfs_test3b.sfs" // for the tests that need two images
+
+static int errors = 0;
+
+static void check(bool ok, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "ERROR: %s\n", what);
+    errors++;
+  }
+}
+
+// len bytes of a pattern seeded by seed, different for every seed
+static void fill(char* buf, int len, int seed) {
+  for (int i = 0; i < len; i++) {
+    buf[i] = (char)(seed * 31 + i * 7 + i / BLOCK_SIZE);
+  }
+}
+
+// whether the file holds exactly the len bytes in want
+static bool holds(sfs_t* fs, const char* name, const char* want, int len) {
+  char* got = malloc(len + 1);
+  int nth_inode = sfs_lookup_r(fs, name);
+  bool same = nth_inode != -1
+    && sfs_inode_size_r(fs, nth_inode) == len
+    && sfs_pread_inode_r(fs, nth_inode, got, len + 1, 0) == len
+    && memcmp(got, want, len) == 0;
+
+  free(got);
+
+  return same;
+}
+
+// creates the file holding len bytes of buf, returns its i-node or -1
+static int make_file(sfs_t* fs, const char* name, const char* buf, int len) {
+  int nth_inode = sfs_create_r(fs, name);
+
+  if (
+    nth_inode == -1 || sfs_pwrite_inode_r(fs, nth_inode, buf, len, 0) != len
+  ) {
+    return -1;
+  }
+
+  return nth_inode;
+}
+
+// data blocks marked used in the bitmap, once the delayed ones have places
+static int blocks_used(sfs_t* fs) {
+  int used = 0;
+
+  sfs_sync_r(fs);
+
+  for (int i = 0; i < NUM_FREE_BITMAP_ROWS; i++) {
+    used += __builtin_popcountll(fs->free_block_list[i]);
+  }
+
+  return used;
+}
+
+static int fsck_problems(sfs_t* fs, int flags, sfs_fsck_report* report) {
+  return sfs_fsck_r(fs, flags, 4, report);
+}
+
+static sfs_t* remount(sfs_t* fs) {
+  sfs_unmount(fs);
+
+  return sfs_mount(IMAGE, 0);
+}
+
+// SPARSE FILES
+// Seeking past the end and writing leaves a hole that reads back as zeros and
+// takes no blocks.
+static void test_holes() {
+  sfs_t* fs = sfs_mount(IMAGE, 1);
+  char want[20 * BLOCK_SIZE], tail[100];
+
+  fill(tail, sizeof(tail), 0);
+  memset(want, 0, sizeof(want));
+  memcpy(want + sizeof(want) - sizeof(tail), tail, sizeof(tail));
+
+  int before = blocks_used(fs);
+  int fileID = sfs_fopen_r(fs, "sparse");
+  sfs_fseek_r(fs, fileID, sizeof(want) - sizeof(tail));
+  sfs_fwrite_r(fs, fileID, tail, sizeof(tail));
+  check(blocks_used(fs) == before + 1, "hole took blocks");
+  check(holds(fs, "sparse", want, sizeof(want)), "hole doesn't read as zeros");
+  check(blocks_used(fs) == before + 1, "reading a hole took blocks");
+
+  // filling part of the hole takes just the blocks written
+  fill(want + 3 * BLOCK_SIZE, BLOCK_SIZE, 1);
+  sfs_pwrite_r(fs, fileID, want + 3 * BLOCK_SIZE, BLOCK_SIZE, 3 * BLOCK_SIZE);
+  check(blocks_used(fs) == before + 2, "filling a hole took extra blocks");
+
+  fs = remount(fs);
+  check(
+    holds(fs, "sparse", want, sizeof(want)), "sparse file changed by remount"
+  );
+  sfs_unmount(fs);
+}
+
+// INLINE FILES
+// Small files stay in the i-node until they outgrow it.
+static void test_inline() {
+  sfs_t* fs = sfs_mount(IMAGE, 1);
+  char small[100 + 2 * BLOCK_SIZE];
+
+  fill(small, sizeof(small), 2);
+
+  int before = blocks_used(fs);
+  int nth_inode = make_file(fs, "small", small, 100);
+  check(
+    fs->inode_table[nth_inode].flags & INODE_INLINE, "small file isn't inline"
+  );
+  check(blocks_used(fs) == before, "inline file took blocks");
+  check(holds(fs, "small", small, 100), "inline file reads back wrong");
+
+  fs = remount(fs);
+  check(holds(fs, "small", small, 100), "inline file changed by remount");
+
+  int fileID = sfs_fopen_r(fs, "small");
+  sfs_pwrite_r(fs, fileID, small + 100, 2 * BLOCK_SIZE, 100);
+  check(
+    !(fs->inode_table[nth_inode].flags & INODE_INLINE),
+    "file that outgrew the i-node is still inline"
+  );
+  check(
+    holds(fs, "small", small, sizeof(small)), "file lost bytes moving out"
+  );
+  sfs_unmount(fs);
+}
+
+// COMPRESSION
+// Repetitive data packs into fewer blocks and reads back the same, data that
+// doesn't shrink is stored plain.
+static void test_compression() {
+  sfs_t* fs = sfs_mount(IMAGE, 1);
+  char packed[16 * BLOCK_SIZE], plain[8 * BLOCK_SIZE];
+  sfs_compress_stats compress;
+
+  sfs_set_compression_r(fs, 1);
+  memset(packed, 'z', sizeof(packed));
+  for (int i = 0; i < (int)sizeof(plain); i++) {
+    plain[i] = (char)(i * 2654435761u >> 13); // nothing for the codec to find
+  }
+
+  int before = blocks_used(fs);
+  int nth_inode = make_file(fs, "packed", packed, sizeof(packed));
+  check(
+    fs->inode_table[nth_inode].flags & INODE_COMPRESSED,
+    "file made with compression on isn't compressed"
+  );
+  sfs_get_compress_stats_r(fs, &compress);
+  check(compress.clusters_packed > 0, "repetitive file wasn't compressed");
+  check(
+    blocks_used(fs) - before < (int)sizeof(packed) / BLOCK_SIZE,
+    "compressed file takes as many blocks as a plain one"
+  );
+  check(holds(fs, "packed", packed, sizeof(packed)), "compressed file wrong");
+
+  make_file(fs, "plain", plain, sizeof(plain));
+  check(holds(fs, "plain", plain, sizeof(plain)), "incompressible file wrong");
+
+  fs = remount(fs);
+  check(
+    holds(fs, "packed", packed, sizeof(packed)),
+    "compressed file changed by remount"
+  );
+  check(
+    holds(fs, "plain", plain, sizeof(plain)),
+    "incompressible file changed by remount"
+  );
+  sfs_unmount(fs);
+}
+
+// flips a byte of the block at addr in the unmounted image at path
+static void corrupt_block(const char* path, int addr) {
+  FILE* image = fopen(path, "r+b");
+
+  fseek(image, (long)addr * BLOCK_SIZE + 5, SEEK_SET);
+  int c = fgetc(image);
+  fseek(image, (long)addr * BLOCK_SIZE + 5, SEEK_SET);
+  fputc(c ^ 0xff, image);
+  fclose(image);
+}
+
+// CHECKSUMS
+// A block changed on disk fails its checksum, and reading it stops short
+// instead of handing out the corrupt bytes. Damaged tables keep the image from
+// mounting at all.
+static void test_checksums() {
+  sfs_t* fs = sfs_mount(IMAGE, 1);
+  char data[3 * BLOCK_SIZE], got[3 * BLOCK_SIZE];
+
+  fill(data, sizeof(data), 3);
+
+  int nth_inode = make_file(fs, "crc", data, sizeof(data));
+  sfs_sync_r(fs); // gives the blocks their places
+  int addr = fs->inode_table[nth_inode].direct[1];
+  check(holds(fs, "crc", data, sizeof(data)), "file reads back wrong");
+
+  sfs_unmount(fs);
+  corrupt_block(IMAGE, addr);
+  fs = sfs_mount(IMAGE, 0);
+  int fileID = sfs_fopen_r(fs, "crc");
+  check(
+    sfs_pread_r(fs, fileID, got, sizeof(got), 0) == BLOCK_SIZE,
+    "read didn't stop at the corrupt block"
+  );
+  check(memcmp(got, data, BLOCK_SIZE) == 0, "good block read back wrong");
+  sfs_unmount(fs);
+
+  corrupt_block(IMAGE, 0); // the superblock
+  fs = sfs_mount(IMAGE, 0);
+  check(fs == NULL, "image with a corrupt superblock mounted");
+  sfs_unmount(fs);
+}
+
+#define STRESS_THREADS 4
+#define STRESS_ROUNDS 30
+
+static char shared_data[6 * BLOCK_SIZE];
+
+typedef struct {
+  sfs_t* fs;
+  int seed;
+} stress_arg;
+
+// one stress thread: churns through its own files while reading the shared one,
+// returns (through the pointer) how many checks failed
+static void* stress_thread(void* arg) {
+  sfs_t* fs = ((stress_arg*)arg)->fs;
+  int seed = ((stress_arg*)arg)->seed;
+  char name[MAXFILENAME], data[5 * BLOCK_SIZE], got[6 * BLOCK_SIZE];
+  int shared = sfs_fopen_r(fs, "shared");
+  intptr_t failed = 0;
+
+  fill(data, sizeof(data), seed);
+  for (int round = 0; round < STRESS_ROUNDS; round++) {
+    snprintf(name, sizeof(name), "t%d_%d", seed, round);
+    int fileID = sfs_fopen_r(fs, name);
+    // out of order and overlapping, so blocks get allocated mid-file
+    for (int i = 4; i >= 0; i--) {
+      failed += sfs_pwrite_r(fs, fileID, data + i * BLOCK_SIZE, BLOCK_SIZE + 10,
+        i * BLOCK_SIZE) != BLOCK_SIZE + 10;
+    }
+    failed += sfs_pread_r(fs, fileID, got, sizeof(got), 0) != sizeof(data) + 10
+      || memcmp(got, data, sizeof(data)) != 0;
+    failed += sfs_pread_r(fs, shared, got, sizeof(got), 0)
+      != sizeof(shared_data)
+      || memcmp(got, shared_data, sizeof(shared_data)) != 0;
+    sfs_fclose_r(fs, fileID);
+    // keep every other file, so removes and allocations interleave
+    if (round % 2 == 0) {
+      failed += sfs_remove_r(fs, name) != 0;
+    }
+  }
+
+  return (void*)failed;
+}
+
+// THREADS
+// Threads creating, writing, reading and removing files at once, half of them
+// on one image and half on another, see only their own data and leave the
+// tables consistent. Clean under ThreadSanitizer (build with CFLAGS/LDFLAGS
+// += -fsanitize=thread).
+static void test_threads() {
+  sfs_t* fs[2] = { sfs_mount(IMAGE, 1), sfs_mount(IMAGE2, 1) };
+  pthread_t threads[STRESS_THREADS];
+  stress_arg args[STRESS_THREADS];
+  char data[5 * BLOCK_SIZE], got[5 * BLOCK_SIZE], name[MAXFILENAME];
+  int before[2];
+  void* failed;
+
+  fill(shared_data, sizeof(shared_data), 9);
+  for (int i = 0; i < 2; i++) {
+    make_file(fs[i], "shared", shared_data, sizeof(shared_data));
+    before[i] = blocks_used(fs[i]);
+  }
+
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    args[t] = (stress_arg){ fs[t % 2], 10 + t };
+    pthread_create(&threads[t], NULL, stress_thread, &args[t]);
+  }
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    pthread_join(threads[t], &failed);
+    check(failed == NULL, "stress thread saw the wrong data");
+  }
+
+  for (int i = 0; i < 2; i++) {
+    sfs_unmount(fs[i]);
+    fs[i] = sfs_mount(i == 0 ? IMAGE : IMAGE2, 0);
+  }
+  // the kept files are intact and hold 6 blocks each, the removed ones none,
+  // and nothing one image did shows up in the other
+  for (int t = 0; t < STRESS_THREADS; t++) {
+    fill(data, sizeof(data), 10 + t);
+    for (int round = 1; round < STRESS_ROUNDS; round += 2) {
+      snprintf(name, sizeof(name), "t%d_%d", 10 + t, round);
+      int fileID = sfs_fopen_r(fs[t % 2], name);
+      check(
+        sfs_pread_r(fs[t % 2], fileID, got, sizeof(got), 0) == sizeof(got)
+          && memcmp(got, data, sizeof(got)) == 0,
+        "file kept by a stress thread is wrong"
+      );
+      check(
+        sfs_getfilesize_r(fs[(t + 1) % 2], name) == 0,
+        "file shows up in the other image"
+      );
+    }
+  }
+  for (int i = 0; i < 2; i++) {
+    check(
+      blocks_used(fs[i]) - before[i]
+        == STRESS_THREADS / 2 * (STRESS_ROUNDS / 2) * 6,
+      "stress run leaked or lost blocks"
+    );
+    sfs_unmount(fs[i]);
+  }
+}
+
+// reads nblocks at addr straight from the image file, past the flusher and
+// without touching the emulator's state it may be changing
+static void read_image(const char* path, int addr, int nblocks, void* buf) {
+  FILE* image = fopen(path, "rb");
+
+  fseek(image, (long)addr * BLOCK_SIZE, SEEK_SET);
+  fread(buf, BLOCK_SIZE, nblocks, image);
+  fclose(image);
+}
+
+// copies the file's i-node as it is on disk right now
+static void inode_on_disk(int nth_inode, inode* file_inode) {
+  static inode table[NUM_INODE_BLOCKS * BLOCK_SIZE / sizeof(inode) + 1];
+
+  read_image(IMAGE, 1, NUM_INODE_BLOCKS, table);
+  *file_inode = table[nth_inode];
+}
+
+// whether every block the i-node on disk points at already holds its data
+static bool pointers_hold_data(inode* file_inode, const char* want) {
+  char block_buf[BLOCK_SIZE];
+
+  for (int i = 0; i < 12; i++) {
+    if (file_inode->direct[i] == 0) {
+      continue;
+    }
+    read_image(IMAGE, file_inode->direct[i], 1, block_buf);
+    if (memcmp(block_buf, want + i * BLOCK_SIZE, BLOCK_SIZE) != 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// WRITEBACK
+// Writes stay in memory until they come of age or sync asks for them, and the
+// flusher puts data on disk before the i-node that points at it, so the image
+// never has a pointer to a block that hasn't been written.
+static void test_writeback() {
+  sfs_t* fs = sfs_mount(IMAGE, 1);
+  char data[8 * BLOCK_SIZE];
+  inode on_disk;
+  struct timespec pause = { 0, 5 * 1000 * 1000 };
+
+  sfs_set_writeback_r(fs, 256, 200);
+  fill(data, sizeof(data), 30);
+  int fileID = sfs_fopen_r(fs, "late");
+  int nth_inode = fs->fdt[fileID].inode;
+  sfs_pwrite_r(fs, fileID, data, 4 * BLOCK_SIZE, 0);
+  inode_on_disk(nth_inode, &on_disk);
+  check(on_disk.size == 0, "write reached the disk before it came of age");
+
+  // a second batch while the first is aging, watched until both are out
+  nanosleep(&pause, NULL);
+  sfs_pwrite_r(fs, fileID, data + 4 * BLOCK_SIZE, 4 * BLOCK_SIZE,
+    4 * BLOCK_SIZE);
+  bool ordered = true;
+  for (int i = 0; i < 200 && on_disk.size < sizeof(data); i++) {
+    nanosleep(&pause, NULL);
+    inode_on_disk(nth_inode, &on_disk);
+    ordered &= pointers_hold_data(&on_disk, data);
+  }
+  check(ordered, "i-node reached the disk before its data");
+  check(on_disk.size == sizeof(data), "flusher didn't write aged blocks");
+
+  // sync doesn't wait for anything to age
+  sfs_set_writeback_r(fs, 256, 60000);
+  memset(data, 'y', BLOCK_SIZE);
+  sfs_pwrite_r(fs, fileID, data, BLOCK_SIZE, 0);
+  sfs_sync_r(fs);
+  inode_on_disk(nth_inode, &on_disk);
+  check(pointers_hold_data(&on_disk, data), "sync left blocks in memory");
+
+  // and write-through doesn't need it
+  sfs_set_writeback_r(fs, 0, 0);
+  memset(data, 'x', BLOCK_SIZE);
+  sfs_pwrite_r(fs, fileID, data, BLOCK_SIZE, 0);
+  check(
+    pointers_hold_data(&on_disk, data), "write-through write isn't on disk"
+  );
+  sfs_unmount(fs);
+}
+
+#define AIO_WRITES 32
+
+typedef struct {
+  int done; // callbacks run
+  int failed; // of them, with a result other than the one expected
+  int want; // the result expected
+} aio_count;
+
+static void aio_counted(void* arg, int result) {
+  aio_count* count = arg;
+
+  __atomic_fetch_add(&count->done, 1, __ATOMIC_RELAXED);
+  if (result != count->want) {
+    __atomic_fetch_add(&count->failed, 1, __ATOMIC_RELAXED);
+  }
+}
+
+typedef struct {
+  int done;
+  int result;
+} aio_one;
+
+static void aio_got(void* arg, int result) {
+  aio_one* one = arg;
+
+  one->result = result;
+  one->done = 1;
+}
+
+// dispatches completions as they come until done reaches n (or ~5 s pass)
+static void aio_wait(sfs_aio* aio, int* done, int n) {
+  struct pollfd ready = { sfs_aio_fd(aio), POLLIN, 0 };
+
+  for (int i = 0; i < 500 && *done < n; i++) {
+    poll(&ready, 1, 10);
+    sfs_aio_dispatch(aio);
+  }
+}
+
+// ASYNC API
+// Every request completes exactly once with what the blocking call would have
+// returned, callbacks run where they're asked to, and destroying the pool
+// drains whatever is still in flight.
+static void test_async() {
+  sfs_t* fs = sfs_mount(IMAGE, 1);
+  char data[AIO_WRITES * BLOCK_SIZE], got[AIO_WRITES * BLOCK_SIZE];
+  aio_count writes = { 0, 0, BLOCK_SIZE };
+  aio_one opened = { 0, -1 }, synced = { 0, -1 };
+
+  fill(data, sizeof(data), 40);
+  sfs_aio* aio = sfs_aio_create(fs, 4, 0);
+  sfs_open_async(aio, "async", aio_got, &opened);
+  aio_wait(aio, &opened.done, 1);
+  check(opened.result >= 0, "async open didn't complete");
+  int fileID = opened.result;
+
+  for (int i = AIO_WRITES - 1; i >= 0; i--) {
+    sfs_write_async(aio, fileID, data + i * BLOCK_SIZE, BLOCK_SIZE,
+      i * BLOCK_SIZE, aio_counted, &writes);
+  }
+  aio_wait(aio, &writes.done, AIO_WRITES);
+  check(writes.done == AIO_WRITES, "async writes didn't all complete");
+  check(writes.failed == 0, "async write returned the wrong length");
+
+  sfs_sync_async(aio, aio_got, &synced);
+  sfs_aio_destroy(aio); // runs the sync's callback before returning
+  check(
+    synced.done && synced.result == 0, "destroy didn't drain a pending sync"
+  );
+
+  // callbacks on the workers, the fd stays quiet
+  aio_count reads = { 0, 0, BLOCK_SIZE };
+  aio = sfs_aio_create(fs, 4, SFS_AIO_WORKER_CALLBACKS);
+  for (int i = 0; i < AIO_WRITES; i++) {
+    sfs_read_async(aio, fileID, got + i * BLOCK_SIZE, BLOCK_SIZE,
+      i * BLOCK_SIZE, aio_counted, &reads);
+  }
+  sfs_aio_destroy(aio);
+  check(reads.done == AIO_WRITES, "destroy didn't drain pending reads");
+  check(reads.failed == 0, "async read returned the wrong length");
+  check(memcmp(got, data, sizeof(data)) == 0, "async reads got wrong data");
+  sfs_unmount(fs);
+}
+
+// ALLOCATION GROUPS
+// A file's blocks land in its home group (i-node number mod NUM_ALLOC_GROUPS),
+// and each group's free count follows the bitmap.
+static void test_groups() {
+  sfs_t* fs = sfs_mount(IMAGE, 1);
+  char data[20 * BLOCK_SIZE], name[MAXFILENAME];
+  int nth_inodes[NUM_ALLOC_GROUPS + 2];
+
+  fill(data, sizeof(data), 50);
+  // written a block at a time, round robin, so they'd interleave in one pool
+  for (int i = 0; i < 20; i++) {
+    for (int f = 0; f < NUM_ALLOC_GROUPS + 2; f++) {
+      snprintf(name, sizeof(name), "g%d", f);
+      int fileID = sfs_fopen_r(fs, name);
+      sfs_pwrite_r(fs, fileID, data + i * BLOCK_SIZE, BLOCK_SIZE,
+        i * BLOCK_SIZE);
+      nth_inodes[f] = fs->fdt[fileID].inode;
+    }
+  }
+
+  sfs_sync_r(fs); // gives the blocks their places
+  bool at_home = true;
+  for (int f = 0; f < NUM_ALLOC_GROUPS + 2; f++) {
+    inode* file_inode = &fs->inode_table[nth_inodes[f]];
+
+    for (int i = 0; i < 20; i++) {
+      int addr = *get_block_ptr(file_inode, i);
+      at_home &= (addr - DATA_BLOCKS_ADDR) / GROUP_BLOCKS
+        == nth_inodes[f] % NUM_ALLOC_GROUPS;
+    }
+    snprintf(name, sizeof(name), "g%d", f);
+    check(holds(fs, name, data, sizeof(data)), "grouped file reads back wrong");
+  }
+  check(at_home, "block outside its file's home group");
+
+  int free_blocks = 0;
+  for (int group = 0; group < NUM_ALLOC_GROUPS; group++) {
+    free_blocks += fs->group_free[group];
+  }
+  check(
+    free_blocks == MAX_BLOCKS_ALL_FILES - blocks_used(fs),
+    "group free counts don't match the bitmap"
+  );
+  sfs_unmount(fs);
+}
+
+#define DIR_FILES 60
+
+// DIRECTORY LISTING
+// A listing picks up from its cookie wherever it stopped: with files removed
+// between calls, and with another listing going on at the same time, every
+// file that stays is listed exactly once, with its size.
+static void test_readdir() {
+  sfs_t* fs = sfs_mount(IMAGE, 1);
+  char data[DIR_FILES], name[MAXFILENAME];
+  int seen[2][DIR_FILES] = { { 0 } };
+  int cookie[2] = { SFS_DIR_START, SFS_DIR_START };
+  bool done[2] = { false, false }, sizes_right = true;
+  sfs_dirent entry;
+
+  fill(data, sizeof(data), 60);
+  for (int i = 0; i < DIR_FILES; i++) {
+    snprintf(name, sizeof(name), "d%d", i);
+    make_file(fs, name, data, i + 1);
+  }
+
+  // two listings, 3 and 7 entries at a time. The first removes the files
+  // d0, d3, d6, ... as it passes them, and between batches a file from
+  // d1, d4, d7, ... goes too, most likely ahead of both. d2, d5, d8, ...
+  // stay put.
+  for (int step = 0; !done[0] || !done[1]; step++) {
+    for (int l = 0; l < 2; l++) {
+      for (int n = 0; n < 3 + l * 4 && !done[l]; n++) {
+        int next = sfs_readdir_r(fs, cookie[l], &entry);
+
+        if (next == 0) {
+          done[l] = true;
+          break;
+        }
+        cookie[l] = next;
+
+        int i = atoi(entry.name + 1);
+        seen[l][i]++;
+        sizes_right &= entry.size == (unsigned int)i + 1;
+        if (l == 0 && i % 3 == 0) {
+          sfs_remove_r(fs, entry.name);
+        }
+      }
+    }
+    if (3 * step + 1 < DIR_FILES) {
+      snprintf(name, sizeof(name), "d%d", 3 * step + 1);
+      sfs_remove_r(fs, name);
+    }
+  }
+
+  bool once = true;
+  for (int i = 2; i < DIR_FILES; i += 3) {
+    once &= seen[0][i] == 1 && seen[1][i] == 1;
+  }
+  for (int i = 0; i < DIR_FILES; i++) {
+    once &= seen[0][i] <= 1 && seen[1][i] <= 1;
+  }
+  check(once, "listing skipped or repeated a file across removes");
+  check(sizes_right, "listing gave a wrong size");
+  sfs_unmount(fs);
+}
+
+// CLONES
+// A clone reads like its source, each side's writes stay its own, and fsck
+// counts the blocks they share instead of calling them cross links.
+static void test_clones() {
+  sfs_t* fs = sfs_mount(IMAGE, 1);
+  char a[20 * BLOCK_SIZE], b[20 * BLOCK_SIZE];
+  sfs_fsck_report report;
+
+  fill(a, sizeof(a), 1);
+  make_file(fs, "orig", a, sizeof(a));
+  check(sfs_clone_r(fs, "orig", "copy") != -1, "clone failed");
+  check(holds(fs, "copy", a, sizeof(a)), "clone doesn't match its source");
+
+  // each side's writes stay its own
+  memcpy(b, a, sizeof(b));
+  memset(b + 5 * BLOCK_SIZE, 'c', 100);
+  sfs_pwrite_inode_r(
+    fs, sfs_lookup_r(fs, "copy"), b + 5 * BLOCK_SIZE, 100, 5 * BLOCK_SIZE
+  );
+  check(holds(fs, "orig", a, sizeof(a)), "write to a clone reached source");
+  check(holds(fs, "copy", b, sizeof(b)), "write to a clone was lost");
+
+  fs = remount(fs);
+  check(holds(fs, "orig", a, sizeof(a)), "clone source changed by remount");
+  check(holds(fs, "copy", b, sizeof(b)), "clone changed by remount");
+  check(fsck_problems(fs, 0, &report) == 0, "fsck complains about a clone");
+  check(report.shared_blocks > 0, "fsck doesn't count a clone's blocks");
+  sfs_unmount(fs);
+}
+
+// DEDUP
+// Blocks with equal contents end up shared, in whole files or parts of them,
+// and a write to one is copied like a clone's.
+static void test_dedup() {
+  sfs_t* fs = sfs_mount(IMAGE, 1);
+  char a[8 * BLOCK_SIZE], b[8 * BLOCK_SIZE];
+  sfs_dedup_report dedup;
+  sfs_fsck_report report;
+
+  fill(a, sizeof(a), 2);
+  fill(b, sizeof(b), 3);
+  memcpy(b + 4 * BLOCK_SIZE, a, 4 * BLOCK_SIZE); // half of b is a's start
+  make_file(fs, "a", a, sizeof(a));
+  make_file(fs, "b", b, sizeof(b));
+  make_file(fs, "a2", a, sizeof(a));
+
+  sfs_dedup_r(fs, 0, &dedup);
+  check(dedup.merged_blocks == 12, "dedup didn't merge the equal blocks");
+  check(holds(fs, "a", a, sizeof(a)), "dedup changed a file");
+  check(holds(fs, "b", b, sizeof(b)), "dedup changed a partly equal file");
+
+  // a merged block is copied again on write
+  memset(a, 'x', BLOCK_SIZE);
+  sfs_pwrite_inode_r(fs, sfs_lookup_r(fs, "a"), a, BLOCK_SIZE, 0);
+  check(holds(fs, "a", a, sizeof(a)), "write to a merged block was lost");
+  check(!holds(fs, "a2", a, sizeof(a)), "write to a merged block spread");
+
+  fs = remount(fs);
+  check(holds(fs, "a", a, sizeof(a)), "deduped file changed by remount");
+  check(holds(fs, "b", b, sizeof(b)), "deduped file changed by remount");
+  check(fsck_problems(fs, 0, &report) == 0, "fsck complains after dedup");
+  sfs_unmount(fs);
+}
+
+// DEFRAG
+// A file whose blocks interleave with another's comes out in one extent, with
+// its data and its neighbour's unchanged.
+static void test_defrag() {
+  sfs_t* fs = sfs_mount(IMAGE, 1);
+  char a[16 * BLOCK_SIZE], b[16 * BLOCK_SIZE];
+  sfs_fsck_report report;
+  int nblocks;
+
+  // i-nodes 1 and 17 share an allocation group, so their blocks written in
+  // turns interleave (given places as they're written)
+  char name[MAXFILENAME + 1];
+  sfs_set_writeback_r(fs, 0, 0);
+  for (int i = 1; i <= 17; i++) {
+    sprintf(name, "f%d", i);
+    sfs_create_r(fs, name);
+  }
+  fill(a, sizeof(a), 4);
+  fill(b, sizeof(b), 5);
+  for (int i = 0; i < 16; i++) {
+    int offset = i * BLOCK_SIZE;
+
+    sfs_pwrite_inode_r(fs, 1, a + offset, BLOCK_SIZE, offset);
+    sfs_pwrite_inode_r(fs, 17, b + offset, BLOCK_SIZE, offset);
+  }
+  check(
+    file_extents(&fs->inode_table[1], NULL, &nblocks) > 1,
+    "test file didn't come out fragmented"
+  );
+
+  check(sfs_defrag_inode_r(fs, 1) == 1, "defrag didn't make one extent");
+  check(holds(fs, "f1", a, sizeof(a)), "defrag changed the file");
+  check(holds(fs, "f17", b, sizeof(b)), "defrag changed its neighbour");
+
+  fs = remount(fs);
+  check(holds(fs, "f1", a, sizeof(a)), "defragged file changed by remount");
+  check(fsck_problems(fs, 0, &report) == 0, "fsck complains after defrag");
+  sfs_unmount(fs);
+}
+
+// IMAGE BUILDER
+// A built image mounts with every file in one extent, and SFS_TRACE, which is
+// for mounts, doesn't start a trace while it's built.
+static void test_mkimage() {
+  char a[8 * BLOCK_SIZE], b[100];
+  sfs_fsck_report report;
+  int nblocks;
+
+  fill(a, sizeof(a), 6);
+  fill(b, sizeof(b), 7);
+  unlink("sfs_test3.trace");
+  setenv("SFS_TRACE", "sfs_test3.trace", 1);
+  sfs_builder* builder = sfs_build_start(IMAGE);
+  int nth_a = sfs_build_add(builder, "a", a, sizeof(a));
+  check(sfs_build_add(builder, "b", b, sizeof(b)) != -1, "build_add failed");
+  check(sfs_build_add(builder, "a", b, sizeof(b)) == -1, "built a name twice");
+  sfs_build_finish(builder);
+  unsetenv("SFS_TRACE");
+  check(access("sfs_test3.trace", F_OK) != 0, "building started a trace");
+  unlink("sfs_test3.trace");
+
+  sfs_t* fs = sfs_mount(IMAGE, 0);
+  check(fs != NULL, "built image doesn't mount");
+  if (fs == NULL) {
+    return;
+  }
+  check(holds(fs, "a", a, sizeof(a)), "built file lost its data");
+  check(holds(fs, "b", b, sizeof(b)), "built inline file lost its data");
+  check(
+    file_extents(&fs->inode_table[nth_a], NULL, &nblocks) == 1,
+    "built file isn't in one extent"
+  );
+  check(
+    fsck_problems(fs, 0, &report) == 0, "fsck complains about a built image"
+  );
+  sfs_unmount(fs);
+}
+
+// DELAYED ALLOCATION
+// Blocks get their places when they're written out, so a file written in
+// small pieces still lands in one run.
+static void test_delayed() {
+  sfs_t* fs = sfs_mount(IMAGE, 1);
+  char big[40 * BLOCK_SIZE];
+  sfs_fsck_report report;
+  int nblocks;
+
+  sfs_set_writeback_r(fs, 256, 60000); // nothing goes out unless asked
+  fill(big, sizeof(big), 8);
+  int nth_big = sfs_create_r(fs, "big");
+  for (int i = 0; i < 40; i++) {
+    sfs_pwrite_inode_r(
+      fs, nth_big, big + i * BLOCK_SIZE, BLOCK_SIZE, i * BLOCK_SIZE
+    );
+  }
+  check(
+    is_delayed(fs->inode_table[nth_big].direct[0]), "new block wasn't delayed"
+  );
+  check(holds(fs, "big", big, sizeof(big)), "delayed blocks read back wrong");
+  check(sfs_sync_r(fs) == 0, "sync failed");
+  check(
+    file_extents(&fs->inode_table[nth_big], NULL, &nblocks) == 1,
+    "delayed blocks weren't placed in one run"
+  );
+
+  fs = remount(fs);
+  check(holds(fs, "big", big, sizeof(big)), "delayed blocks lost on unmount");
+  check(fsck_problems(fs, 0, &report) == 0, "fsck complains after writes");
+  sfs_unmount(fs);
+}
+
+// DISK FULL
+// A delayed block that can't be placed keeps its data and its promise: sync
+// says so, and fsck refuses to check (or repair) rather than take the block
+// for a bad pointer.
+static void test_full() {
+  sfs_t* fs = sfs_mount(IMAGE, 1);
+  char data[2 * BLOCK_SIZE];
+  static int grabbed[MAX_BLOCKS_ALL_FILES];
+  int ngrabbed = 0;
+  int addr;
+  sfs_fsck_report report;
+
+  sfs_set_writeback_r(fs, 256, 60000);
+  fill(data, sizeof(data), 9);
+  int nth_inode = make_file(fs, "late", data, sizeof(data));
+
+  // takes every free block past the promises, as a buggy allocation would
+  while ((addr = alloc_run(fs, 1, 0, 1)) != -1) {
+    grabbed[ngrabbed++] = addr;
+  }
+  check(sfs_sync_r(fs) == -1, "sync didn't report unplaced blocks");
+  check(holds(fs, "late", data, sizeof(data)), "unplaced blocks were dropped");
+  check(
+    fsck_problems(fs, SFS_FSCK_REPAIR, &report) == -1,
+    "fsck ran on blocks that have no places"
+  );
+  check(
+    is_delayed(fs->inode_table[nth_inode].direct[0]),
+    "fsck dropped a delayed block"
+  );
+
+  for (int i = 0; i < ngrabbed; i++) {
+    free_from_block_list(fs, grabbed[i]);
+  }
+  write_free_block_list(fs);
+  check(sfs_sync_r(fs) == 0, "sync failed once there was room again");
+  check(
+    fsck_problems(fs, 0, &report) == 0, "fsck complains once blocks are placed"
+  );
+
+  fs = remount(fs);
+  check(holds(fs, "late", data, sizeof(data)), "late placed blocks lost");
+  sfs_unmount(fs);
+}
+
+// CONSISTENCY CHECK
+// Two files that point at the same block without being clones are found and
+// given their own copies. Tables that fail their checksums keep the image from
+// mounting until fsck has rewritten them.
+static void test_fsck() {
+  sfs_t* fs = sfs_mount(IMAGE, 1);
+  char a[4 * BLOCK_SIZE], b[4 * BLOCK_SIZE];
+  sfs_fsck_report report;
+
+  fill(a, sizeof(a), 20);
+  fill(b, sizeof(b), 21);
+  int nth_a = make_file(fs, "a", a, sizeof(a));
+  int nth_b = make_file(fs, "b", b, sizeof(b));
+  check(fsck_problems(fs, 0, &report) == 0, "fsck complains after writes");
+
+  // cross-link b's first block to a's
+  pthread_rwlock_wrlock(&fs->inode_locks[nth_b]);
+  free_from_block_list(fs, fs->inode_table[nth_b].direct[0]);
+  fs->inode_table[nth_b].direct[0] = fs->inode_table[nth_a].direct[0];
+  write_inode(fs, nth_b);
+  pthread_rwlock_unlock(&fs->inode_locks[nth_b]);
+  write_free_block_list(fs);
+  memcpy(b, a, BLOCK_SIZE);
+
+  check(fsck_problems(fs, 0, &report) > 0, "fsck missed a cross-link");
+  check(report.dup_blocks == 1, "cross-link not counted as a dup");
+  fsck_problems(fs, SFS_FSCK_REPAIR, &report);
+  check(report.repaired > 0, "fsck didn't repair the cross-link");
+  check(fsck_problems(fs, 0, &report) == 0, "repaired image isn't clean");
+
+  // the copies are apart now
+  memset(b, 'w', 10);
+  sfs_pwrite_inode_r(fs, nth_b, b, 10, 0);
+  check(holds(fs, "a", a, sizeof(a)), "repaired cross-link still shared");
+  check(holds(fs, "b", b, sizeof(b)), "repaired file lost a write");
+  sfs_unmount(fs);
+
+  corrupt_block(IMAGE, 1); // the first i-node table block
+  check(sfs_mount(IMAGE, 0) == NULL, "image with corrupt tables mounted");
+  fs = sfs_mount_damaged(IMAGE);
+  check(fs != NULL, "fsck can't open an image with corrupt tables");
+  fsck_problems(fs, SFS_FSCK_REPAIR, &report);
+  check(report.checksum_errors == 1, "corrupt table block not reported");
+  sfs_unmount(fs);
+  fs = sfs_mount(IMAGE, 0);
+  check(fs != NULL, "image doesn't mount after fsck repaired it");
+  sfs_unmount(fs);
+}
+
+int main() {
+  test_holes();
+  test_inline();
+  test_compression();
+  test_checksums();
+  test_threads();
+  test_writeback();
+  test_async();
+  test_groups();
+  test_readdir();
+  test_clones();
+  test_dedup();
+  test_defrag();
+  test_mkimage();
+  test_delayed();
+  test_full();
+  test_fsck();
+  unlink(IMAGE);
+  unlink(IMAGE2);
+
+  fprintf(stderr, "Test program exiting with %d errors\n", errors);
+
+  return errors;
+}